@@ -0,0 +1,427 @@
+#define CXXOPTS_NO_REGEX 1
+#include <Tracy.hpp>
+#include <cxxopts.hpp>
+
+#include "buffer_pool.hpp"
+#include "reproject.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+// clang-format off
+#include <windows.h>
+#include <psapi.h>
+// clang-format on
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+struct NamedLens {
+  const char *name;
+  reproject::LensInfo lens;
+};
+
+// One lens of each type, on a square 36 mm sensor. Pairs reproject() does not
+// support are skipped, see supported().
+std::vector<NamedLens> bench_lenses() {
+  std::vector<NamedLens> lenses(3);
+  lenses[0].name = "rectilinear";
+  lenses[0].lens.type = reproject::RECTILINEAR;
+  lenses[0].lens.rectilinear.focal_length = 18.0f;
+  lenses[1].name = "equidistant";
+  lenses[1].lens.type = reproject::FISHEYE_EQUIDISTANT;
+  lenses[1].lens.fisheye_equidistant.fov = float(M_PI);
+  lenses[2].name = "equisolid";
+  lenses[2].lens.type = reproject::FISHEYE_EQUISOLID;
+  lenses[2].lens.fisheye_equisolid.focal_length = 12.5f;
+  lenses[2].lens.fisheye_equisolid.fov = float(M_PI);
+  for (NamedLens &l : lenses) {
+    l.lens.sensor_width = 36.0f;
+    l.lens.sensor_height = 36.0f;
+  }
+  return lenses;
+}
+
+struct NamedLayout {
+  const char *name;
+  reproject::DataLayout layout;
+  int channels;
+};
+
+// clang-format off
+const NamedLayout LAYOUTS[] = {
+  {"rgb",   reproject::RGB,   3},
+  {"rgba",  reproject::RGBA,  4},
+  {"rgbz",  reproject::RGBZ,  4},
+  {"rgbaz", reproject::RGBAZ, 5},
+};
+
+const std::pair<const char *, reproject::Interpolation> INTERPOLATIONS[] = {
+  {"nn", reproject::NEAREST},
+  {"bl", reproject::BILINEAR},
+  {"bc", reproject::BICUBIC},
+  {"tl", reproject::TRILINEAR},
+};
+// clang-format on
+
+std::vector<std::string> split(const std::string &list) {
+  std::vector<std::string> items;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+bool selected(const std::vector<std::string> &list, const std::string &name) {
+  return std::find(list.begin(), list.end(), name) != list.end();
+}
+
+/** Peak resident set size of the process so far, in bytes. */
+size_t peak_rss() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return size_t(usage.ru_maxrss);
+#else
+  return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+/**
+ * Fills img with a smooth pattern with detail at every scale, such that the
+ * kernels read realistic data rather than constants. The depth channel, if
+ * any, is a positive gradient.
+ */
+template <typename T> void fill_synthetic(reproject::Image &img) {
+  T *data = reproject::pixels<T>(img);
+  int ps = reproject::pixel_stride(img);
+  size_t cs = reproject::channel_stride(img);
+  for (int y = 0; y < img.height; ++y) {
+    for (int x = 0; x < img.width; ++x) {
+      float u = float(x) / img.width;
+      float v = float(y) / img.height;
+      T *px = data + (size_t(y) * img.width + x) * ps;
+      for (int c = 0; c < img.channels; ++c) {
+        float value = 0.5f + 0.25f * std::sin((c + 1) * 40.0f * u * u) +
+                      0.25f * std::cos((c + 2) * 30.0f * v * (1.0f + u));
+        if ((img.data_layout == reproject::RGBZ && c == 3) ||
+            (img.data_layout == reproject::RGBAZ && c == 4)) {
+          value = 1.0f + 10.0f * v;
+        }
+        px[c * cs] = T(value);
+      }
+    }
+  }
+}
+
+bool supported(const reproject::LensInfo &in, const reproject::LensInfo &out) {
+  try {
+    reproject::build_reprojection_map(in, 1, 1, out, 1, 1, 1);
+    return true;
+  } catch (const std::runtime_error &) {
+    return false;
+  }
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+std::string case_key(const nlohmann::json &c) {
+  return c["in"].get<std::string>() + ">" + c["out"].get<std::string>() +
+         " " + c["interpolation"].get<std::string>() + " s" +
+         std::to_string(c["samples"].get<int>()) + " " +
+         c["layout"].get<std::string>();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  // clang-format off
+  cxxopts::Options options(argv[0],
+    "Benchmark of the reprojection kernels on synthetic frames, over lens\n"
+    "pairs, interpolation methods, sample counts and channel layouts.\n"
+    "Prints the results as JSON.");
+  options.add_options("Cases")
+    ("width", "Width of the input and output frames.",
+     cxxopts::value<int>()->default_value("2048"), "pixels")
+    ("height", "Height of the input and output frames.",
+     cxxopts::value<int>()->default_value("2048"), "pixels")
+    ("lenses", "Lenses to benchmark all pairs of: rectilinear, equidistant "
+     "and equisolid.",
+     cxxopts::value<std::string>()
+         ->default_value("rectilinear,equidistant,equisolid"), "list")
+    ("interpolation", "Interpolation methods: nn, bl, bc and tl.",
+     cxxopts::value<std::string>()->default_value("nn,bl,bc,tl"), "list")
+    ("samples", "Numbers of samples per dimension.",
+     cxxopts::value<std::string>()->default_value("1,2"), "list")
+    ("layouts", "Channel layouts: rgb, rgba, rgbz and rgbaz.",
+     cxxopts::value<std::string>()->default_value("rgb,rgba,rgbz,rgbaz"),
+     "list")
+    ("map", "Reproject through a reprojection map, built once per case "
+     "outside of the timed runs.")
+    ("planar", "Keep frames as one plane per channel.")
+    ("half", "Keep frames as 16-bit floats.")
+    ;
+  options.add_options("Runtime")
+    ("j,threads", "Number of threads reprojecting each frame.",
+     cxxopts::value<int>()->default_value("1"), "threads")
+    ("iterations", "Timed runs per case. The median is reported.",
+     cxxopts::value<int>()->default_value("5"), "runs")
+    ("o,output", "Write the JSON results to this file instead of stdout.",
+     cxxopts::value<std::string>(), "json-file")
+    ("baseline", "JSON results of an earlier run. Exits with status 2 if "
+     "any case got slower than it by more than --tolerance.",
+     cxxopts::value<std::string>(), "json-file")
+    ("tolerance", "Allowed relative throughput loss against --baseline.",
+     cxxopts::value<double>()->default_value("0.05"), "fraction")
+    ("h,help", "Show help")
+    ;
+  // clang-format on
+
+  int width, height, num_threads, iterations;
+  double tolerance;
+  std::vector<std::string> lens_names, interpolation_names, layout_names;
+  std::vector<int> sample_counts;
+  bool use_map = false;
+  reproject::Storage storage = reproject::INTERLEAVED;
+  reproject::PixelFormat pixel_format = reproject::F32;
+  std::string output_file, baseline_file;
+  try {
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::printf("%s\n", options.help().c_str());
+      return 0;
+    }
+    width = result["width"].as<int>();
+    height = result["height"].as<int>();
+    num_threads = result["threads"].as<int>();
+    iterations = result["iterations"].as<int>();
+    tolerance = result["tolerance"].as<double>();
+    lens_names = split(result["lenses"].as<std::string>());
+    interpolation_names = split(result["interpolation"].as<std::string>());
+    layout_names = split(result["layouts"].as<std::string>());
+    for (const std::string &s : split(result["samples"].as<std::string>())) {
+      sample_counts.push_back(std::atoi(s.c_str()));
+    }
+    use_map = result.count("map") > 0;
+    if (result.count("planar")) {
+      storage = reproject::PLANAR;
+    }
+    if (result.count("half")) {
+      pixel_format = reproject::F16;
+    }
+    if (result.count("output")) {
+      output_file = result["output"].as<std::string>();
+    }
+    if (result.count("baseline")) {
+      baseline_file = result["baseline"].as<std::string>();
+    }
+  } catch (const cxxopts::OptionException &e) {
+    std::printf("%s\n\n", e.what());
+    std::printf("%s\n", options.help().c_str());
+    return 1;
+  }
+  if (width <= 0 || height <= 0 || iterations <= 0 || num_threads <= 0) {
+    std::printf("Error: --width, --height, --iterations and --threads must "
+                "be positive.\n");
+    return 1;
+  }
+  for (int s : sample_counts) {
+    if (s <= 0) {
+      std::printf("Error: --samples must be positive.\n");
+      return 1;
+    }
+  }
+
+  std::vector<NamedLens> lenses;
+  for (const NamedLens &l : bench_lenses()) {
+    if (selected(lens_names, l.name)) {
+      lenses.push_back(l);
+    }
+  }
+
+  reproject::BufferPool pool;
+  nlohmann::json cases = nlohmann::json::array();
+  for (const NamedLayout &layout : LAYOUTS) {
+    if (!selected(layout_names, layout.name)) {
+      continue;
+    }
+    reproject::Image in;
+    in.width = width;
+    in.height = height;
+    in.channels = layout.channels;
+    in.data = nullptr;
+    in.data_layout = layout.layout;
+    in.storage = storage;
+    in.format = pixel_format;
+    reproject::allocate_pixels(in, &pool);
+    if (pixel_format == reproject::F16) {
+      fill_synthetic<half>(in);
+    } else {
+      fill_synthetic<float>(in);
+    }
+    reproject::Image out = in;
+    out.buffer = nullptr;
+    reproject::allocate_pixels(out, &pool);
+
+    for (const NamedLens &li : lenses) {
+      for (const NamedLens &lo : lenses) {
+        if (!supported(li.lens, lo.lens)) {
+          std::fprintf(stderr, "Skipping unsupported pair %s>%s\n", li.name,
+                       lo.name);
+          continue;
+        }
+        in.lens = li.lens;
+        out.lens = lo.lens;
+        for (int num_samples : sample_counts) {
+          reproject::ReprojectionMap map;
+          double map_seconds = 0.0;
+          if (use_map) {
+            auto start = std::chrono::steady_clock::now();
+            map = reproject::build_reprojection_map(
+                in.lens, in.width, in.height, out.lens, out.width, out.height,
+                num_samples, num_threads);
+            map_seconds = seconds_since(start);
+          }
+          for (const auto &interpolation : INTERPOLATIONS) {
+            if (!selected(interpolation_names, interpolation.first)) {
+              continue;
+            }
+            ZoneScopedN("bench_case");
+            auto run = [&]() {
+              if (use_map) {
+                reproject::reproject(&in, &out, map, interpolation.second,
+                                     num_threads);
+              } else {
+                reproject::reproject(&in, &out, num_samples,
+                                     interpolation.second, num_threads);
+              }
+            };
+            // Pages in the output and warms up the caches.
+            run();
+            std::vector<double> times;
+            for (int i = 0; i < iterations; ++i) {
+              auto start = std::chrono::steady_clock::now();
+              run();
+              times.push_back(seconds_since(start));
+            }
+            std::sort(times.begin(), times.end());
+            double median = times[times.size() / 2];
+            double pixels = double(out.width) * out.height;
+            double samples = pixels * num_samples * num_samples;
+
+            nlohmann::json c;
+            c["in"] = li.name;
+            c["out"] = lo.name;
+            c["interpolation"] = interpolation.first;
+            c["samples"] = num_samples;
+            c["layout"] = layout.name;
+            c["seconds"] = median;
+            c["min_seconds"] = times.front();
+            c["mpix_per_s"] = pixels / median * 1e-6;
+            c["ns_per_sample"] = median / samples * 1e9;
+            c["peak_rss_bytes"] = peak_rss();
+            if (use_map) {
+              c["map_build_seconds"] = map_seconds;
+            }
+            std::fprintf(stderr, "%-36s %8.2f Mpix/s %7.2f ns/sample\n",
+                         case_key(c).c_str(), c["mpix_per_s"].get<double>(),
+                         c["ns_per_sample"].get<double>());
+            cases.push_back(c);
+          }
+        }
+      }
+    }
+  }
+
+  nlohmann::json report;
+  report["width"] = width;
+  report["height"] = height;
+  report["threads"] = num_threads;
+  report["iterations"] = iterations;
+  report["map"] = use_map;
+  report["planar"] = storage == reproject::PLANAR;
+  report["half"] = pixel_format == reproject::F16;
+  report["peak_rss_bytes"] = peak_rss();
+  report["cases"] = cases;
+
+  if (output_file.empty()) {
+    std::printf("%s\n", report.dump(2).c_str());
+  } else {
+    std::ofstream out(output_file);
+    out << report.dump(2) << "\n";
+    if (!out) {
+      std::printf("Error: could not write %s\n", output_file.c_str());
+      return 1;
+    }
+  }
+
+  // Cases missing from either run are not compared, so the baseline may cover
+  // a different selection.
+  if (!baseline_file.empty()) {
+    nlohmann::json baseline;
+    try {
+      std::ifstream in(baseline_file);
+      in >> baseline;
+    } catch (const nlohmann::json::exception &e) {
+      std::printf("Error: could not read baseline %s: %s\n",
+                  baseline_file.c_str(), e.what());
+      return 1;
+    }
+    for (const char *setting :
+         {"width", "height", "threads", "map", "planar", "half"}) {
+      if (baseline[setting] != report[setting]) {
+        std::printf("Error: baseline %s was run with a different --%s.\n",
+                    baseline_file.c_str(), setting);
+        return 1;
+      }
+    }
+    std::map<std::string, double> reference;
+    for (const nlohmann::json &c : baseline["cases"]) {
+      reference[case_key(c)] = c["mpix_per_s"].get<double>();
+    }
+    int regressions = 0;
+    for (const nlohmann::json &c : cases) {
+      auto it = reference.find(case_key(c));
+      double mpix = c["mpix_per_s"].get<double>();
+      if (it != reference.end() && mpix < it->second * (1.0 - tolerance)) {
+        std::fprintf(stderr, "Regression: %s %.2f Mpix/s, was %.2f\n",
+                     case_key(c).c_str(), mpix, it->second);
+        regressions++;
+      }
+    }
+    if (regressions > 0) {
+      return 2;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include "buffer_pool.hpp"
+
+#include <iterator>
+#include <new>
+
+#include "Tracy.hpp"
+
+namespace reproject {
+
+static constexpr std::align_val_t BUFFER_ALIGNMENT{64};
+
+static void *allocate_buffer(size_t bytes) {
+  ZoneScoped;
+  return ::operator new(bytes, BUFFER_ALIGNMENT);
+}
+
+static void free_buffer(void *ptr) { ::operator delete(ptr, BUFFER_ALIGNMENT); }
+
+BufferPool::State::~State() {
+  for (auto &b : released) {
+    free_buffer(b.second);
+  }
+}
+
+BufferPool::BufferPool(size_t max_cached_bytes)
+    : state_(std::make_shared<State>()) {
+  state_->max_cached_bytes = max_cached_bytes;
+}
+
+std::shared_ptr<void> BufferPool::acquire(size_t bytes) {
+  void *ptr = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    auto it = state_->buffers.find(bytes);
+    if (it != state_->buffers.end()) {
+      ptr = it->second->second;
+      state_->released.erase(it->second);
+      state_->buffers.erase(it);
+      state_->cached_bytes -= bytes;
+      state_->stats.reuses++;
+      state_->stats.reused_bytes += bytes;
+    } else {
+      state_->stats.allocations++;
+      state_->stats.allocated_bytes += bytes;
+    }
+  }
+  if (ptr == nullptr) {
+    ptr = allocate_buffer(bytes);
+  }
+
+  // The deleter keeps the state alive, so buffers may outlive the pool.
+  std::shared_ptr<State> state = state_;
+  return std::shared_ptr<void>(ptr, [state, bytes](void *p) {
+    if (bytes > state->max_cached_bytes) {
+      free_buffer(p);
+      return;
+    }
+    std::list<std::pair<size_t, void *>> evicted;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->released.emplace_front(bytes, p);
+      state->buffers.emplace(bytes, state->released.begin());
+      state->cached_bytes += bytes;
+      while (state->cached_bytes > state->max_cached_bytes) {
+        auto oldest = std::prev(state->released.end());
+        auto range = state->buffers.equal_range(oldest->first);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second == oldest) {
+            state->buffers.erase(it);
+            break;
+          }
+        }
+        state->cached_bytes -= oldest->first;
+        evicted.splice(evicted.end(), state->released, oldest);
+      }
+    }
+    for (auto &b : evicted) {
+      free_buffer(b.second);
+    }
+  });
+}
+
+size_t BufferPool::cached_bytes() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->cached_bytes;
+}
+
+BufferPool::Stats BufferPool::stats() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->stats;
+}
+
+void BufferPool::clear() {
+  std::list<std::pair<size_t, void *>> released;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    released.swap(state_->released);
+    state_->buffers.clear();
+    state_->cached_bytes = 0;
+  }
+  for (auto &b : released) {
+    free_buffer(b.second);
+  }
+}
+
+void allocate_pixels(Image &img, BufferPool *pool) {
+  size_t bytes = num_elements(img) * element_size(img);
+  if (pool != nullptr) {
+    img.buffer = pool->acquire(bytes);
+  } else {
+    img.buffer = std::shared_ptr<void>(allocate_buffer(bytes), free_buffer);
+  }
+  img.data = nullptr;
+  img.data_f16 = nullptr;
+  if (img.format == F16) {
+    img.data_f16 = (half *)img.buffer.get();
+  } else {
+    img.data = (float *)img.buffer.get();
+  }
+}
+
+} // namespace reproject
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "reproject.hpp"
+
+namespace reproject {
+
+/**
+ * Recycles large buffers between frames. Buffers are handed out as shared
+ * pointers; dropping the last reference returns the buffer to its pool instead
+ * of freeing it, so the next frame of the same size reuses memory that is
+ * already paged in. Buffers outliving their pool are simply freed. When the
+ * cached buffers exceed max_cached_bytes, the ones released longest ago are
+ * freed, such that sizes no longer in use, as of other resolutions, do not
+ * stay cached.
+ *
+ * Thread-safe, but meant to be used as one pool per worker to keep the lock
+ * uncontended.
+ */
+class BufferPool {
+public:
+  // About seven 4K RGBA frames of floats.
+  static constexpr size_t DEFAULT_MAX_CACHED_BYTES = size_t(1) << 30;
+
+  /** Buffers larger than max_cached_bytes are freed instead of cached. */
+  explicit BufferPool(size_t max_cached_bytes = DEFAULT_MAX_CACHED_BYTES);
+
+  /** Returns an uninitialized, 64-byte aligned buffer of the given size. */
+  std::shared_ptr<void> acquire(size_t bytes);
+
+  template <typename T> std::shared_ptr<T> acquire_array(size_t count) {
+    std::shared_ptr<void> buffer = acquire(count * sizeof(T));
+    return std::shared_ptr<T>(buffer, (T *)buffer.get());
+  }
+
+  /** Totals over all acquire() calls so far, see stats(). */
+  struct Stats {
+    uint64_t allocations{0};
+    uint64_t allocated_bytes{0};
+    uint64_t reuses{0};
+    uint64_t reused_bytes{0};
+  };
+
+  size_t cached_bytes() const;
+  Stats stats() const;
+  void clear();
+
+private:
+  struct State {
+    size_t max_cached_bytes;
+    size_t cached_bytes{0};
+    Stats stats;
+    std::mutex mutex;
+    // Free buffers, most recently released first, and by size.
+    std::list<std::pair<size_t, void *>> released;
+    std::multimap<size_t, std::list<std::pair<size_t, void *>>::iterator>
+        buffers;
+
+    ~State();
+  };
+  std::shared_ptr<State> state_;
+};
+
+/**
+ * Allocates the pixels of img according to its dimensions and format, drawn
+ * from pool if given. img.buffer owns the allocation.
+ */
+void allocate_pixels(Image &img, BufferPool *pool = nullptr);
+
+} // namespace reproject
@@ -0,0 +1,52 @@
+#include "color.hpp"
+
+#include <cmath>
+#include <cstring>
+
+namespace reproject {
+
+const std::array<float, 256> &png_to_linear_table() {
+  static const std::array<float, 256> table = [] {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; ++i) {
+      t[i] = std::pow(float(i) / 255.0f, 2.2f);
+    }
+    return t;
+  }();
+  return table;
+}
+
+static uint8_t linear_to_png_exact(float s) {
+  return uint8_t(255.9f * std::pow(s, 1.0f / 2.2f));
+}
+
+// The thresholds are found by bisecting the bit patterns of the floats, which
+// are ordered like the values themselves, so the table lookup reproduces the
+// pow() rounding exactly.
+const std::array<float, 256> &linear_to_png_thresholds() {
+  static const std::array<float, 256> table = [] {
+    std::array<float, 256> t;
+    t[0] = 0.0f;
+    uint32_t one_bits;
+    float one = 1.0f;
+    std::memcpy(&one_bits, &one, sizeof(float));
+    for (int d = 1; d < 256; ++d) {
+      uint32_t lo = 0, hi = one_bits;
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        float v;
+        std::memcpy(&v, &mid, sizeof(float));
+        if (linear_to_png_exact(v) >= d) {
+          hi = mid;
+        } else {
+          lo = mid + 1;
+        }
+      }
+      std::memcpy(&t[d], &lo, sizeof(float));
+    }
+    return t;
+  }();
+  return table;
+}
+
+} // namespace reproject
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace reproject {
+
+/**
+ * Linear value of every 8-bit PNG value, assuming a gamma of 2.2.
+ */
+const std::array<float, 256> &png_to_linear_table();
+
+/**
+ * thresholds[d] is the smallest linear value in [0, 1] that is encoded as d or
+ * more by uint8_t(255.9f * pow(s, 1 / 2.2f)).
+ */
+const std::array<float, 256> &linear_to_png_thresholds();
+
+/**
+ * Gamma encodes a linear value to 8 bits, clamping it to [0, 1] first. Uses a
+ * branch free binary search over linear_to_png_thresholds() instead of pow(),
+ * with the same result.
+ */
+inline uint8_t linear_to_png(float s, const float *thresholds) {
+  s = std::max(0.0f, std::min(1.0f, s));
+  int d = 0;
+  for (int step = 128; step > 0; step >>= 1) {
+    d += s >= thresholds[d + step] ? step : 0;
+  }
+  return uint8_t(d);
+}
+
+/**
+ * Reinhard tonemap, mapping reinhard to 1.
+ */
+inline float reinhard_tonemap(float v, float reinhard) {
+  return v * (1.0f + v / (reinhard * reinhard)) / (1.0f + v);
+}
+
+} // namespace reproject
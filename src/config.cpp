@@ -5,41 +5,44 @@
 namespace reproject {
 
 LensInfo extract_lens_info_from_config(const nlohmann::json &cfg) {
-  const nlohmann::json &camera_cfg = cfg["camera"];
-  std::string camera_type = camera_cfg["/type"_json_pointer];
+  // at(), as operator[] of a const json without the key is undefined.
+  const nlohmann::json &camera_cfg = cfg.at("camera");
+  std::string camera_type = camera_cfg.at("type").get<std::string>();
 
   reproject::LensInfo lens;
-  lens.sensor_width = cfg["sensor_size"][0].get<float>();
-  lens.sensor_height = cfg["sensor_size"][1].get<float>();
+  lens.sensor_width = cfg.at("sensor_size").at(0).get<float>();
+  lens.sensor_height = cfg.at("sensor_size").at(1).get<float>();
 
-  int res_x = cfg["resolution"][0].get<int>();
-  int res_y = cfg["resolution"][1].get<int>();
+  int res_x = cfg.at("resolution").at(0).get<int>();
+  int res_y = cfg.at("resolution").at(1).get<int>();
 
   if (camera_type == "PANO") {
-    camera_type = camera_cfg["panorama_type"].get<std::string>();
+    camera_type = camera_cfg.at("panorama_type").get<std::string>();
     if (camera_type == "FISHEYE_EQUIDISTANT") {
       lens.type = reproject::FISHEYE_EQUIDISTANT;
-      lens.fisheye_equidistant.fov = camera_cfg["fisheye_fov"].get<float>();
+      lens.fisheye_equidistant.fov =
+          camera_cfg.at("fisheye_fov").get<float>();
     } else if (camera_type == "FISHEYE_EQUISOLID") {
       lens.type = reproject::FISHEYE_EQUISOLID;
       lens.fisheye_equisolid.focal_length =
-          camera_cfg["fisheye_lens"].get<float>();
-      lens.fisheye_equisolid.fov = camera_cfg["fisheye_fov"].get<float>();
+          camera_cfg.at("fisheye_lens").get<float>();
+      lens.fisheye_equisolid.fov = camera_cfg.at("fisheye_fov").get<float>();
     } else if (camera_type == "EQUIRECTANGULAR") {
       lens.type = reproject::EQUIRECTANGULAR;
       auto &leq = lens.equirectangular;
-      leq.latitude_min = camera_cfg["latitude_min"].get<float>();
-      leq.latitude_max = camera_cfg["latitude_max"].get<float>();
-      leq.longitude_min = camera_cfg["longitude_min"].get<float>();
-      leq.longitude_max = camera_cfg["longitude_max"].get<float>();
+      leq.latitude_min = camera_cfg.at("latitude_min").get<float>();
+      leq.latitude_max = camera_cfg.at("latitude_max").get<float>();
+      leq.longitude_min = camera_cfg.at("longitude_min").get<float>();
+      leq.longitude_max = camera_cfg.at("longitude_max").get<float>();
     }
   } else if (camera_type == "PERSP") {
     lens.type = reproject::RECTILINEAR;
-    std::string lens_unit = camera_cfg["lens_unit"].get<std::string>();
+    std::string lens_unit = camera_cfg.at("lens_unit").get<std::string>();
     if (lens_unit == "MILLIMETERS") {
-      lens.rectilinear.focal_length = camera_cfg["focal_length"].get<float>();
+      lens.rectilinear.focal_length =
+          camera_cfg.at("focal_length").get<float>();
     } else if (lens_unit == "FOV") {
-      float angle = camera_cfg["angle"].get<float>();
+      float angle = camera_cfg.at("angle").get<float>();
       // sensor_width = focal_length * tan(fov/2)
       std::printf("Warning: relying on 'angle' is unsafe. Angle is assumed "
                   "to be based on the width of the sensor.\n");
@@ -101,4 +104,55 @@ void store_lens_info_in_config(const LensInfo &ol, nlohmann::json &out_cfg) {
   }
 }
 
+bool extract_exposure_from_config(const nlohmann::json &cfg,
+                                  ExposureInfo &exposure) {
+  auto it = cfg.find("auto_exposure");
+  if (it == cfg.end() || !it->is_object()) {
+    return false;
+  }
+  const nlohmann::json &scales = (*it)["scales"];
+  const nlohmann::json &frames = (*it)["frames"];
+  if (!scales.is_array() || scales.size() != 3 || !frames.is_array()) {
+    return false;
+  }
+  for (int c = 0; c < 3; ++c) {
+    exposure.scales[c] = scales[c].get<float>();
+  }
+  exposure.frames = frames.get<std::vector<std::string>>();
+  return true;
+}
+
+void store_exposure_in_config(const ExposureInfo &exposure,
+                              nlohmann::json &cfg) {
+  cfg["auto_exposure"] = nlohmann::json::object();
+  cfg["auto_exposure"]["scales"] = {exposure.scales[0], exposure.scales[1],
+                                    exposure.scales[2]};
+  cfg["auto_exposure"]["frames"] = exposure.frames;
+}
+
+bool operator==(const LensInfo &a, const LensInfo &b) {
+  if (a.type != b.type || a.sensor_width != b.sensor_width ||
+      a.sensor_height != b.sensor_height) {
+    return false;
+  }
+  switch (a.type) {
+  case RECTILINEAR:
+    return a.rectilinear.focal_length == b.rectilinear.focal_length;
+  case FISHEYE_EQUIDISTANT:
+    return a.fisheye_equidistant.fov == b.fisheye_equidistant.fov;
+  case FISHEYE_EQUISOLID:
+    return a.fisheye_equisolid.focal_length ==
+               b.fisheye_equisolid.focal_length &&
+           a.fisheye_equisolid.fov == b.fisheye_equisolid.fov;
+  case EQUIRECTANGULAR:
+    return a.equirectangular.latitude_min == b.equirectangular.latitude_min &&
+           a.equirectangular.latitude_max == b.equirectangular.latitude_max &&
+           a.equirectangular.longitude_min ==
+               b.equirectangular.longitude_min &&
+           a.equirectangular.longitude_max == b.equirectangular.longitude_max;
+  default:
+    return true;
+  }
+}
+
 } // namespace reproject
@@ -2,6 +2,9 @@
 
 #include <nlohmann/json_fwd.hpp>
 
+#include <string>
+#include <vector>
+
 namespace reproject {
 
 enum LensType {
@@ -40,10 +43,36 @@ struct LensInfo {
  * Extracts the lens information from a config file, as produced by the Blender
  * addon.
  * @throws std::invalid_argument if the given json tree cannot be extracted
- *         correctly.
+ *         correctly, nlohmann::json::exception if it lacks a field.
  */
 LensInfo extract_lens_info_from_config(const nlohmann::json &config);
 
 void store_lens_info_in_config(const LensInfo &lens, nlohmann::json &config);
 
+/**
+ * Exposure scales shared by a batch of frames, and the names of the frames
+ * they were derived from.
+ */
+struct ExposureInfo {
+  float scales[3];
+  std::vector<std::string> frames;
+};
+
+/**
+ * Returns false if the config has no (valid) exposure information.
+ */
+bool extract_exposure_from_config(const nlohmann::json &config,
+                                  ExposureInfo &exposure);
+
+void store_exposure_in_config(const ExposureInfo &exposure,
+                              nlohmann::json &config);
+
+/**
+ * Compares the fields that are relevant for the lens type.
+ */
+bool operator==(const LensInfo &a, const LensInfo &b);
+inline bool operator!=(const LensInfo &a, const LensInfo &b) {
+  return !(a == b);
+}
+
 } // namespace reproject
@@ -0,0 +1,679 @@
+#include "gpu.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include <Tracy.hpp>
+
+#include "color.hpp"
+
+#ifdef REPROJECT_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+namespace reproject {
+
+#ifdef REPROJECT_OPENCL
+
+namespace {
+
+// The kernels mirror map_row(), the samplers and sample_span() of
+// reproject.cpp. Inputs are packed into RGBA images, such that BILINEAR can
+// use the texture units; the other interpolations read single taps.
+const char *KERNELS = R"CL(
+#define RECTILINEAR 0
+#define EQUIDISTANT 1
+
+#define NEAREST 0
+#define BILINEAR 1
+#define BICUBIC 2
+
+#define F32 0
+#define F16 1
+#define PNG 2
+
+typedef struct {
+  int in_width, in_height, in_lens;
+  float in_sensor, in_param;
+  int out_width, out_height, out_lens;
+  float out_sensor, out_param;
+  int num_samples, interpolation, channels, format, planar;
+  int png_channels, fill_uncovered, fill_png, alpha, tonemap;
+  float fill, reinhard, scale_r, scale_g, scale_b;
+} Params;
+
+__constant sampler_t TAPS =
+    CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE |
+    CLK_FILTER_NEAREST;
+__constant sampler_t LINEAR =
+    CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE |
+    CLK_FILTER_LINEAR;
+
+// param is the focal length of rectilinear lenses and the field of view of
+// equidistant ones.
+bool to_spherical(int lens, float sensor, float param, float img_w, float cx,
+                  float cy, float *alpha, float *theta) {
+  float r_px = sqrt(cx * cx + cy * cy);
+  *alpha = atan2(cy, cx);
+  if (lens == RECTILINEAR) {
+    *theta = atan(r_px / param * (sensor / img_w));
+    return true;
+  }
+  float r_mm = r_px / img_w * sensor;
+  *theta = r_mm / (sensor / param);
+  return *theta <= 0.5f * param;
+}
+
+bool from_spherical(int lens, float sensor, float param, float img_w,
+                    float alpha, float theta, float *cx, float *cy) {
+  float r_px;
+  bool valid;
+  if (lens == RECTILINEAR) {
+    r_px = param * tan(theta) / sensor * img_w;
+    valid = theta < 1.57079633f;
+  } else {
+    r_px = sensor / param * theta / sensor * img_w;
+    valid = theta <= 0.5f * param;
+  }
+  *cx = r_px * cos(alpha);
+  *cy = r_px * sin(alpha);
+  return valid;
+}
+
+float4 tap(__read_only image2d_t src, int x, int y) {
+  return read_imagef(src, TAPS, (int2)(x, y));
+}
+
+void cubic_weights(float x, float *w) {
+  float x2 = x * x;
+  float x3 = x2 * x;
+  w[0] = 0.5f * (2.0f * x2 - (x + x3));
+  w[1] = 0.5f * (3.0f * x3 - 5.0f * x2 + 2.0f);
+  w[2] = 0.5f * (-3.0f * x3 + (4.0f * x2 + x));
+  w[3] = 0.5f * (x3 - x2);
+}
+
+float4 sample(__read_only image2d_t src, const Params *p, float sx,
+              float sy) {
+  const int w = p->in_width;
+  const int h = p->in_height;
+  if (p->interpolation == NEAREST) {
+    return tap(src, clamp((int)(sx + 0.5f), 0, w - 1),
+               clamp((int)(sy + 0.5f), 0, h - 1));
+  }
+  if (p->interpolation == BILINEAR) {
+    // Texel centers are at half integers.
+    return read_imagef(src, LINEAR, (float2)(sx + 0.5f, sy + 0.5f));
+  }
+  int ix = (int)sx;
+  int iy = (int)sy;
+  int x1 = clamp(ix, 0, w - 1);
+  int y1 = clamp(iy, 0, h - 1);
+  int xs[4] = {clamp(ix - 1, 0, w - 1), x1, clamp(ix + 1, 0, w - 1),
+               clamp(ix + 2, 0, w - 1)};
+  float wx[4], wy[4];
+  cubic_weights(fmax(0.0f, fmin(1.0f, sx - x1)), wx);
+  cubic_weights(fmax(0.0f, fmin(1.0f, sy - y1)), wy);
+  float4 r = (float4)(0.0f);
+  for (int j = 0; j < 4; ++j) {
+    int y = clamp(iy - 1 + j, 0, h - 1);
+    float4 row = wx[0] * tap(src, xs[0], y) + wx[1] * tap(src, xs[1], y) +
+                 wx[2] * tap(src, xs[2], y) + wx[3] * tap(src, xs[3], y);
+    r += wy[j] * row;
+  }
+  return r;
+}
+
+float reinhard_tonemap(float v, float reinhard) {
+  return v * (1.0f + v / (reinhard * reinhard)) / (1.0f + v);
+}
+
+uchar linear_to_png(float s, __constant float *thresholds) {
+  s = s < 1.0f ? s : 1.0f;
+  s = 0.0f < s ? s : 0.0f;
+  int d = 0;
+  for (int step = 128; step > 0; step >>= 1) {
+    d += s >= thresholds[d + step] ? step : 0;
+  }
+  return (uchar)d;
+}
+
+__kernel void pack(__global const uchar *src, int width, int height,
+                   int channels, int format, int planar,
+                   __write_only image2d_t dst) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const size_t i = (size_t)y * width + x;
+  float v[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  for (int c = 0; c < channels; ++c) {
+    size_t e = planar ? c * (size_t)width * height + i : i * channels + c;
+    v[c] = format == F16 ? vload_half(e, (__global const half *)src)
+                         : ((__global const float *)src)[e];
+  }
+  write_imagef(dst, (int2)(x, y), (float4)(v[0], v[1], v[2], v[3]));
+}
+
+__kernel void reproject(__read_only image2d_t src, Params p,
+                        __global uchar *dst, __global uchar *coverage,
+                        __constant float *thresholds) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  float cx = (x + 0.5f) - p.out_width * 0.5f;
+  float cy = (y + 0.5f) - p.out_height * 0.5f;
+
+  float4 sum = (float4)(0.0f);
+  bool covered = false;
+  for (int ssx = 0; ssx < p.num_samples; ++ssx) {
+    float scx = cx + (ssx + 1.0f) / (p.num_samples + 1.0f) - 0.5f;
+    for (int ssy = 0; ssy < p.num_samples; ++ssy) {
+      float scy = cy + (ssy + 1.0f) / (p.num_samples + 1.0f) - 0.5f;
+      float alpha, theta, sx, sy;
+      bool valid = to_spherical(p.out_lens, p.out_sensor, p.out_param,
+                                p.out_width, scx, scy, &alpha, &theta);
+      valid = from_spherical(p.in_lens, p.in_sensor, p.in_param, p.in_width,
+                             alpha, theta, &sx, &sy) && valid;
+      sx = (sx - 0.5f) + p.in_width * 0.5f;
+      sy = (sy - 0.5f) + p.in_height * 0.5f;
+      covered = covered || (valid && sx >= -0.5f && sx <= p.in_width - 0.5f &&
+                            sy >= -0.5f && sy <= p.in_height - 0.5f);
+      sum += sample(src, &p, sx, sy);
+    }
+  }
+
+  const size_t i = (size_t)y * p.out_width + x;
+  if (coverage) {
+    coverage[i] = covered;
+  }
+  const bool fill = p.fill_uncovered && !covered;
+  sum *= 1.0f / (p.num_samples * p.num_samples);
+  float v[4] = {sum.x, sum.y, sum.z, sum.w};
+  if (p.tonemap) {
+    v[0] = reinhard_tonemap(v[0] * p.scale_r, p.reinhard);
+    v[1] = reinhard_tonemap(v[1] * p.scale_g, p.reinhard);
+    v[2] = reinhard_tonemap(v[2] * p.scale_b, p.reinhard);
+  }
+  if (p.format == PNG) {
+    for (int c = 0; c < p.png_channels; ++c) {
+      uchar d = 0;
+      if (c < p.channels && !(fill && c == p.alpha)) {
+        d = fill ? p.fill_png : linear_to_png(v[c], thresholds);
+      }
+      dst[i * p.png_channels + c] = d;
+    }
+    return;
+  }
+  const size_t plane = (size_t)p.out_width * p.out_height;
+  for (int c = 0; c < p.channels; ++c) {
+    float value = fill ? (c == p.alpha ? 0.0f : p.fill) : v[c];
+    size_t e = p.planar ? c * plane + i : i * p.channels + c;
+    if (p.format == F16) {
+      vstore_half(value, e, (__global half *)dst);
+    } else {
+      ((__global float *)dst)[e] = value;
+    }
+  }
+}
+)CL";
+
+// Host side of the Params of KERNELS, members in the same order.
+struct Params {
+  cl_int in_width, in_height, in_lens;
+  cl_float in_sensor, in_param;
+  cl_int out_width, out_height, out_lens;
+  cl_float out_sensor, out_param;
+  cl_int num_samples, interpolation, channels, format, planar;
+  cl_int png_channels, fill_uncovered, fill_png, alpha, tonemap;
+  cl_float fill, reinhard, scale_r, scale_g, scale_b;
+};
+
+void check(cl_int status, const char *what) {
+  if (status != CL_SUCCESS) {
+    throw std::runtime_error(std::string("OpenCL ") + what +
+                             " failed with error " + std::to_string(status) +
+                             ".");
+  }
+}
+
+/**
+ * The GPU and the kernels built for it, shared by all streams for the
+ * lifetime of the process.
+ */
+struct Device {
+  cl_device_id device;
+  cl_context context;
+  cl_program program;
+  // linear_to_png_thresholds().
+  cl_mem thresholds;
+  size_t max_width, max_height;
+  std::string name;
+};
+
+std::string device_info(cl_device_id device, cl_device_info info) {
+  size_t size = 0;
+  clGetDeviceInfo(device, info, 0, nullptr, &size);
+  std::string value(size, '\0');
+  clGetDeviceInfo(device, info, size, &value[0], nullptr);
+  return value.c_str();
+}
+
+/** The first GPU with image support of any platform, if any. */
+std::unique_ptr<Device> open_device() {
+  ZoneScoped;
+  cl_uint num_platforms = 0;
+  if (clGetPlatformIDs(0, nullptr, &num_platforms) != CL_SUCCESS) {
+    return nullptr;
+  }
+  std::vector<cl_platform_id> platforms(num_platforms);
+  clGetPlatformIDs(num_platforms, platforms.data(), nullptr);
+  for (cl_platform_id platform : platforms) {
+    cl_device_id id;
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &id, nullptr) !=
+        CL_SUCCESS) {
+      continue;
+    }
+    cl_bool images = CL_FALSE;
+    clGetDeviceInfo(id, CL_DEVICE_IMAGE_SUPPORT, sizeof(images), &images,
+                    nullptr);
+    if (!images) {
+      continue;
+    }
+    std::unique_ptr<Device> dev(new Device());
+    dev->device = id;
+    dev->name = device_info(id, CL_DEVICE_NAME);
+    clGetDeviceInfo(id, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(size_t),
+                    &dev->max_width, nullptr);
+    clGetDeviceInfo(id, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(size_t),
+                    &dev->max_height, nullptr);
+    cl_int status;
+    dev->context = clCreateContext(nullptr, 1, &id, nullptr, nullptr, &status);
+    if (status != CL_SUCCESS) {
+      continue;
+    }
+    dev->program =
+        clCreateProgramWithSource(dev->context, 1, &KERNELS, nullptr, &status);
+    if (status == CL_SUCCESS) {
+      status = clBuildProgram(dev->program, 1, &id, "", nullptr, nullptr);
+    }
+    if (status != CL_SUCCESS) {
+      size_t size = 0;
+      clGetProgramBuildInfo(dev->program, id, CL_PROGRAM_BUILD_LOG, 0, nullptr,
+                            &size);
+      std::string log(size, '\0');
+      clGetProgramBuildInfo(dev->program, id, CL_PROGRAM_BUILD_LOG, size,
+                            &log[0], nullptr);
+      std::printf("Warning: Cannot build the kernels for %s: %s\n",
+                  dev->name.c_str(), log.c_str());
+      clReleaseContext(dev->context);
+      continue;
+    }
+    const std::array<float, 256> &thresholds = linear_to_png_thresholds();
+    dev->thresholds = clCreateBuffer(
+        dev->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(thresholds), (void *)thresholds.data(), &status);
+    if (status != CL_SUCCESS) {
+      clReleaseProgram(dev->program);
+      clReleaseContext(dev->context);
+      continue;
+    }
+    return dev;
+  }
+  return nullptr;
+}
+
+const Device *device() {
+  static const std::unique_ptr<Device> dev = open_device();
+  return dev.get();
+}
+
+bool lens_supported(const LensInfo &lens) {
+  return lens.type == RECTILINEAR || lens.type == FISHEYE_EQUIDISTANT;
+}
+
+cl_int lens_code(const LensInfo &lens) {
+  return lens.type == RECTILINEAR ? 0 : 1;
+}
+
+cl_float lens_param(const LensInfo &lens) {
+  return lens.type == RECTILINEAR ? lens.rectilinear.focal_length
+                                  : lens.fisheye_equidistant.fov;
+}
+
+void release(cl_mem &mem) {
+  if (mem) {
+    clReleaseMemObject(mem);
+    mem = nullptr;
+  }
+}
+
+void release(cl_event &event) {
+  if (event) {
+    clReleaseEvent(event);
+    event = nullptr;
+  }
+}
+
+} // namespace
+
+bool gpu_available() { return device() != nullptr; }
+
+std::string gpu_device_name() {
+  const Device *dev = device();
+  return dev ? dev->name : "";
+}
+
+bool gpu_supports(const Image *in, const Image *out, Interpolation im) {
+  const Device *dev = device();
+  return dev && im != TRILINEAR && in->channels <= 4 &&
+         out->channels == in->channels && lens_supported(in->lens) &&
+         lens_supported(out->lens) && size_t(in->width) <= dev->max_width &&
+         size_t(in->height) <= dev->max_height;
+}
+
+struct GpuStream::State {
+  const Device *dev;
+  // Uploads and downloads go through transfer, kernels through compute, such
+  // that they overlap.
+  cl_command_queue transfer{nullptr};
+  cl_command_queue compute{nullptr};
+  cl_kernel pack{nullptr};
+  cl_kernel reproject{nullptr};
+  // The pixels of the input as uploaded, and packed into an RGBA image.
+  cl_mem upload{nullptr};
+  size_t upload_bytes{0};
+  cl_mem image{nullptr};
+  // Dimensions, lens and channels of the uploaded input, without pixels.
+  Image input{};
+  bool has_input{false};
+  // Done when the upload buffer may be overwritten again.
+  cl_event packed{nullptr};
+
+  struct Output {
+    cl_mem pixels{nullptr};
+    size_t bytes{0};
+    cl_mem coverage{nullptr};
+    size_t coverage_bytes{0};
+  };
+  // One per reproject() call since the last finish(), recycled after it.
+  std::vector<Output> outputs;
+  size_t next_output{0};
+  std::vector<cl_event> downloads;
+
+  /** Makes mem hold at least bytes, keeping it if it does. */
+  void reserve(cl_mem &mem, size_t &size, size_t bytes, cl_mem_flags flags) {
+    if (mem && size >= bytes) {
+      return;
+    }
+    // Commands still using the old buffer keep it alive until they are done.
+    release(mem);
+    cl_int status;
+    mem = clCreateBuffer(dev->context, flags, bytes, nullptr, &status);
+    check(status, "clCreateBuffer");
+    size = bytes;
+  }
+
+  ~State() {
+    if (compute) {
+      clFinish(compute);
+    }
+    if (transfer) {
+      clFinish(transfer);
+    }
+    for (cl_event &event : downloads) {
+      release(event);
+    }
+    release(packed);
+    for (Output &output : outputs) {
+      release(output.pixels);
+      release(output.coverage);
+    }
+    release(upload);
+    release(image);
+    // clang-format off
+    if (pack) clReleaseKernel(pack);
+    if (reproject) clReleaseKernel(reproject);
+    if (compute) clReleaseCommandQueue(compute);
+    if (transfer) clReleaseCommandQueue(transfer);
+    // clang-format on
+  }
+};
+
+GpuStream::GpuStream() : state_(new State) {
+  State &s = *state_;
+  s.dev = device();
+  if (!s.dev) {
+    throw std::runtime_error("No OpenCL GPU found.");
+  }
+  cl_int status;
+  // clang-format off
+  s.transfer = clCreateCommandQueue(s.dev->context, s.dev->device, 0, &status);
+  check(status, "clCreateCommandQueue");
+  s.compute = clCreateCommandQueue(s.dev->context, s.dev->device, 0, &status);
+  check(status, "clCreateCommandQueue");
+  s.pack = clCreateKernel(s.dev->program, "pack", &status);
+  check(status, "clCreateKernel");
+  s.reproject = clCreateKernel(s.dev->program, "reproject", &status);
+  check(status, "clCreateKernel");
+  // clang-format on
+}
+
+GpuStream::~GpuStream() = default;
+
+void GpuStream::upload(const Image &in) {
+  ZoneScoped;
+  State &s = *state_;
+  if (in.channels > 4 || pixel_data(in) == nullptr) {
+    throw std::invalid_argument("The GPU reprojects images with pixels and "
+                                "up to four channels.");
+  }
+  const size_t bytes = num_elements(in) * element_size(in);
+  s.reserve(s.upload, s.upload_bytes, bytes, CL_MEM_READ_ONLY);
+  if (!s.image || s.input.width != in.width || s.input.height != in.height ||
+      s.input.format != in.format) {
+    release(s.image);
+    cl_image_format format;
+    format.image_channel_order = CL_RGBA;
+    format.image_channel_data_type = in.format == F16 ? CL_HALF_FLOAT
+                                                      : CL_FLOAT;
+    cl_image_desc desc{};
+    desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+    desc.image_width = in.width;
+    desc.image_height = in.height;
+    cl_int status;
+    s.image = clCreateImage(s.dev->context, CL_MEM_READ_WRITE, &format,
+                            &desc, nullptr, &status);
+    check(status, "clCreateImage");
+  }
+  s.input = in;
+  s.input.buffer = nullptr;
+  s.input.data = nullptr;
+  s.input.data_f16 = nullptr;
+  s.has_input = true;
+
+  // The previous input may still be packed from the upload buffer. Kernels
+  // reading the image run before the next pack, as they share a queue.
+  cl_event written;
+  check(clEnqueueWriteBuffer(s.transfer, s.upload, CL_FALSE, 0, bytes,
+                             pixel_data(in), s.packed ? 1 : 0,
+                             s.packed ? &s.packed : nullptr, &written),
+        "upload");
+  release(s.packed);
+  const cl_int width = in.width, height = in.height, channels = in.channels;
+  const cl_int format = in.format == F16 ? 1 : 0;
+  const cl_int planar = in.storage == PLANAR;
+  // clang-format off
+  clSetKernelArg(s.pack, 0, sizeof(cl_mem), &s.upload);
+  clSetKernelArg(s.pack, 1, sizeof(cl_int), &width);
+  clSetKernelArg(s.pack, 2, sizeof(cl_int), &height);
+  clSetKernelArg(s.pack, 3, sizeof(cl_int), &channels);
+  clSetKernelArg(s.pack, 4, sizeof(cl_int), &format);
+  clSetKernelArg(s.pack, 5, sizeof(cl_int), &planar);
+  clSetKernelArg(s.pack, 6, sizeof(cl_mem), &s.image);
+  // clang-format on
+  const size_t global[2] = {size_t(in.width), size_t(in.height)};
+  cl_int status = clEnqueueNDRangeKernel(s.compute, s.pack, 2, nullptr, global,
+                                         nullptr, 1, &written, &s.packed);
+  clReleaseEvent(written);
+  check(status, "pack");
+}
+
+void GpuStream::reproject(Image &out, int num_samples, Interpolation im,
+                          const OutputTransform *transform,
+                          uint8_t *coverage) {
+  ZoneScoped;
+  State &s = *state_;
+  if (!s.has_input) {
+    throw std::invalid_argument("Nothing uploaded to reproject.");
+  }
+  if (!gpu_supports(&s.input, &out, im)) {
+    throw std::invalid_argument("The GPU does not support these images.");
+  }
+  const bool png = transform != nullptr && transform->png != nullptr;
+  const size_t num_pixels = size_t(out.width) * out.height;
+  const size_t bytes = png ? num_pixels * transform->png_channels
+                           : num_elements(out) * element_size(out);
+  void *host = png ? (void *)transform->png : pixel_data(out);
+  if (host == nullptr) {
+    throw std::invalid_argument("Images to reproject need pixels.");
+  }
+
+  if (s.next_output == s.outputs.size()) {
+    s.outputs.emplace_back();
+  }
+  State::Output &o = s.outputs[s.next_output++];
+  s.reserve(o.pixels, o.bytes, bytes, CL_MEM_WRITE_ONLY);
+  if (coverage) {
+    s.reserve(o.coverage, o.coverage_bytes, num_pixels, CL_MEM_WRITE_ONLY);
+  }
+
+  const Image &in = s.input;
+  Params p{};
+  p.in_width = in.width;
+  p.in_height = in.height;
+  p.in_lens = lens_code(in.lens);
+  p.in_sensor = in.lens.sensor_width;
+  p.in_param = lens_param(in.lens);
+  p.out_width = out.width;
+  p.out_height = out.height;
+  p.out_lens = lens_code(out.lens);
+  p.out_sensor = out.lens.sensor_width;
+  p.out_param = lens_param(out.lens);
+  p.num_samples = num_samples;
+  p.interpolation = im;
+  p.channels = out.channels;
+  p.format = png ? 2 : out.format == F16 ? 1 : 0;
+  p.planar = out.storage == PLANAR;
+  p.alpha = out.data_layout == RGBA || out.data_layout == RGBAZ ? 3 : -1;
+  p.scale_r = p.scale_g = p.scale_b = 1.0f;
+  p.reinhard = 1.0f;
+  if (transform) {
+    p.png_channels = transform->png_channels;
+    p.fill_uncovered = transform->fill_uncovered;
+    p.fill = transform->fill;
+    p.fill_png = std::isnan(transform->fill)
+                     ? 0
+                     : linear_to_png(transform->fill,
+                                     linear_to_png_thresholds().data());
+    p.tonemap = transform->tonemap;
+    p.scale_r = transform->scales[0];
+    p.scale_g = transform->scales[1];
+    p.scale_b = transform->scales[2];
+    p.reinhard = transform->reinhard;
+  }
+  // A null buffer is a null pointer in the kernel.
+  cl_mem coverage_mem = coverage ? o.coverage : nullptr;
+  // clang-format off
+  clSetKernelArg(s.reproject, 0, sizeof(cl_mem), &s.image);
+  clSetKernelArg(s.reproject, 1, sizeof(Params), &p);
+  clSetKernelArg(s.reproject, 2, sizeof(cl_mem), &o.pixels);
+  clSetKernelArg(s.reproject, 3, sizeof(cl_mem), &coverage_mem);
+  clSetKernelArg(s.reproject, 4, sizeof(cl_mem), &s.dev->thresholds);
+  // clang-format on
+  const size_t global[2] = {size_t(out.width), size_t(out.height)};
+  cl_event computed;
+  check(clEnqueueNDRangeKernel(s.compute, s.reproject, 2, nullptr, global,
+                               nullptr, 0, nullptr, &computed),
+        "reproject");
+
+  // Downloaded while the kernels of the next outputs run.
+  cl_event downloaded;
+  cl_int status = clEnqueueReadBuffer(s.transfer, o.pixels, CL_FALSE, 0,
+                                      bytes, host, 1, &computed, &downloaded);
+  if (status == CL_SUCCESS) {
+    s.downloads.push_back(downloaded);
+    if (coverage) {
+      status = clEnqueueReadBuffer(s.transfer, o.coverage, CL_FALSE, 0,
+                                   num_pixels, coverage, 1, &computed,
+                                   &downloaded);
+      if (status == CL_SUCCESS) {
+        s.downloads.push_back(downloaded);
+      }
+    }
+  }
+  clReleaseEvent(computed);
+  check(status, "download");
+}
+
+void GpuStream::finish() {
+  ZoneScoped;
+  State &s = *state_;
+  cl_int status = clFinish(s.compute);
+  cl_int transfer_status = clFinish(s.transfer);
+  bool failed = false;
+  s.downloads.push_back(s.packed);
+  s.packed = nullptr;
+  for (cl_event &event : s.downloads) {
+    if (!event) {
+      continue;
+    }
+    cl_int done = CL_COMPLETE;
+    clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(done),
+                   &done, nullptr);
+    failed |= done < 0;
+    release(event);
+  }
+  s.downloads.clear();
+  s.next_output = 0;
+  check(status, "clFinish");
+  check(transfer_status, "clFinish");
+  if (failed) {
+    throw std::runtime_error("Reprojecting on the GPU failed.");
+  }
+}
+
+#else
+
+bool gpu_available() { return false; }
+
+std::string gpu_device_name() { return ""; }
+
+bool gpu_supports(const Image *in, const Image *out, Interpolation im) {
+  return false;
+}
+
+struct GpuStream::State {};
+
+GpuStream::GpuStream() {
+  throw std::runtime_error("Built without the OpenCL backend, see "
+                           "REPROJECT_OPENCL.");
+}
+
+GpuStream::~GpuStream() = default;
+
+void GpuStream::upload(const Image &in) {}
+
+void GpuStream::reproject(Image &out, int num_samples, Interpolation im,
+                          const OutputTransform *transform,
+                          uint8_t *coverage) {}
+
+void GpuStream::finish() {}
+
+#endif
+
+} // namespace reproject
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "reproject.hpp"
+
+namespace reproject {
+
+/**
+ * Whether this build has the OpenCL backend (REPROJECT_OPENCL) and it found a
+ * GPU to run on.
+ */
+bool gpu_available();
+
+/** Name of the GPU of the backend, empty without one. */
+std::string gpu_device_name();
+
+/**
+ * Whether the GPU reprojects in onto out: both lenses rectilinear or
+ * equidistant, up to four channels and any interpolation but TRILINEAR.
+ * BILINEAR uses the texture units of the GPU, of which the weights have 8
+ * fractional bits, so it may differ from the CPU by about 1/256 of the
+ * difference between adjacent pixels. The others differ at most in rounding.
+ */
+bool gpu_supports(const Image *in, const Image *out, Interpolation im);
+
+/**
+ * Queues of work on the GPU for one thread. The input is uploaded once and
+ * then reprojected onto any number of outputs, each downloaded while the
+ * next one is computed. Transfers and kernels run on separate queues, so the
+ * upload of one frame also overlaps the kernels of a previous one. Calls do
+ * not block until finish(): the pixels of the input and outputs must stay
+ * valid until then.
+ */
+class GpuStream {
+public:
+  /** @throws std::runtime_error if there is no GPU, see gpu_available(). */
+  GpuStream();
+  ~GpuStream();
+
+  /** Uploads in, which subsequent reproject() calls read. */
+  void upload(const Image &in);
+
+  /**
+   * Reprojects the uploaded input onto out, like reproject() without a map.
+   * Writes to coverage, if set, whether each output pixel is covered by the
+   * input, see ReprojectionMap.
+   * @throws std::invalid_argument if there is no input or the images are not
+   * supported, see gpu_supports().
+   */
+  void reproject(Image &out, int num_samples, Interpolation im,
+                 const OutputTransform *transform = nullptr,
+                 uint8_t *coverage = nullptr);
+
+  /**
+   * Waits until all uploads, kernels and downloads are done.
+   * @throws std::runtime_error if any of them failed.
+   */
+  void finish();
+
+private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+} // namespace reproject
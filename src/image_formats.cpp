@@ -7,68 +7,198 @@
 #include <ImfInputFile.h>
 #include <ImfNamespace.h>
 #include <ImfOutputFile.h>
+#include <ImfTestFile.h>
+#include <ImfThreading.h>
+#include <ImfTileDescription.h>
+#include <ImfTiledInputFile.h>
+#include <ImfTiledOutputFile.h>
 #include <lodepng.h>
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <stdexcept>
+#include <unordered_map>
 
 #include "Tracy.hpp"
+#include "color.hpp"
 
 namespace reproject {
 
-void save_png(const reproject::Image &output, std::string output_file) {
-  ZoneScoped;
+template <typename T>
+static void convert_to_png(const reproject::Image &output, int png_channels,
+                           uint8_t *image_buf) {
+  const int ps = pixel_stride(output);
+  const size_t cs = channel_stride(output);
+  int color_channels = std::min(output.channels, png_channels);
+  const float *thresholds = linear_to_png_thresholds().data();
 
-  uint8_t *image_buf = new uint8_t[output.width * output.height * 4];
-  float vmax = 0.0f;
-  float vmin = 1.0f;
+  const T *data = pixels<T>(output);
   for (int y = 0; y < output.height; ++y) {
     for (int x = 0; x < output.width; ++x) {
-      for (int c = 0; c < output.channels; ++c) {
-        float s = output.data[((y * output.width) + x) * output.channels + c];
-        vmax = std::max(vmax, s);
-        vmin = std::min(vmin, s);
-        s = std::max(0.0f, std::min(1.0f, s));
-        s = std::pow(s, 1.0f / 2.2f);
-        uint8_t d = uint8_t(255.9f * s);
-        image_buf[((y * output.width) + x) * 4 + c] = d;
+      size_t i = size_t(y) * output.width + x;
+      uint8_t *dst = &image_buf[i * png_channels];
+      for (int c = 0; c < color_channels; ++c) {
+        dst[c] = linear_to_png(data[i * ps + c * cs], thresholds);
       }
-      if (output.channels != 4) {
-        image_buf[((y * output.width) + x) * 4 + 3] = 255;
+      for (int c = color_channels; c < png_channels; ++c) {
+        dst[c] = 0;
       }
     }
   }
+}
+
+PngFilter parse_png_filter(const std::string &name) {
+  // clang-format off
+  if (name == "zero")    return PNG_FILTER_ZERO;
+  if (name == "minsum")  return PNG_FILTER_MINSUM;
+  if (name == "entropy") return PNG_FILTER_ENTROPY;
+  if (name == "brute")   return PNG_FILTER_BRUTE_FORCE;
+  // clang-format on
+  throw std::invalid_argument("Unknown PNG filter: " + name);
+}
+
+static void apply_png_options(const PngOptions &options,
+                              LodePNGEncoderSettings &settings) {
+  switch (options.filter) {
+  case PNG_FILTER_ZERO:
+    settings.filter_strategy = LFS_ZERO;
+    break;
+  case PNG_FILTER_MINSUM:
+    settings.filter_strategy = LFS_MINSUM;
+    break;
+  case PNG_FILTER_ENTROPY:
+    settings.filter_strategy = LFS_ENTROPY;
+    break;
+  case PNG_FILTER_BRUTE_FORCE:
+    settings.filter_strategy = LFS_BRUTE_FORCE;
+    break;
+  }
+
+  // LZ77 window size, nice match length and lazy matching per level. Level 5
+  // are lodepng's defaults.
+  // clang-format off
+  static const unsigned zlib_levels[9][3] = {
+    {  256,  16, 0}, {  512,  32, 0}, { 1024,  64, 0},
+    { 2048,  64, 1}, { 2048, 128, 1}, { 4096, 128, 1},
+    { 8192, 258, 1}, {16384, 258, 1}, {32768, 258, 1},
+  };
+  // clang-format on
+  LodePNGCompressSettings &zlib = settings.zlibsettings;
+  if (options.level <= 0) {
+    zlib.btype = 0;
+    zlib.use_lz77 = 0;
+    // Do not spend a pass over the pixels looking for a smaller color type.
+    settings.auto_convert = 0;
+  } else {
+    const unsigned *l = zlib_levels[std::min(options.level, 9) - 1];
+    zlib.btype = 2;
+    zlib.use_lz77 = 1;
+    zlib.windowsize = l[0];
+    zlib.nicematch = l[1];
+    zlib.lazymatching = l[2];
+  }
+}
+
+void save_png(const reproject::Image &output, std::string output_file,
+              const PngOptions &options, BufferPool *pool) {
+  ZoneScoped;
+
+  const int channels = png_channels(output);
+  size_t bytes = size_t(output.width) * output.height * channels;
+  std::shared_ptr<uint8_t> buffer;
+  if (pool != nullptr) {
+    buffer = pool->acquire_array<uint8_t>(bytes);
+  } else {
+    buffer.reset(new uint8_t[bytes], std::default_delete<uint8_t[]>());
+  }
+  uint8_t *image_buf = buffer.get();
+  if (output.format == F16) {
+    convert_to_png<half>(output, channels, image_buf);
+  } else {
+    convert_to_png<float>(output, channels, image_buf);
+  }
+  save_png(image_buf, output.width, output.height, channels, output_file,
+           options);
+}
+
+int png_channels(const reproject::Image &img) {
+  return img.data_layout == RGBA || img.data_layout == RGBAZ ? 4 : 3;
+}
+
+void save_png(const uint8_t *image_buf, int width, int height, int channels,
+              std::string output_file, const PngOptions &options) {
+  ZoneScoped;
+  lodepng::State state;
+  LodePNGColorType color_type = channels == 4 ? LCT_RGBA : LCT_RGB;
+  state.info_raw.colortype = color_type;
+  state.info_raw.bitdepth = 8;
+  state.info_png.color.colortype = color_type;
+  state.info_png.color.bitdepth = 8;
+  apply_png_options(options, state.encoder);
+
+  std::vector<uint8_t> png;
   {
     ZoneScopedN("lodepng::encode");
-    lodepng::encode(output_file.c_str(), image_buf, output.width,
-                    output.height);
+    unsigned error = lodepng::encode(png, image_buf, width, height, state);
+    if (error) {
+      throw std::runtime_error(output_file + ": " + lodepng_error_text(error));
+    }
+  }
+  if (lodepng::save_file(png, output_file)) {
+    throw std::runtime_error("cannot write " + output_file);
   }
-  delete[] image_buf;
 }
 
-reproject::Image read_png(std::string input_file) {
+template <typename T>
+static void convert_from_png(const uint8_t *color_data,
+                             reproject::Image &input) {
+  const int ps = pixel_stride(input);
+  const size_t cs = channel_stride(input);
+  const float *to_linear = png_to_linear_table().data();
+  T *data = pixels<T>(input);
+  for (int y = 0; y < input.height; ++y) {
+    for (int x = 0; x < input.width; ++x) {
+      const uint8_t *p = &color_data[(size_t(y) * input.width + x) * 3];
+      size_t oo = (size_t(y) * input.width + x) * ps;
+      data[oo + 0 * cs] = to_linear[p[0]];
+      data[oo + 1 * cs] = to_linear[p[1]];
+      data[oo + 2 * cs] = to_linear[p[2]];
+    }
+  }
+}
+
+reproject::Image read_png(std::string input_file, Storage storage,
+                          PixelFormat format, BufferPool *pool) {
   ZoneScoped;
   std::vector<uint8_t> data;
-  lodepng::load_file(data, input_file);
+  if (lodepng::load_file(data, input_file)) {
+    throw std::runtime_error("cannot read " + input_file);
+  }
 
   unsigned int w, h;
   std::vector<uint8_t> color_data;
-  lodepng::decode(color_data, w, h, data);
+  unsigned error = lodepng::decode(color_data, w, h, data, LCT_RGB, 8);
+  if (error) {
+    throw std::runtime_error(input_file + ": " + lodepng_error_text(error));
+  }
 
   reproject::Image input;
   input.width = w;
   input.height = h;
   input.channels = 3;
-  input.data = new float[input.width * input.height * input.channels];
+  input.storage = storage;
+  input.format = format;
   {
-    ZoneScopedN("convert EXR to float buffer");
-    for (int y = 0; y < input.height; ++y) {
-      for (int x = 0; x < input.width; ++x) {
-        uint8_t *p = &color_data[(y * w + x) * 4];
-        int oo = (y * input.width + x) * input.channels;
-        input.data[oo + 0] = std::pow(float(p[0]) / 255.0f, 2.2f);
-        input.data[oo + 1] = std::pow(float(p[1]) / 255.0f, 2.2f);
-        input.data[oo + 2] = std::pow(float(p[2]) / 255.0f, 2.2f);
-      }
+    ZoneScopedN("convert PNG to float buffer");
+    allocate_pixels(input, pool);
+    if (format == F16) {
+      convert_from_png<half>(color_data.data(), input);
+    } else {
+      convert_from_png<float>(color_data.data(), input);
     }
   }
   input.data_layout = reproject::RGB;
@@ -76,143 +206,506 @@ reproject::Image read_png(std::string input_file) {
   return input;
 }
 
-reproject::Image read_exr(std::string input_file) {
-  ZoneScoped;
-  using namespace Imf;
-
-  InputFile file(input_file.c_str());
-  Imath::Box2i dw = file.header().dataWindow();
+reproject::Image read_image(std::string input_file, Storage storage,
+                            PixelFormat format, BufferPool *pool) {
+  size_t dot = input_file.rfind('.');
+  std::string extension = dot == std::string::npos ? "" : input_file.substr(dot);
+  if (extension == ".exr") {
+    return read_exr(input_file, storage, format, pool);
+  } else if (extension == ".png") {
+    return read_png(input_file, storage, format, pool);
+  }
+  throw std::invalid_argument("Unsupported image file: " + input_file);
+}
 
-  reproject::Image input;
-  input.width = dw.max.x - dw.min.x + 1;
-  input.height = dw.max.y - dw.min.y + 1;
-  input.channels = 0;
+ImageHeader read_image_header(std::string input_file) {
+  ZoneScoped;
+  size_t dot = input_file.rfind('.');
+  std::string extension = dot == std::string::npos ? "" : input_file.substr(dot);
+  ImageHeader header;
+  if (extension == ".exr") {
+    Imf::InputFile file(input_file.c_str());
+    Imath::Box2i dw = file.header().dataWindow();
+    header.width = dw.max.x - dw.min.x + 1;
+    header.height = dw.max.y - dw.min.y + 1;
+    header.channels = 0;
+    const Imf::ChannelList &channels = file.header().channels();
+    for (auto it = channels.begin(); it != channels.end(); ++it) {
+      header.channels++;
+    }
+    return header;
+  } else if (extension == ".png") {
+    // The signature and IHDR chunk, which holds the dimensions.
+    std::vector<uint8_t> data(33);
+    std::ifstream in(input_file, std::ios::binary);
+    if (!in.read((char *)data.data(), data.size())) {
+      throw std::runtime_error("cannot read " + input_file);
+    }
+    unsigned int w, h;
+    lodepng::State state;
+    unsigned error = lodepng_inspect(&w, &h, &state, data.data(), data.size());
+    if (error) {
+      throw std::runtime_error(input_file + ": " + lodepng_error_text(error));
+    }
+    header.width = w;
+    header.height = h;
+    // read_png() decodes to RGB.
+    header.channels = 3;
+    return header;
+  }
+  throw std::invalid_argument("Unsupported image file: " + input_file);
+}
 
-  std::vector<half *> halfData;
-  std::vector<std::string> channel_names;
+/**
+ * Returns the channel index in the in-memory image of the EXR channel with the
+ * given name, or -1 if the name is not one of the known channels.
+ */
+static int known_channel_index(const std::string &chname, DataLayout layout) {
+  // clang-format off
+  if (chname == "R") return 0;
+  if (chname == "G") return 1;
+  if (chname == "B") return 2;
+  if (chname == "A") return 3;
+  if (chname == "Z") return layout == RGBAZ ? 4 : 3;
+  // clang-format on
+  return -1;
+}
 
-  FrameBuffer fb;
+/**
+ * Channel layout of the image read from an EXR file with the given header:
+ * sets the data layout and channels of img, and the names of the EXR channels
+ * and the channel of img each of them goes to.
+ */
+static void exr_layout(const Imf::Header &header, reproject::Image &img,
+                       std::vector<std::string> &channel_names,
+                       std::vector<int> &dst_channel) {
   bool found_A = false;
   bool found_Z = false;
 
   // Figure out which channels are present
-  const ChannelList &channels = file.header().channels();
+  const Imf::ChannelList &channels = header.channels();
   for (auto it = channels.begin(); it != channels.end(); ++it) {
     std::string chname = it.name();
     channel_names.push_back(chname);
-    const Channel &channel = it.channel();
 
     found_A |= chname == "A";
     found_Z |= chname == "Z";
   }
 
   if (found_A && found_Z) {
-    input.data_layout = reproject::RGBAZ;
+    img.data_layout = reproject::RGBAZ;
   } else if (found_A) {
-    input.data_layout = reproject::RGBA;
+    img.data_layout = reproject::RGBA;
   } else if (found_Z) {
-    input.data_layout = reproject::RGBZ;
+    img.data_layout = reproject::RGBZ;
   } else {
-    input.data_layout = reproject::RGB;
+    img.data_layout = reproject::RGB;
   }
+  img.channels = channel_names.size();
 
-  // Prepare the frame buffer for the selected channels.
-  input.channels = channel_names.size();
-  for (auto channel_name : channel_names) {
-    ZoneScopedN("prepare_channel");
-    half *buf = new half[input.width * input.height];
-    size_t dts = sizeof(*buf);
-    fb.insert(channel_name, Slice{HALF, (char *)buf, dts, input.width * dts});
-    halfData.push_back(buf);
+  // Known channels go to their fixed place, other channels fill up the
+  // remaining places in file order.
+  dst_channel.assign(img.channels, -1);
+  std::vector<bool> taken(img.channels, false);
+  for (int c = 0; c < img.channels; ++c) {
+    int dstC = known_channel_index(channel_names[c], img.data_layout);
+    if (dstC >= 0 && dstC < img.channels && !taken[dstC]) {
+      dst_channel[c] = dstC;
+      taken[dstC] = true;
+    }
   }
+  int next_free = 0;
+  for (int c = 0; c < img.channels; ++c) {
+    if (dst_channel[c] < 0) {
+      while (taken[next_free]) {
+        next_free++;
+      }
+      dst_channel[c] = next_free;
+      taken[next_free] = true;
+    }
+  }
+}
 
-  {
+/**
+ * Frame buffer that decodes the channels of an EXR file with data window dw
+ * into the pixels of img, of which the first is pixel (x0, y0) of the window.
+ */
+static Imf::FrameBuffer exr_frame_buffer(const reproject::Image &img,
+                                         const Imath::Box2i &dw, int x0, int y0,
+                                         const std::vector<std::string> &names,
+                                         const std::vector<int> &dst_channel) {
+  // OpenEXR converts to the requested pixel type while decoding, straight
+  // into the destination layout, so no intermediate buffers are needed.
+  Imf::PixelType type = img.format == F16 ? Imf::HALF : Imf::FLOAT;
+  char *data = (char *)pixel_data(img);
+  const size_t dts = element_size(img);
+  const size_t ps = pixel_stride(img);
+  const size_t cs = channel_stride(img);
+  const ptrdiff_t origin =
+      (ptrdiff_t(dw.min.y + y0) * img.width + dw.min.x + x0) * ps;
+  Imf::FrameBuffer fb;
+  for (size_t c = 0; c < names.size(); ++c) {
+    // Slices are addressed by absolute pixel coordinates.
+    char *base = data + (ptrdiff_t(dst_channel[c] * cs) - origin) * dts;
+    fb.insert(names[c],
+              Imf::Slice{type, base, ps * dts, img.width * ps * dts});
+  }
+  return fb;
+}
+
+reproject::Image read_exr(std::string input_file, Storage storage,
+                          PixelFormat format, BufferPool *pool) {
+  ZoneScoped;
+  using namespace Imf;
+
+  // Tiled and multi-resolution files are read from their full resolution
+  // level, tile by tile rather than through scan lines.
+  std::unique_ptr<InputFile> lines;
+  std::unique_ptr<TiledInputFile> tiles;
+  if (isTiledOpenExrFile(input_file.c_str())) {
+    tiles.reset(new TiledInputFile(input_file.c_str()));
+  } else {
+    lines.reset(new InputFile(input_file.c_str()));
+  }
+  const Header &header = tiles ? tiles->header() : lines->header();
+  Imath::Box2i dw = header.dataWindow();
+
+  reproject::Image input;
+  input.width = dw.max.x - dw.min.x + 1;
+  input.height = dw.max.y - dw.min.y + 1;
+  input.channels = 0;
+  input.storage = storage;
+  input.format = format;
+
+  std::vector<std::string> channel_names;
+  std::vector<int> dst_channel;
+  exr_layout(header, input, channel_names, dst_channel);
+  allocate_pixels(input, pool);
+
+  FrameBuffer fb = exr_frame_buffer(input, dw, 0, 0, channel_names, dst_channel);
+  if (tiles) {
+    ZoneScopedN("read_tiles()");
+    tiles->setFrameBuffer(fb);
+    tiles->readTiles(0, tiles->numXTiles(0) - 1, 0, tiles->numYTiles(0) - 1);
+  } else {
     ZoneScopedN("read_pixels()");
-    file.setFrameBuffer(fb);
-    file.readPixels(dw.min.y, dw.max.y);
+    lines->setFrameBuffer(fb);
+    lines->readPixels(dw.min.y, dw.max.y);
   }
 
-  {
-    ZoneScopedN("convert EXR to float buffer");
-    input.data = new float[input.width * input.height * input.channels];
-    for (int c = 0; c < input.channels; ++c) {
-      std::string chname = channel_names[c];
-      int dstC = 0;
-
-      // clang-format off
-      if (chname == "R") dstC = 0;
-      if (chname == "G") dstC = 1;
-      if (chname == "B") dstC = 2;
-      if (input.data_layout == RGBA) {
-        if (chname == "A") dstC = 3;
-        if (chname == "Z") dstC = -1000;
-      } else if (input.data_layout == RGBZ) {
-        if (chname == "A") dstC = -1000;
-        if (chname == "Z") dstC = 3;
-      } else if (input.data_layout == RGBAZ) {
-        if (chname == "A") dstC = 3;
-        if (chname == "Z") dstC = 4;
-      }
-      // clang-format off
-
-      for (int y = 0; y < input.height; ++y) {
-        for (int x = 0; x < input.width; ++x) {
-          int ro = y * input.width + x;
-          input.data[(y * input.width + x) * input.channels + dstC] =
-              float(halfData[c][ro]);
-        }
+  return input;
+}
+
+struct ExrRegionReader::State {
+  std::unique_ptr<Imf::InputFile> lines;
+  std::unique_ptr<Imf::TiledInputFile> tiles;
+  Imath::Box2i dw;
+  std::vector<std::string> channel_names;
+  std::vector<int> dst_channel;
+  int tile_width{0};
+  int tile_height{0};
+  int x_tiles{0};
+  // Decoded tiles by index, and their indices from the most to the least
+  // recently used.
+  std::unordered_map<int, std::pair<reproject::Image, std::list<int>::iterator>>
+      cache;
+  std::list<int> lru;
+  size_t cached_bytes{0};
+  size_t cache_bytes;
+};
+
+ExrRegionReader::ExrRegionReader(std::string input_file, PixelFormat format,
+                                 size_t cache_bytes)
+    : state_(new State) {
+  State &s = *state_;
+  s.cache_bytes = cache_bytes;
+  if (Imf::isTiledOpenExrFile(input_file.c_str())) {
+    s.tiles.reset(new Imf::TiledInputFile(input_file.c_str()));
+    s.tile_width = s.tiles->tileXSize();
+    s.tile_height = s.tiles->tileYSize();
+    s.x_tiles = s.tiles->numXTiles(0);
+  } else {
+    s.lines.reset(new Imf::InputFile(input_file.c_str()));
+  }
+  const Imf::Header &header = s.tiles ? s.tiles->header() : s.lines->header();
+  s.dw = header.dataWindow();
+  frame_.width = s.dw.max.x - s.dw.min.x + 1;
+  frame_.height = s.dw.max.y - s.dw.min.y + 1;
+  frame_.data = nullptr;
+  frame_.storage = INTERLEAVED;
+  frame_.format = format;
+  exr_layout(header, frame_, s.channel_names, s.dst_channel);
+  region_ = frame_;
+  region_.height = 0;
+}
+
+ExrRegionReader::~ExrRegionReader() = default;
+
+bool ExrRegionReader::tiled() const { return state_->tiles != nullptr; }
+
+const reproject::Image &ExrRegionReader::read(const PixelRect &rect) {
+  ZoneScoped;
+  if (rect.x0 < 0 || rect.y0 < 0 || rect.x1 > frame_.width ||
+      rect.y1 > frame_.height || rect.empty()) {
+    throw std::invalid_argument("Invalid region of pixels.");
+  }
+  if (state_->tiles) {
+    read_tiles(rect);
+  } else {
+    read_rows(rect.y0, rect.y1);
+  }
+  return region_;
+}
+
+void ExrRegionReader::read_rows(int y0, int y1) {
+  const size_t pitch = size_t(frame_.width) * frame_.channels *
+                       element_size(frame_);
+  // Rows the previous band also held stay, moved to their new place.
+  const int keep0 = std::max(y0, region_y0_);
+  const int keep1 = std::min(y1, region_y0_ + region_.height);
+  reproject::Image band = region_;
+  band.height = y1 - y0;
+  if (num_elements(band) > capacity_) {
+    allocate_pixels(band);
+    capacity_ = num_elements(band);
+  }
+  if (keep0 < keep1) {
+    std::memmove((char *)pixel_data(band) + (keep0 - y0) * pitch,
+                 (const char *)pixel_data(region_) +
+                     (keep0 - region_y0_) * pitch,
+                 (keep1 - keep0) * pitch);
+  }
+  region_ = band;
+  region_y0_ = y0;
+
+  State &s = *state_;
+  auto read = [&](int r0, int r1) {
+    if (r0 >= r1) {
+      return;
+    }
+    ZoneScopedN("read_pixels()");
+    s.lines->setFrameBuffer(exr_frame_buffer(region_, s.dw, 0, y0,
+                                             s.channel_names, s.dst_channel));
+    s.lines->readPixels(s.dw.min.y + r0, s.dw.min.y + r1 - 1);
+    decoded_pixels_ += uint64_t(r1 - r0) * frame_.width;
+  };
+  if (keep0 < keep1) {
+    read(y0, keep0);
+    read(keep1, y1);
+  } else {
+    read(y0, y1);
+  }
+}
+
+void ExrRegionReader::read_tiles(const PixelRect &rect) {
+  State &s = *state_;
+  const int tx0 = rect.x0 / s.tile_width;
+  const int tx1 = (rect.x1 - 1) / s.tile_width;
+  const int ty0 = rect.y0 / s.tile_height;
+  const int ty1 = (rect.y1 - 1) / s.tile_height;
+  reproject::Image region = region_;
+  region_x0_ = tx0 * s.tile_width;
+  region_y0_ = ty0 * s.tile_height;
+  region.width =
+      std::min(frame_.width, (tx1 + 1) * s.tile_width) - region_x0_;
+  region.height =
+      std::min(frame_.height, (ty1 + 1) * s.tile_height) - region_y0_;
+  if (num_elements(region) > capacity_) {
+    allocate_pixels(region);
+    capacity_ = num_elements(region);
+  }
+  region_ = region;
+
+  const size_t pixel_bytes = frame_.channels * element_size(frame_);
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      reproject::Image t = tile(tx, ty);
+      const int ox = tx * s.tile_width - region_x0_;
+      const int oy = ty * s.tile_height - region_y0_;
+      for (int y = 0; y < t.height; ++y) {
+        std::memcpy((char *)pixel_data(region_) +
+                        (size_t(oy + y) * region_.width + ox) * pixel_bytes,
+                    (const char *)pixel_data(t) +
+                        size_t(y) * t.width * pixel_bytes,
+                    t.width * pixel_bytes);
       }
     }
   }
+}
 
-  for (half *ptr : halfData) {
-    ZoneScopedN("free_f16");
-    delete[] ptr;
+reproject::Image ExrRegionReader::tile(int tx, int ty) {
+  State &s = *state_;
+  const int index = ty * s.x_tiles + tx;
+  auto it = s.cache.find(index);
+  if (it != s.cache.end()) {
+    s.lru.splice(s.lru.begin(), s.lru, it->second.second);
+    return it->second.first;
   }
 
-  return input;
+  ZoneScopedN("read_tile()");
+  reproject::Image t = frame_;
+  t.width = std::min(s.tile_width, frame_.width - tx * s.tile_width);
+  t.height = std::min(s.tile_height, frame_.height - ty * s.tile_height);
+  const size_t bytes = num_elements(t) * element_size(t);
+  // Make room first, such that the cache always holds the newest tile.
+  while (!s.lru.empty() && s.cached_bytes + bytes > s.cache_bytes) {
+    auto victim = s.cache.find(s.lru.back());
+    s.cached_bytes -= num_elements(victim->second.first) *
+                      element_size(victim->second.first);
+    s.cache.erase(victim);
+    s.lru.pop_back();
+  }
+  allocate_pixels(t);
+  s.tiles->setFrameBuffer(exr_frame_buffer(t, s.dw, tx * s.tile_width,
+                                           ty * s.tile_height, s.channel_names,
+                                           s.dst_channel));
+  s.tiles->readTile(tx, ty);
+  decoded_pixels_ += uint64_t(t.width) * t.height;
+
+  s.lru.push_front(index);
+  s.cache.emplace(index, std::make_pair(t, s.lru.begin()));
+  s.cached_bytes += bytes;
+  return t;
 }
 
-void save_exr(const reproject::Image &output, std::string output_file) {
-  ZoneScoped;
-  using namespace Imf;
+ExrCompression parse_exr_compression(const std::string &name) {
+  // clang-format off
+  if (name == "none") return EXR_NONE;
+  if (name == "zips") return EXR_ZIPS;
+  if (name == "zip")  return EXR_ZIP;
+  if (name == "piz")  return EXR_PIZ;
+  if (name == "dwaa") return EXR_DWAA;
+  // clang-format on
+  throw std::invalid_argument("Unknown EXR compression: " + name);
+}
+
+void set_exr_threads(int num_threads) { Imf::setGlobalThreadCount(num_threads); }
+
+static Imf::Compression to_imf_compression(ExrCompression compression) {
+  switch (compression) {
+  case EXR_NONE:
+    return Imf::NO_COMPRESSION;
+  case EXR_ZIPS:
+    return Imf::ZIPS_COMPRESSION;
+  case EXR_ZIP:
+    return Imf::ZIP_COMPRESSION;
+  case EXR_PIZ:
+    return Imf::PIZ_COMPRESSION;
+  case EXR_DWAA:
+    return Imf::DWAA_COMPRESSION;
+  }
+  throw std::invalid_argument("Unknown EXR compression.");
+}
 
-  std::vector<std::string> channel_names = {"R", "G", "B", "A", "Z"};
-  if (output.channels > channel_names.size()) {
+/**
+ * Header of an EXR file holding the channels of output, as HALF.
+ */
+static Imf::Header exr_header(const reproject::Image &output,
+                              const ExrOptions &options) {
+  using namespace Imf;
+  static const char *channel_names[] = {"R", "G", "B", "A", "Z"};
+  if (output.channels > 5) {
     throw std::runtime_error("cannot save exr with more than 5 channels.");
   }
-  std::vector<half *> halfData;
-  FrameBuffer fb;
   Header header(output.width, output.height);
   for (int i = 0; i < output.channels; ++i) {
-    ZoneScopedN("convert_f32_to_f16");
     header.channels().insert(channel_names[i], Channel(HALF));
-    half *buf = new half[output.width * output.height];
-    for (int y = 0; y < output.height; ++y) {
-      for (int x = 0; x < output.width; ++x) {
-        int ro = (output.width * y + x) * output.channels + i;
-        buf[y * output.width + x] = output.data[ro];
-      }
-    }
-    size_t dts = sizeof(*buf);
-    Slice slice{HALF, (char *)buf, dts, dts * output.width};
-    fb.insert(channel_names[i], slice);
-    halfData.push_back(buf);
   }
+  header.compression() = to_imf_compression(options.compression);
+  header.zipCompressionLevel() = options.zip_level;
+  header.dwaCompressionLevel() = options.dwa_level;
+  if (options.tile_size > 0) {
+    header.setTileDescription(
+        TileDescription(options.tile_size, options.tile_size, ONE_LEVEL));
+  }
+  return header;
+}
 
-  header.zipCompressionLevel() = 9;
+/**
+ * Frame buffer with the pixels of output, of which the first row is row y0 of
+ * the file.
+ */
+static Imf::FrameBuffer exr_output_frame_buffer(const reproject::Image &output,
+                                                int y0) {
+  using namespace Imf;
+  static const char *channel_names[] = {"R", "G", "B", "A", "Z"};
+  const size_t ps = pixel_stride(output);
+  const size_t cs = channel_stride(output);
 
+  // Channels are stored as HALF: OpenEXR converts from FLOAT slices while
+  // encoding, HALF slices are written as they are.
+  PixelType type = output.format == F16 ? HALF : FLOAT;
+  const size_t dts = element_size(output);
+  // Slices are addressed by absolute pixel coordinates.
+  char *data = (char *)pixel_data(output) -
+               ptrdiff_t(y0) * ps * dts * output.width;
+  FrameBuffer fb;
+  for (int i = 0; i < output.channels; ++i) {
+    Slice slice{type, data + i * cs * dts, ps * dts, ps * dts * output.width};
+    fb.insert(channel_names[i], slice);
+  }
+  return fb;
+}
+
+void save_exr(const reproject::Image &output, std::string output_file,
+              const ExrOptions &options) {
+  ZoneScoped;
+  Imf::Header header = exr_header(output, options);
   {
     ZoneScopedN("write");
-    OutputFile of(output_file.c_str(), header);
-    of.setFrameBuffer(fb);
-    of.writePixels(output.height);
+    if (options.tile_size > 0) {
+      Imf::TiledOutputFile of(output_file.c_str(), header);
+      of.setFrameBuffer(exr_output_frame_buffer(output, 0));
+      of.writeTiles(0, of.numXTiles(0) - 1, 0, of.numYTiles(0) - 1);
+    } else {
+      Imf::OutputFile of(output_file.c_str(), header);
+      of.setFrameBuffer(exr_output_frame_buffer(output, 0));
+      of.writePixels(output.height);
+    }
   }
+}
+
+struct ExrBandWriter::State {
+  std::unique_ptr<Imf::OutputFile> lines;
+  std::unique_ptr<Imf::TiledOutputFile> tiles;
+  int tile_size;
+};
 
-  for (half *ptr : halfData) {
-    ZoneScopedN("free_f16");
-    delete[] ptr;
+ExrBandWriter::ExrBandWriter(std::string output_file,
+                             const reproject::Image &frame,
+                             const ExrOptions &options)
+    : state_(new State), height_(frame.height) {
+  Imf::Header header = exr_header(frame, options);
+  state_->tile_size = options.tile_size;
+  if (options.tile_size > 0) {
+    state_->tiles.reset(new Imf::TiledOutputFile(output_file.c_str(), header));
+  } else {
+    state_->lines.reset(new Imf::OutputFile(output_file.c_str(), header));
+  }
+}
+
+ExrBandWriter::~ExrBandWriter() = default;
+
+void ExrBandWriter::write(const reproject::Image &band) {
+  ZoneScopedN("write");
+  if (next_row_ + band.height > height_ || band.storage != INTERLEAVED) {
+    throw std::invalid_argument("Band does not fit the EXR file.");
+  }
+  if (state_->tiles) {
+    const int ts = state_->tile_size;
+    if (band.height % ts != 0 && next_row_ + band.height != height_) {
+      throw std::invalid_argument(
+          "Bands of tiled EXR files must hold whole rows of tiles.");
+    }
+    state_->tiles->setFrameBuffer(exr_output_frame_buffer(band, next_row_));
+    state_->tiles->writeTiles(0, state_->tiles->numXTiles(0) - 1,
+                              next_row_ / ts,
+                              (next_row_ + band.height - 1) / ts);
+  } else {
+    state_->lines->setFrameBuffer(exr_output_frame_buffer(band, next_row_));
+    state_->lines->writePixels(band.height);
   }
+  next_row_ += band.height;
 }
 
 } // namespace reproject
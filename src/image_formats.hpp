@@ -1,15 +1,182 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
 
+#include "buffer_pool.hpp"
 #include "reproject.hpp"
 
 namespace reproject {
 
-void save_png(const reproject::Image &img, std::string output_file);
-void save_exr(const reproject::Image &img, std::string output_file);
+enum ExrCompression { EXR_NONE, EXR_ZIPS, EXR_ZIP, EXR_PIZ, EXR_DWAA };
 
-reproject::Image read_exr(std::string input_file);
-reproject::Image read_png(std::string input_file);
+struct ExrOptions {
+  ExrCompression compression{EXR_ZIP};
+  // Used by EXR_ZIP and EXR_ZIPS, 1 (fastest) to 9 (smallest).
+  int zip_level{9};
+  // Used by EXR_DWAA, higher is smaller and lossier.
+  float dwa_level{45.0f};
+  // Square tiles of this many pixels if positive, scan lines otherwise.
+  int tile_size{0};
+};
+
+enum PngFilter {
+  PNG_FILTER_ZERO,
+  PNG_FILTER_MINSUM,
+  PNG_FILTER_ENTROPY,
+  PNG_FILTER_BRUTE_FORCE,
+};
+
+struct PngOptions {
+  PngFilter filter{PNG_FILTER_MINSUM};
+  // zlib effort: 0 stores uncompressed, 1 (fastest) to 9 (smallest). 5 are
+  // lodepng's defaults.
+  int level{5};
+};
+
+/**
+ * @throws std::invalid_argument if name is not one of zero, minsum, entropy,
+ * brute.
+ */
+PngFilter parse_png_filter(const std::string &name);
+
+/**
+ * @throws std::invalid_argument if name is not one of none, zips, zip, piz,
+ * dwaa.
+ */
+ExrCompression parse_exr_compression(const std::string &name);
+
+/**
+ * Number of threads OpenEXR uses internally to compress and decompress line
+ * buffers, shared by all files being read or written. 0 disables threading.
+ */
+void set_exr_threads(int num_threads);
+
+/**
+ * Readers and writers draw their pixel and conversion buffers from pool when
+ * one is given.
+ */
+void save_png(const reproject::Image &img, std::string output_file,
+              const PngOptions &options = {}, BufferPool *pool = nullptr);
+
+/**
+ * Number of 8-bit channels save_png() writes for img: RGBA if it has alpha,
+ * RGB otherwise.
+ */
+int png_channels(const reproject::Image &img);
+
+/**
+ * Saves already gamma encoded 8-bit pixels, with 3 (RGB) or 4 (RGBA) channels
+ * interleaved.
+ */
+void save_png(const uint8_t *image_buf, int width, int height, int channels,
+              std::string output_file, const PngOptions &options = {});
+void save_exr(const reproject::Image &img, std::string output_file,
+              const ExrOptions &options = {});
+
+reproject::Image read_exr(std::string input_file,
+                          Storage storage = INTERLEAVED,
+                          PixelFormat format = F32, BufferPool *pool = nullptr);
+reproject::Image read_png(std::string input_file,
+                          Storage storage = INTERLEAVED,
+                          PixelFormat format = F32, BufferPool *pool = nullptr);
+
+/**
+ * Dimensions and number of channels of the image read_image() would return
+ * for a file, as far as they are known from its header alone.
+ */
+struct ImageHeader {
+  int width, height, channels;
+};
+
+/**
+ * Reads only the header of an EXR or PNG file, depending on its extension.
+ * @throws std::invalid_argument for other extensions.
+ * @throws std::runtime_error if the header cannot be read.
+ */
+ImageHeader read_image_header(std::string input_file);
+
+/**
+ * Reads an EXR or PNG file, depending on its extension.
+ * @throws std::invalid_argument for other extensions.
+ */
+reproject::Image read_image(std::string input_file,
+                            Storage storage = INTERLEAVED,
+                            PixelFormat format = F32,
+                            BufferPool *pool = nullptr);
+
+/**
+ * Reads regions of an EXR file, for images that do not fit in memory or of
+ * which only a part is sampled. Regions are interleaved.
+ *
+ * Scan line files are read in bands of whole rows. Rows the previous band also
+ * held are moved rather than decoded again, so bands that slide down the image
+ * read every row about once.
+ *
+ * Tiled and multi-resolution files are read from their full resolution level,
+ * in whole tiles, such that only the tiles a region touches are decoded. The
+ * most recently used tiles are kept in a cache of cache_bytes, which holds at
+ * least one tile, so regions that overlap decode their shared tiles once.
+ */
+class ExrRegionReader {
+public:
+  /** @throws std::exception if the file cannot be opened. */
+  explicit ExrRegionReader(std::string input_file, PixelFormat format = F32,
+                           size_t cache_bytes = size_t(256) << 20);
+  ~ExrRegionReader();
+
+  /** Dimensions and layout of the whole image, without pixels. */
+  const reproject::Image &frame() const { return frame_; }
+
+  bool tiled() const;
+
+  /**
+   * Returns pixels of the image that include rect, of which the first is at
+   * (x0(), y0()). The pixels stay valid until the next call.
+   */
+  const reproject::Image &read(const PixelRect &rect);
+  int x0() const { return region_x0_; }
+  int y0() const { return region_y0_; }
+
+  /** Number of pixels decoded from the file so far. */
+  uint64_t decoded_pixels() const { return decoded_pixels_; }
+
+private:
+  void read_rows(int y0, int y1);
+  void read_tiles(const PixelRect &rect);
+  reproject::Image tile(int tx, int ty);
+
+  struct State;
+  std::unique_ptr<State> state_;
+  reproject::Image frame_;
+  reproject::Image region_;
+  int region_x0_{0};
+  int region_y0_{0};
+  size_t capacity_{0};
+  uint64_t decoded_pixels_{0};
+};
+
+/**
+ * Writes an EXR file in bands of rows, top to bottom, like save_exr() would
+ * write the whole image. Bands of tiled files hold whole rows of tiles, but
+ * for the last.
+ */
+class ExrBandWriter {
+public:
+  /** frame has the dimensions, channels and format of the whole image. */
+  ExrBandWriter(std::string output_file, const reproject::Image &frame,
+                const ExrOptions &options = {});
+  ~ExrBandWriter();
+
+  /** Writes the rows of band, which is interleaved, below the previous ones. */
+  void write(const reproject::Image &band);
+
+private:
+  struct State;
+  std::unique_ptr<State> state_;
+  int height_;
+  int next_row_{0};
+};
 
 } // namespace reproject
@@ -0,0 +1,232 @@
+#include "journal.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <Tracy.hpp>
+#include <nlohmann/json.hpp>
+
+namespace reproject {
+
+namespace {
+
+const int JOURNAL_VERSION = 1;
+
+/** Size and modification time of file. Returns false if it does not exist. */
+bool stat_file(const std::string &file, FileStamp &stamp) {
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64(file.c_str(), &st) != 0) {
+    return false;
+  }
+  stamp.mtime = int64_t(st.st_mtime) * 1000000000;
+#else
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0) {
+    return false;
+  }
+#ifdef __APPLE__
+  const struct timespec &mtime = st.st_mtimespec;
+#else
+  const struct timespec &mtime = st.st_mtim;
+#endif
+  stamp.mtime = int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+#endif
+  stamp.size = st.st_size;
+  return true;
+}
+
+uint64_t hash_file(const std::string &file) {
+  ZoneScoped;
+  std::ifstream in(file, std::ios::binary);
+  std::vector<char> chunk(1 << 20);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  while (in) {
+    in.read(chunk.data(), chunk.size());
+    size_t n = in.gcount();
+    // Chained: the hash of each chunk goes into the next.
+    hash ^= hash_bytes(chunk.data(), n);
+    hash *= 0x100000001b3ull;
+  }
+  if (in.bad() || !in.eof()) {
+    throw std::runtime_error("Could not read " + file);
+  }
+  return hash;
+}
+
+std::string hex(uint64_t value) {
+  char text[17];
+  std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+  return text;
+}
+
+uint64_t from_hex(const std::string &text) {
+  return std::stoull(text, nullptr, 16);
+}
+
+} // namespace
+
+uint64_t hash_bytes(const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+FileStamp stamp_file(const std::string &file, bool hash) {
+  FileStamp stamp;
+  if (!stat_file(file, stamp)) {
+    throw std::runtime_error("No such file " + file);
+  }
+  if (hash) {
+    stamp.hash = hash_file(file);
+  }
+  return stamp;
+}
+
+Journal::Journal(std::string file) : file_(std::move(file)) {
+  std::ifstream in(file_);
+  if (!in) {
+    return;
+  }
+  try {
+    nlohmann::json journal;
+    in >> journal;
+    if (journal.at("version").get<int>() != JOURNAL_VERSION) {
+      throw std::runtime_error("Unknown version");
+    }
+    for (const auto &item : journal.at("inputs").items()) {
+      const nlohmann::json &entry = item.value();
+      Input &input = inputs_[item.key()];
+      input.stamp.size = entry.at("size").get<uint64_t>();
+      input.stamp.mtime = entry.at("mtime").get<int64_t>();
+      input.stamp.hash = from_hex(entry.at("hash").get<std::string>());
+      for (const auto &output : entry.at("outputs").items()) {
+        Output &o = input.outputs[output.key()];
+        o.settings = from_hex(output.value().at("settings").get<std::string>());
+        o.bytes = output.value().at("bytes").get<uint64_t>();
+        o.mtime = output.value().at("mtime").get<int64_t>();
+      }
+    }
+  } catch (const std::exception &e) {
+    throw std::runtime_error("Could not read journal " + file_ + ": " +
+                             e.what());
+  }
+}
+
+bool Journal::done(const std::string &input, const std::string &output,
+                   uint64_t settings) {
+  FileStamp recorded;
+  Output written;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto in = inputs_.find(input);
+    if (in == inputs_.end()) {
+      return false;
+    }
+    auto out = in->second.outputs.find(output);
+    if (out == in->second.outputs.end() || out->second.settings != settings) {
+      return false;
+    }
+    recorded = in->second.stamp;
+    written = out->second;
+  }
+  FileStamp out_now, in_now;
+  // Another run may have written the output since, with as many bytes.
+  if (!stat_file(output, out_now) || out_now.size != written.bytes ||
+      out_now.mtime != written.mtime ||
+      !stat_file(input, in_now) || in_now.size != recorded.size) {
+    return false;
+  }
+  if (in_now.mtime == recorded.mtime) {
+    return true;
+  }
+  // Touched or copied, possibly without changing.
+  if (hash_file(input) != recorded.hash) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  inputs_[input].stamp.mtime = in_now.mtime;
+  changed_ = true;
+  return true;
+}
+
+void Journal::record(const std::string &input, const FileStamp &stamp,
+                     const std::string &output,
+                     const FileStamp &output_stamp, uint64_t settings) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Input &in = inputs_[input];
+  if (in.stamp.size != stamp.size || in.stamp.hash != stamp.hash) {
+    // Outputs of other contents are out of date.
+    in.outputs.clear();
+  }
+  in.stamp = stamp;
+  in.outputs[output] = {settings, output_stamp.size, output_stamp.mtime};
+  changed_ = true;
+}
+
+void Journal::save() {
+  ZoneScoped;
+  std::lock_guard<std::mutex> save_lock(save_mutex_);
+  nlohmann::json journal;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    journal["version"] = JOURNAL_VERSION;
+    nlohmann::json &inputs = journal["inputs"] = nlohmann::json::object();
+    for (const auto &in : inputs_) {
+      nlohmann::json &entry = inputs[in.first];
+      entry["size"] = in.second.stamp.size;
+      entry["mtime"] = in.second.stamp.mtime;
+      entry["hash"] = hex(in.second.stamp.hash);
+      nlohmann::json &outputs = entry["outputs"] = nlohmann::json::object();
+      for (const auto &out : in.second.outputs) {
+        outputs[out.first] = {{"settings", hex(out.second.settings)},
+                              {"bytes", out.second.bytes},
+                              {"mtime", out.second.mtime}};
+      }
+    }
+    changed_ = false;
+    saved_ = Stopwatch();
+  }
+
+  std::random_device random;
+  std::string tmp = file_ + ".tmp" + std::to_string(random());
+  {
+    std::ofstream out(tmp);
+    out << journal.dump(1) << "\n";
+    if (!out) {
+      std::remove(tmp.c_str());
+      throw std::runtime_error("Could not write journal " + tmp);
+    }
+  }
+  if (std::rename(tmp.c_str(), file_.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    throw std::runtime_error("Could not write journal " + file_);
+  }
+}
+
+void Journal::save_if_due(double seconds) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!changed_ || saved_.seconds() < seconds) {
+      return;
+    }
+  }
+  save();
+}
+
+} // namespace reproject
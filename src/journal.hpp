@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "metrics.hpp"
+
+namespace reproject {
+
+/**
+ * 64-bit FNV-1a hash of data, taken over 64-bit words and then the remaining
+ * bytes.
+ */
+uint64_t hash_bytes(const void *data, size_t size);
+
+/**
+ * What identifies the contents of a file: its size, its modification time in
+ * nanoseconds, and the hash_bytes() of its contents, chained over chunks.
+ */
+struct FileStamp {
+  uint64_t size{0};
+  int64_t mtime{0};
+  uint64_t hash{0};
+};
+
+/**
+ * Stamp of file, with the hash if hash is set.
+ * @throws std::runtime_error if the file cannot be read.
+ */
+FileStamp stamp_file(const std::string &file, bool hash = true);
+
+/**
+ * Record of the outputs completed by runs over a batch, such that a rerun
+ * only makes the ones that are missing or out of date. For every output it
+ * holds the hash of the settings it was made with, its size and modification
+ * time, and the stamp of the input it was made from. Outputs should only be
+ * recorded once they are written and closed, so that ones cut short by a
+ * crash do not count.
+ * Thread-safe.
+ */
+class Journal {
+public:
+  /**
+   * Loads file, if it exists.
+   * @throws std::runtime_error if it exists but does not hold a journal.
+   */
+  explicit Journal(std::string file);
+
+  /**
+   * Whether output was recorded for input with these settings and still
+   * holds what was recorded: it has the size and modification time it had,
+   * and input the size and modification time it had. Inputs with only
+   * another modification time are hashed, and still count if their contents
+   * are the same.
+   */
+  bool done(const std::string &input, const std::string &output,
+            uint64_t settings);
+
+  /**
+   * Records output, with the stamp_file() of it without hash, as made from
+   * input with settings.
+   */
+  void record(const std::string &input, const FileStamp &stamp,
+              const std::string &output, const FileStamp &output_stamp,
+              uint64_t settings);
+
+  /**
+   * Writes the journal to a temporary file that is then renamed over the
+   * file, such that it is complete even if the process is killed.
+   * @throws std::runtime_error if it cannot be written.
+   */
+  void save();
+
+  /** Saves if anything was recorded since the last save, seconds ago. */
+  void save_if_due(double seconds);
+
+private:
+  struct Output {
+    uint64_t settings;
+    uint64_t bytes;
+    int64_t mtime;
+  };
+  struct Input {
+    FileStamp stamp;
+    std::map<std::string, Output> outputs;
+  };
+
+  std::string file_;
+  std::mutex mutex_;
+  // Held while saving, such that saves land in order.
+  std::mutex save_mutex_;
+  std::map<std::string, Input> inputs_;
+  bool changed_{false};
+  Stopwatch saved_;
+};
+
+} // namespace reproject
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <type_traits>
+
+#include "reproject.hpp"
+
+namespace reproject {
+
+template <typename T> struct TypeTag {
+  using type = T;
+};
+
+/**
+ * Calls f(std::integral_constant<int, C>, std::integral_constant<Storage, S>,
+ * TypeTag<T>) with the compile-time channel count C, storage S and element
+ * type T matching img, such that kernels can be instantiated for them.
+ * Channel counts other than 3, 4 and 5 (see DataLayout) map to the generic
+ * C = 0.
+ */
+template <typename F> auto with_layout(const Image *img, F f) {
+  auto with_channels = [&](auto storage, auto type) {
+    switch (img->channels) {
+    case 3:
+      return f(std::integral_constant<int, 3>{}, storage, type);
+    case 4:
+      return f(std::integral_constant<int, 4>{}, storage, type);
+    case 5:
+      return f(std::integral_constant<int, 5>{}, storage, type);
+    default:
+      return f(std::integral_constant<int, 0>{}, storage, type);
+    }
+  };
+  auto with_storage = [&](auto type) {
+    if (img->storage == PLANAR) {
+      return with_channels(std::integral_constant<Storage, PLANAR>{}, type);
+    }
+    return with_channels(std::integral_constant<Storage, INTERLEAVED>{}, type);
+  };
+  if (img->format == F16) {
+    return with_storage(TypeTag<half>{});
+  }
+  return with_storage(TypeTag<float>{});
+}
+
+} // namespace reproject
@@ -2,13 +2,21 @@
 #include <Tracy.hpp>
 #include <cxxopts.hpp>
 
+#include "buffer_pool.hpp"
+#include "gpu.hpp"
 #include "image_formats.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "parallel.hpp"
+#include "pipeline.hpp"
 #include "reproject.hpp"
 #include <atomic>
 #include <cmath>
 #include <ctpl_stl.h>
+#include <functional>
 #include <ghc/filesystem.hpp>
 #include <nlohmann/json.hpp>
+#include <thread>
 
 namespace fs = ghc::filesystem;
 
@@ -29,10 +37,38 @@ int main(int argc, char **argv) {
      cxxopts::value<std::string>(), "file")
     ("single", "A single input file to convert.",
      cxxopts::value<std::string>(), "file")
+    ("frames-from-cfg", "Take the input images from the frames of the "
+     "input config instead of listing --input-dir: the file of each frame "
+     "name in it, with an .exr or .png extension if the name has neither.")
+    ("manifest", "Take the input images from this file instead of listing "
+     "--input-dir, one path per line, relative to --input-dir.",
+     cxxopts::value<std::string>(), "file")
     ("o,output-dir", "Output directory to put the reprojected images.",
      cxxopts::value<std::string>(), "file")
+    ("job", "JSON file with a list of output targets, each with its own "
+     "lens, scale, formats, output directory and output config, see the "
+     "README. Every input image is read once and reprojected to all of "
+     "them. Replaces --output-dir, --output-cfg and the output optics "
+     "options.",
+     cxxopts::value<std::string>(), "json-file")
     ("exr", "Output EXR files. Color and depth.")
     ("png", "Output PNG files. Color only.")
+    ("exr-compression", "Compression of output EXR files: none, zips, zip, "
+     "piz or dwaa.",
+     cxxopts::value<std::string>()->default_value("zip"), "type")
+    ("exr-level", "Compression level of output EXR files. 1 to 9 for zip and "
+     "zips (default: 9), higher is smaller and lossier for dwaa "
+     "(default: 45).",
+     cxxopts::value<float>(), "level")
+    ("exr-tiles", "Write tiled EXR files with square tiles of this many "
+     "pixels. 0 writes scan lines.",
+     cxxopts::value<int>()->default_value("0"), "size")
+    ("png-filter", "Filter strategy of output PNG files: zero, minsum, "
+     "entropy or brute. zero is the fastest.",
+     cxxopts::value<std::string>()->default_value("minsum"), "strategy")
+    ("png-level", "zlib effort for output PNG files. 0 stores uncompressed, "
+     "1 is the fastest and 9 the smallest.",
+     cxxopts::value<int>()->default_value("5"), "level")
     ;
 
   options.add_options("Filter files")
@@ -45,14 +81,33 @@ int main(int argc, char **argv) {
   options.add_options("Sampling")
     ("s,samples", "Number of samples per dimension for interpolating",
      cxxopts::value<int>()->default_value("1"), "number")
+    ("adaptive", "Pick the number of samples per tile from the local scale "
+     "of the reprojection, with --samples as the maximum. Tiles where the "
+     "input is magnified get a single sample.")
+    ("adaptive-quality", "Samples per input pixel spanned by an output "
+     "pixel, per dimension, used by --adaptive.",
+     cxxopts::value<float>()->default_value("1.0"), "factor")
+    ("fast-math", "Map pixels through a table of the radial scale between "
+     "the lenses instead of evaluating the lens functions for every "
+     "sample. Accurate to 1/256 of an input pixel.")
+    ("compact-map", "Store the source coordinates of most tiles as 16-bit "
+     "fixed point, accurate to 1/256 of an input pixel. Halves the memory "
+     "and bandwidth used by the reprojection map.")
 
     ("nn", "Nearest neighbor interpolation")
     ("bl", "Bilinear interpolation")
     ("bc", "Bicubic interpolation (default)")
+    ("tl", "Trilinear interpolation between the levels of a mip pyramid "
+     "of the input, picked per pixel. Prevents aliasing when downscaling, "
+     "without increasing --samples.")
+    ("fill", "Value of output pixels outside of the input image or field "
+     "of view: black or nan, with alpha 0, or clamp to sample the edge of "
+     "the input like before.",
+     cxxopts::value<std::string>()->default_value("black"), "mode")
 
     ("scale", "Output scale, as a fraction of the input size. "
-     "It is recommended to increase --samples to prevent aliassing "
-     "in case you are downscaling. Eg: --scale 0.5 --samples 2 "
+     "It is recommended to use --tl or increase --samples to prevent "
+     "aliassing in case you are downscaling. Eg: --scale 0.5 --samples 2 "
      "or --scale 0.33334 --samples 3 or --scale 0.25 --samples 4. "
      "Final dimensions are rounded towards zero.",
      cxxopts::value<double>()->default_value("1.0"), "percentage")
@@ -74,6 +129,11 @@ int main(int argc, char **argv) {
   options.add_options("Color processing")
     ("auto-exposure", "Automatic exposure compensation and white balance.",
      cxxopts::value<bool>(), "auto_exposure")
+    ("batch-exposure", "Like --auto-exposure, but with one exposure for all "
+     "images, derived from the given number of images spread over the "
+     "batch. Stored in the output config and reused by reruns over the same "
+     "images.",
+     cxxopts::value<int>()->default_value("0"), "images")
     ("exposure", "Exposure compensation in stops (EV) to brigthen "
                  "or darken the pictures.",
      cxxopts::value<double>()->default_value("0.0"), "EV")
@@ -87,6 +147,54 @@ int main(int argc, char **argv) {
     ("skip-if-exists", "Skip if the output file already exists.")
     ("j,parallel", "Number of parallel images to process.",
      cxxopts::value<int>()->default_value("1"), "threads")
+    ("image-threads", "Number of threads reprojecting each image. "
+     "Useful with --single or few very large images.",
+     cxxopts::value<int>()->default_value("1"), "threads")
+    ("read-threads", "Number of threads reading and decoding input images.",
+     cxxopts::value<int>()->default_value("1"), "threads")
+    ("write-threads", "Number of threads encoding and writing output images.",
+     cxxopts::value<int>()->default_value("1"), "threads")
+    ("queue-depth", "Number of images waiting between the read, process and "
+     "write stages. Bounds the number of images in memory.",
+     cxxopts::value<int>()->default_value("2"), "images")
+    ("stream-rows", "Reproject EXR images in bands of this many output "
+     "rows, reading only the input rows each band needs and writing it "
+     "before the next, for images that do not fit in memory. Only with "
+     "--exr output, and not with --tl or automatic exposure. 0 processes "
+     "whole images.",
+     cxxopts::value<int>()->default_value("0"), "rows")
+    ("tile-cache", "Memory for the tiles of tiled EXR images decoded by "
+     "--stream-rows, which decodes only the tiles each band needs, and "
+     "then keeps the most recently used ones for the next bands.",
+     cxxopts::value<double>()->default_value("256"), "MiB")
+    ("memory-budget", "Memory the images in flight may use, estimated "
+     "from their headers. Images are admitted while they fit, such that "
+     "more of them are processed in parallel when they are small. 0 is "
+     "unlimited.",
+     cxxopts::value<double>()->default_value("0"), "MiB")
+    ("exr-threads", "Number of threads OpenEXR uses to compress and "
+     "decompress, shared by all images. 0 disables them, -1 uses the cores "
+     "left over by --parallel and --image-threads.",
+     cxxopts::value<int>()->default_value("0"), "threads")
+    ("planar", "Keep images in memory as one plane per channel instead of "
+     "interleaved. Matches the EXR channel layout.")
+    ("half", "Keep images in memory as 16-bit floats, halving the memory "
+     "used per image. EXR files are stored as 16-bit floats anyway.")
+    ("gpu", "Reproject on the GPU, uploading each input once for all "
+     "targets. Needs a build with REPROJECT_OPENCL, see the README. Falls "
+     "back to the CPU for --tl, --adaptive and more than four channels.")
+    ("map-cache", "Directory to keep reprojection maps in between runs. "
+     "Runs with the same lenses, resolutions and sampling settings map "
+     "them from there instead of computing them.",
+     cxxopts::value<std::string>(), "dir")
+    ("metrics", "Write the time spent per stage, queue waits, bytes and "
+     "pixels read and written, and allocations, in total and per image, to "
+     "this JSON file.",
+     cxxopts::value<std::string>(), "json-file")
+    ("journal", "Record the outputs made, with the inputs and settings they "
+     "were made from, in this JSON file. Reruns skip the outputs of which "
+     "the input and settings are unchanged, and that are still complete.",
+     cxxopts::value<std::string>(), "json-file")
     ("dry-run", "Do not actually reproject images. Only produce config.")
     ("h,help", "Show help")
     ;
@@ -94,19 +202,41 @@ int main(int argc, char **argv) {
 
   cxxopts::ParseResult result;
   int num_threads = 1;
+  int num_image_threads = 1;
+  int num_read_threads = 1;
+  int num_write_threads = 1;
+  int queue_depth = 2;
+  size_t memory_budget = 0;
+  int stream_rows = 0;
+  size_t tile_cache = 0;
+  int num_exr_threads = 0;
+  reproject::ExrOptions exr_options;
+  reproject::PngOptions png_options;
   int num_samples = 1;
+  float adaptive_quality = 0.0f;
+  bool fast_lenses = false;
+  bool compact_map = false;
+  bool use_gpu = false;
   std::string input_single;
   std::string input_dir;
+  std::string manifest_file;
+  bool frames_from_cfg = false;
   std::string output_dir;
   std::string input_cfg_file;
   std::string output_cfg_file;
+  std::string job_file;
   double scale;
   bool auto_exposure = false;
+  int batch_exposure = 0;
   double exposure = 1.0;
   double reinhard = 1.0;
   bool dry_run = false;
   bool reproject = true;
   bool skip_if_exists = false;
+  bool fill_uncovered = true;
+  float fill = 0.0f;
+  reproject::Storage storage = reproject::INTERLEAVED;
+  reproject::PixelFormat pixel_format = reproject::F32;
   try {
     result = options.parse(argc, argv);
     if (result.count("help")) {
@@ -127,13 +257,78 @@ int main(int argc, char **argv) {
         return 1;
       }
     }
-    output_dir = result["output-dir"].as<std::string>();
+    frames_from_cfg = result.count("frames-from-cfg") > 0;
+    if (result.count("manifest")) {
+      manifest_file = result["manifest"].as<std::string>();
+    }
+    if ((frames_from_cfg || !manifest_file.empty()) &&
+        (input_dir.empty() || (frames_from_cfg && !manifest_file.empty()))) {
+      std::printf("Error: --frames-from-cfg and --manifest take the "
+                  "images from --input-dir, and exclude each other.\n");
+      return 1;
+    }
     input_cfg_file = result["input-cfg"].as<std::string>();
-    output_cfg_file = result["output-cfg"].as<std::string>();
+    if (result.count("job")) {
+      job_file = result["job"].as<std::string>();
+    } else {
+      output_dir = result["output-dir"].as<std::string>();
+      output_cfg_file = result["output-cfg"].as<std::string>();
+    }
     num_samples = result["samples"].as<int>();
+    if (result.count("adaptive")) {
+      adaptive_quality = result["adaptive-quality"].as<float>();
+      if (!(adaptive_quality > 0.0f)) {
+        std::printf("Error: --adaptive-quality must be positive.\n");
+        return 1;
+      }
+      if (num_samples > reproject::MAX_ADAPTIVE_SAMPLES) {
+        std::printf("Error: --adaptive supports at most %d --samples.\n",
+                    reproject::MAX_ADAPTIVE_SAMPLES);
+        return 1;
+      }
+    }
     num_threads = result["parallel"].as<int>();
+    num_image_threads = result["image-threads"].as<int>();
+    num_read_threads = result["read-threads"].as<int>();
+    num_write_threads = result["write-threads"].as<int>();
+    queue_depth = result["queue-depth"].as<int>();
+    stream_rows = result["stream-rows"].as<int>();
+    double budget_mib = result["memory-budget"].as<double>();
+    if (!(budget_mib >= 0.0)) {
+      throw std::invalid_argument("--memory-budget must not be negative.");
+    }
+    memory_budget = size_t(budget_mib * 1048576.0);
+    double cache_mib = result["tile-cache"].as<double>();
+    if (!(cache_mib >= 0.0)) {
+      throw std::invalid_argument("--tile-cache must not be negative.");
+    }
+    tile_cache = size_t(cache_mib * 1048576.0);
+    num_exr_threads = result["exr-threads"].as<int>();
+    exr_options.compression = reproject::parse_exr_compression(
+        result["exr-compression"].as<std::string>());
+    png_options.filter =
+        reproject::parse_png_filter(result["png-filter"].as<std::string>());
+    png_options.level = result["png-level"].as<int>();
+    if (result.count("exr-level")) {
+      float level = result["exr-level"].as<float>();
+      exr_options.zip_level = std::max(1, std::min(9, int(level)));
+      exr_options.dwa_level = level;
+    }
+    exr_options.tile_size = result["exr-tiles"].as<int>();
+    if (exr_options.tile_size < 0) {
+      throw std::invalid_argument("--exr-tiles must not be negative.");
+    }
     scale = result["scale"].as<double>();
     auto_exposure = result["auto-exposure"].as<bool>();
+    batch_exposure = result["batch-exposure"].as<int>();
+    std::string fill_mode = result["fill"].as<std::string>();
+    if (fill_mode == "nan") {
+      fill = std::nanf("");
+    } else if (fill_mode == "clamp") {
+      fill_uncovered = false;
+    } else if (fill_mode != "black") {
+      throw std::invalid_argument("Unknown fill mode: " + fill_mode);
+    }
     exposure = std::pow(2.0, result["exposure"].as<double>());
     reinhard = result["reinhard"].as<double>();
     if (result.count("no-reproject")) {
@@ -145,6 +340,19 @@ int main(int argc, char **argv) {
   } catch (cxxopts::OptionException &e) {
     std::printf("%s\n\n%s\n", e.what(), options.help().c_str());
     return 1;
+  } catch (std::invalid_argument &e) {
+    std::printf("Error: %s\n", e.what());
+    return 1;
+  }
+
+  if (auto_exposure && batch_exposure > 0) {
+    std::printf("Error: specify either --auto-exposure or --batch-exposure.\n");
+    return 1;
+  }
+  if (num_threads < 1 || num_image_threads < 1 || num_read_threads < 1 ||
+      num_write_threads < 1 || queue_depth < 1) {
+    std::printf("Error: thread counts and --queue-depth must be at least 1.\n");
+    return 1;
   }
 
   if (result.count("dry-run")) {
@@ -153,6 +361,44 @@ int main(int argc, char **argv) {
   if (result.count("skip-if-exists")) {
     skip_if_exists = true;
   }
+  if (result.count("planar")) {
+    storage = reproject::PLANAR;
+  }
+  if (result.count("half")) {
+    pixel_format = reproject::F16;
+  }
+  if (result.count("fast-math")) {
+    fast_lenses = true;
+  }
+  if (result.count("compact-map")) {
+    compact_map = true;
+  }
+  // One stream per process worker. Adaptive maps pick the samples per tile,
+  // which the GPU does not.
+  std::vector<std::unique_ptr<reproject::GpuStream>> gpu_streams(num_threads);
+  if (result.count("gpu")) {
+    use_gpu = reproject::gpu_available();
+    if (use_gpu && adaptive_quality == 0.0f) {
+      try {
+        for (std::unique_ptr<reproject::GpuStream> &stream : gpu_streams) {
+          stream.reset(new reproject::GpuStream());
+        }
+      } catch (const std::exception &e) {
+        // The device was found, but its queues or kernels failed.
+        std::printf("Warning: %s\n", e.what());
+        use_gpu = false;
+        for (std::unique_ptr<reproject::GpuStream> &stream : gpu_streams) {
+          stream.reset();
+        }
+      }
+    }
+    if (use_gpu) {
+      std::printf("Reprojecting on %s.\n",
+                  reproject::gpu_device_name().c_str());
+    } else {
+      std::printf("Warning: No OpenCL GPU found, reprojecting on the CPU.\n");
+    }
+  }
 
   bool store_png = false;
   bool store_exr = false;
@@ -163,7 +409,7 @@ int main(int argc, char **argv) {
     store_png = true;
   }
 
-  if (!store_exr && !store_png) {
+  if (job_file.empty() && !store_exr && !store_png) {
     std::printf("Error: Did not specify any output format.\n"
                 "Choose --png or --exr. (both are possible).\n");
     return 1;
@@ -183,10 +429,18 @@ int main(int argc, char **argv) {
     found_interpolation_flag++;
     interpolation = reproject::BICUBIC;
   }
+  if (result.count("tl")) {
+    found_interpolation_flag++;
+    interpolation = reproject::TRILINEAR;
+  }
   if (found_interpolation_flag > 1) {
     std::printf("Cannot specify more than one interpolation method.\n\n");
     std::printf("%s", options.help().c_str());
   }
+  if (stream_rows < 0) {
+    std::printf("Error: --stream-rows must not be negative.\n");
+    return 1;
+  }
 
   std::string filter_prefix = result["filter-prefix"].as<std::string>();
   std::string filter_suffix = result["filter-suffix"].as<std::string>();
@@ -196,23 +450,24 @@ int main(int argc, char **argv) {
   cfg_ifstream >> cfg;
   cfg_ifstream.close();
 
-  nlohmann::json out_cfg = cfg;
-  for (int i = 0; i < out_cfg["frames"].size(); ++i) {
-    std::string name = out_cfg["frames"][i]["name"].get<std::string>();
+  auto name_matches = [&](const std::string &name) {
+    return name.size() >= filter_prefix.size() &&
+           name.size() >= filter_suffix.size() &&
+           name.compare(0, filter_prefix.size(), filter_prefix) == 0 &&
+           name.compare(name.size() - filter_suffix.size(),
+                        filter_suffix.size(), filter_suffix) == 0;
+  };
 
-    bool remove = false;
-    if (name.size() < filter_prefix.size() ||
-        name.size() < filter_suffix.size()) {
-      remove = true;
-    } else if (name.substr(0, filter_prefix.size()) != filter_prefix) {
-      remove = true;
-    } else if (name.substr(name.size() - filter_suffix.size()) !=
-               filter_suffix) {
-      remove = true;
-    }
-    if (remove) {
-      out_cfg["frames"].erase(i--);
+  // One pass, keeping the frames that match.
+  nlohmann::json out_cfg = cfg;
+  if (out_cfg.contains("frames")) {
+    nlohmann::json frames = nlohmann::json::array();
+    for (nlohmann::json &frame : out_cfg["frames"]) {
+      if (name_matches(frame["name"].get<std::string>())) {
+        frames.push_back(std::move(frame));
+      }
     }
+    out_cfg["frames"] = std::move(frames);
   }
 
   std::printf("Found camera config: %s\n", cfg["camera"].dump(1).c_str());
@@ -221,195 +476,1015 @@ int main(int argc, char **argv) {
 
   reproject::LensInfo input_lens =
       reproject::extract_lens_info_from_config(cfg);
-  reproject::LensInfo output_lens;
-  int output_lens_types_found = 0;
-  if (result.count("rectilinear")) {
-    std::string lstr = result["rectilinear"].as<std::string>();
-    int comma = lstr.find(",");
-    if (comma == std::string::npos) {
-      std::printf("Error: Required format for --rectilinear x,y\n");
-      return 1;
+  // Output lens from the value of the output optics option of the given type.
+  auto parse_output_lens = [&](const std::string &type,
+                               const std::string &lstr) {
+    reproject::LensInfo ol;
+    if (type == "rectilinear") {
+      size_t comma = lstr.find(",");
+      if (comma == std::string::npos) {
+        throw std::invalid_argument("Required format for --rectilinear x,y");
+      }
+      ol.type = reproject::RECTILINEAR;
+      ol.rectilinear.focal_length = std::atof(lstr.substr(0, comma).c_str());
+      ol.sensor_width = std::atof(lstr.substr(comma + 1).c_str());
+      ol.sensor_height = (float)res_y / (float)res_x * ol.sensor_width;
+    } else if (type == "equisolid") {
+      size_t comma1 = lstr.find(",");
+      size_t comma2 = lstr.find(",", comma1 + 1);
+      if (comma1 == std::string::npos || comma2 == std::string::npos) {
+        throw std::invalid_argument("Required format for --equisolid x,y,z");
+      }
+      auto &olfes = ol.fisheye_equisolid;
+      ol.type = reproject::FISHEYE_EQUISOLID;
+      olfes.focal_length = std::atof(lstr.substr(0, comma1).c_str());
+      olfes.fov = std::atof(lstr.substr(comma2 + 1).c_str());
+      ol.sensor_width = std::atof(lstr.substr(comma1 + 1, comma2).c_str());
+      ol.sensor_height = (float)res_y / (float)res_x * ol.sensor_width;
+    } else {
+      ol.type = reproject::FISHEYE_EQUIDISTANT;
+      ol.fisheye_equidistant.fov = std::atof(lstr.c_str());
+      ol.sensor_width = 36.0f;
+      ol.sensor_height = 36.0f;
     }
-    auto &ol = output_lens;
-    auto &olr = output_lens.rectilinear;
-    output_lens.type = reproject::RECTILINEAR;
-    olr.focal_length = std::atof(lstr.substr(0, comma).c_str());
-    ol.sensor_width = std::atof(lstr.substr(comma + 1).c_str());
-    ol.sensor_height = (float)res_y / (float)res_x * ol.sensor_width;
-
-    output_lens_types_found++;
-  }
-  if (result.count("equisolid")) {
-    std::string lstr = result["equisolid"].as<std::string>();
-    int comma1 = lstr.find(",");
-    int comma2 = lstr.find(",", comma1 + 1);
-    if (comma1 == std::string::npos || comma2 == std::string::npos) {
-      std::printf("Error: Required format for --equisolid x,y,z\n");
-      return 1;
+    return ol;
+  };
+  static const char *lens_types[] = {"rectilinear", "equisolid",
+                                     "equidistant"};
+
+  // Every input image is reprojected to each target, with its own lens,
+  // scale, formats, output directory and output config.
+  struct Target {
+    reproject::LensInfo lens;
+    bool reproject{true};
+    double scale{1.0};
+    bool store_png{false};
+    bool store_exr{false};
+    fs::path output_dir;
+    std::string output_cfg_file;
+    nlohmann::json out_cfg;
+    float exposure_scales[3];
+    // Without reprojection and scaling, the output is a copy of the input.
+    bool copy{false};
+  };
+  std::vector<Target> targets;
+  try {
+    if (job_file.empty()) {
+      Target target;
+      int output_lens_types_found = 0;
+      for (const char *type : lens_types) {
+        if (result.count(type)) {
+          target.lens =
+              parse_output_lens(type, result[type].as<std::string>());
+          output_lens_types_found++;
+        }
+      }
+      if (!reproject) {
+        target.reproject = false;
+        target.lens = input_lens;
+        output_lens_types_found++;
+      }
+      if (output_lens_types_found != 1) {
+        throw std::invalid_argument(
+            "specify one output lens type: [--rectilinear, --equisolid, "
+            "--equidistant, --no-reproject].");
+      }
+      target.scale = scale;
+      target.store_png = store_png;
+      target.store_exr = store_exr;
+      target.output_dir = output_dir;
+      target.output_cfg_file = output_cfg_file;
+      targets.push_back(target);
+    } else {
+      // Targets default to the formats and scale given on the command line.
+      nlohmann::json job;
+      std::ifstream job_ifstream{job_file};
+      if (!job_ifstream) {
+        throw std::invalid_argument("Cannot read job " + job_file);
+      }
+      job_ifstream >> job;
+      for (const nlohmann::json &t : job.at("targets")) {
+        Target target;
+        target.output_dir = t.at("output_dir").get<std::string>();
+        target.output_cfg_file = t.at("output_cfg").get<std::string>();
+        target.scale = t.value("scale", scale);
+        target.store_png = t.value("png", store_png);
+        target.store_exr = t.value("exr", store_exr);
+        int output_lens_types_found = 0;
+        for (const char *type : lens_types) {
+          if (t.contains(type)) {
+            const nlohmann::json &v = t[type];
+            target.lens = parse_output_lens(
+                type, v.is_string() ? v.get<std::string>() : v.dump());
+            output_lens_types_found++;
+          }
+        }
+        if (t.value("no_reproject", false)) {
+          target.reproject = false;
+          target.lens = input_lens;
+          output_lens_types_found++;
+        }
+        if (output_lens_types_found != 1) {
+          throw std::invalid_argument(
+              "every target of " + job_file +
+              " needs one of rectilinear, equisolid, equidistant or "
+              "no_reproject.");
+        }
+        if (!target.store_png && !target.store_exr) {
+          throw std::invalid_argument("target " +
+                                      target.output_dir.string() +
+                                      " of " + job_file +
+                                      " has no output format.");
+        }
+        for (const Target &other : targets) {
+          if (other.output_dir == target.output_dir ||
+              other.output_cfg_file == target.output_cfg_file) {
+            throw std::invalid_argument(
+                "targets of " + job_file +
+                " need their own output_dir and output_cfg.");
+          }
+        }
+        targets.push_back(target);
+      }
+      if (targets.empty()) {
+        throw std::invalid_argument("no targets in " + job_file);
+      }
     }
-    auto &ol = output_lens;
-    auto &olfes = output_lens.fisheye_equisolid;
-    output_lens.type = reproject::FISHEYE_EQUISOLID;
-    olfes.focal_length = std::atof(lstr.substr(0, comma1).c_str());
-    olfes.fov = std::atof(lstr.substr(comma2 + 1).c_str());
-    ol.sensor_width = std::atof(lstr.substr(comma1 + 1, comma2).c_str());
-    ol.sensor_height = (float)res_y / (float)res_x * ol.sensor_width;
+  } catch (const std::exception &e) {
+    std::printf("Error: %s\n", e.what());
+    return 1;
+  }
 
-    output_lens_types_found++;
+  for (Target &target : targets) {
+    // store in out_cfg
+    target.out_cfg = out_cfg;
+    reproject::store_lens_info_in_config(target.lens, target.out_cfg);
+    target.out_cfg["resolution"][0] = int(res_x * target.scale);
+    target.out_cfg["resolution"][1] = int(res_y * target.scale);
+    target.copy = !target.reproject && target.scale == 1.0;
+    std::fill(target.exposure_scales, target.exposure_scales + 3,
+              float(exposure));
   }
-  if (result.count("equidistant")) {
-    std::string lstr = result["equidistant"].as<std::string>();
-    auto &ol = output_lens;
-    auto &olfed = output_lens.fisheye_equidistant;
-    output_lens.type = reproject::FISHEYE_EQUISOLID;
-    olfed.fov = std::atof(lstr.c_str());
-    ol.sensor_width = 36.0f;
-    ol.sensor_height = 36.0f;
 
-    output_lens_types_found++;
+  if (stream_rows > 0 &&
+      (targets.size() > 1 || targets[0].store_png ||
+       interpolation == reproject::TRILINEAR || auto_exposure ||
+       batch_exposure > 0)) {
+    std::printf("Error: --stream-rows only writes EXR files of one target, "
+                "and does not support --tl, --auto-exposure or "
+                "--batch-exposure.\n");
+    return 1;
   }
 
-  if (!reproject) {
-    output_lens = input_lens;
-    output_lens_types_found++;
+  auto is_image = [](const fs::path &p) {
+    return p.extension() == ".exr" || p.extension() == ".png";
+  };
+  // File of a frame of the input config, which may lack the extension.
+  auto frame_file = [&](const fs::path &p) {
+    if (!frames_from_cfg || is_image(p)) {
+      return p;
+    }
+    fs::path exr = p.string() + ".exr";
+    return fs::exists(exr) ? exr : fs::path(p.string() + ".png");
+  };
+  // Calls found for every input file once, in one pass over the frames of
+  // the input config, the manifest or the directory, as they are found. The
+  // directory is listed in no particular order.
+  auto discover = [&](const std::function<void(const fs::path &)> &found) {
+    ZoneScopedN("discover");
+    if (!input_single.empty()) {
+      found(fs::path{input_single});
+    } else if (frames_from_cfg) {
+      for (const nlohmann::json &frame : out_cfg["frames"]) {
+        found(fs::path(input_dir) / frame["name"].get<std::string>());
+      }
+    } else if (!manifest_file.empty()) {
+      std::ifstream manifest(manifest_file);
+      if (!manifest) {
+        throw std::runtime_error("Cannot read manifest " + manifest_file);
+      }
+      std::string line;
+      while (std::getline(manifest, line)) {
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        fs::path p = fs::path(input_dir) / line;
+        if (!line.empty() && name_matches(p.filename().string()) &&
+            is_image(p)) {
+          found(p);
+        }
+      }
+    } else if (!input_dir.empty()) {
+      for (const fs::directory_entry &entry :
+           fs::directory_iterator(fs::path(input_dir))) {
+        const fs::path &p = entry.path();
+        if (entry.is_regular_file() && name_matches(p.filename().string()) &&
+            is_image(p)) {
+          found(p);
+        }
+      }
+    }
+  };
+
+  // Batch exposure samples frames spread over the whole, sorted list, and
+  // streaming processes a list. Otherwise the pipeline takes the files while
+  // they are being discovered.
+  std::vector<fs::path> files;
+  const bool list_files = batch_exposure > 0 || stream_rows > 0;
+  if (list_files) {
+    try {
+      discover([&](const fs::path &p) { files.push_back(frame_file(p)); });
+    } catch (const std::exception &e) {
+      std::printf("Error: %s\n", e.what());
+      return 1;
+    }
+    if (!frames_from_cfg && manifest_file.empty()) {
+      std::sort(files.begin(), files.end());
+    }
   }
 
-  // store in out_cfg
-  reproject::store_lens_info_in_config(output_lens, out_cfg);
-  cfg["resolution"][0] = int(res_x * scale);
-  cfg["resolution"][1] = int(res_y * scale);
+  // OpenEXR threads are shared between all files, so they go on top of the
+  // reprojection threads rather than per image.
+  if (num_exr_threads < 0) {
+    int cores = std::thread::hardware_concurrency();
+    num_exr_threads = std::max(0, cores - num_threads * num_image_threads);
+  }
+  reproject::set_exr_threads(num_exr_threads);
 
-  if (output_lens_types_found > 1) {
-    std::printf("Error: only specify one output lens type: [--rectilinear, "
-                "--equisolid, --equidistant, --no-reproject].\n");
-    return 1;
+  // All frames share the lenses, so typically a single map serves the batch.
+  std::string map_cache_dir;
+  if (result.count("map-cache")) {
+    map_cache_dir = result["map-cache"].as<std::string>();
+    fs::create_directories(map_cache_dir);
   }
+  reproject::ReprojectionMapCache map_cache(map_cache_dir);
+  // Maps that cannot be written to --map-cache are used all the same.
+  auto get_map = [&](const reproject::Image *in, const reproject::Image *out) {
+    std::shared_ptr<const reproject::ReprojectionMap> map =
+        map_cache.get(in, out, num_samples, num_image_threads,
+                      adaptive_quality, fast_lenses, compact_map);
+    std::string error = map_cache.take_save_error();
+    if (!error.empty()) {
+      std::printf("Warning: %s\n", error.c_str());
+    }
+    return map;
+  };
 
-  std::printf("Creating directory: %s\n", output_dir.c_str());
-  fs::create_directory(output_dir);
+  // Output image of a target for an input image, without pixels.
+  auto output_image = [&](const reproject::Image &input,
+                          const Target &target) {
+    reproject::Image output;
+    output.lens = target.lens;
+    output.width = int(input.width * target.scale);
+    output.height = int(input.height * target.scale);
+    output.channels = input.channels;
+    output.data = nullptr;
+    output.data_layout = input.data_layout;
+    output.storage = input.storage;
+    output.format = input.format;
+    return output;
+  };
 
-  std::printf("Saving output config: %s\n", output_cfg_file.c_str());
-  std::ofstream cfg_ofstream{output_cfg_file};
-  cfg_ofstream << out_cfg.dump(2);
-  cfg_ofstream.close();
+  // With --batch-exposure, one set of exposure scales per target is derived
+  // from a sample of the frames and used for all of them, which avoids flicker
+  // and a statistics pass per frame. The scales are stored in the output
+  // config, so a rerun over the same frames and output lens can reuse them.
+  if (batch_exposure > 0 && !files.empty()) {
+    reproject::ExposureInfo batch;
+    int num_samples_frames = std::min<int>(batch_exposure, files.size());
+    std::vector<fs::path> sample_files;
+    for (int i = 0; i < num_samples_frames; ++i) {
+      sample_files.push_back(files[size_t(i) * files.size() /
+                                   num_samples_frames]);
+      batch.frames.push_back(sample_files.back().filename().string());
+    }
+
+    auto use_scales = [&](Target &target, const float *scales) {
+      std::printf("Batch exposure scales: %f %f %f\n", scales[0], scales[1],
+                  scales[2]);
+      std::copy(scales, scales + 3, batch.scales);
+      std::copy(scales, scales + 3, target.exposure_scales);
+      reproject::store_exposure_in_config(batch, target.out_cfg);
+    };
+    std::vector<Target *> analyze;
+    for (Target &target : targets) {
+      bool cached = false;
+      reproject::ExposureInfo previous;
+      try {
+        nlohmann::json previous_cfg;
+        std::ifstream previous_ifstream{target.output_cfg_file};
+        if (previous_ifstream) {
+          previous_ifstream >> previous_cfg;
+          if (previous_cfg["camera"] == target.out_cfg["camera"] &&
+              reproject::extract_exposure_from_config(previous_cfg,
+                                                      previous) &&
+              previous.frames == batch.frames) {
+            cached = true;
+          }
+        }
+      } catch (const std::exception &e) {
+        // Not a usable config, analyze again.
+      }
+      if (cached) {
+        std::printf("Reusing batch exposure from: %s\n",
+                    target.output_cfg_file.c_str());
+        use_scales(target, previous.scales);
+      } else {
+        analyze.push_back(&target);
+      }
+    }
+
+    if (!analyze.empty() && !dry_run) {
+      ZoneScopedN("batch_exposure");
+      std::printf("Analyzing exposure of %d frames.\n", num_samples_frames);
+      // Each sample frame is read once for all targets.
+      std::vector<reproject::ExposureHistogram> histograms(analyze.size());
+      std::mutex histogram_mutex;
+      try {
+        reproject::parallel_for(
+            num_samples_frames, num_threads, [&](int i) {
+              reproject::Image input = reproject::read_image(
+                  sample_files[i].string(), storage, pixel_format);
+              input.lens = input_lens;
+              for (size_t t = 0; t < analyze.size(); ++t) {
+                const Target &target = *analyze[t];
+                reproject::Image output = input;
+                const uint8_t *coverage = nullptr;
+                std::shared_ptr<const reproject::ReprojectionMap> map;
+                if (!target.copy) {
+                  output = output_image(input, target);
+                  reproject::allocate_pixels(output);
+                  map = get_map(&input, &output);
+                  reproject::OutputTransform transform;
+                  transform.fill_uncovered = fill_uncovered;
+                  reproject::reproject(&input, &output, *map, interpolation,
+                                       num_image_threads, &transform);
+                  if (fill_uncovered) {
+                    coverage = map->coverage;
+                  }
+                }
+                reproject::ExposureHistogram frame_histogram =
+                    reproject::exposure_histogram(&output, num_image_threads,
+                                                  coverage);
+                std::lock_guard<std::mutex> lock(histogram_mutex);
+                histograms[t].merge(frame_histogram);
+              }
+            });
+      } catch (const std::exception &e) {
+        std::printf("Error: %s\n", e.what());
+        return 1;
+      }
+      for (size_t t = 0; t < analyze.size(); ++t) {
+        float scales[3];
+        reproject::exposure_scales(histograms[t], scales);
+        use_scales(*analyze[t], scales);
+      }
+    }
+  }
+
+  for (const Target &target : targets) {
+    std::printf("Creating directory: %s\n", target.output_dir.c_str());
+    fs::create_directory(target.output_dir);
+
+    std::printf("Saving output config: %s\n",
+                target.output_cfg_file.c_str());
+    std::ofstream cfg_ofstream{target.output_cfg_file};
+    cfg_ofstream << target.out_cfg.dump(2);
+    cfg_ofstream.close();
+  }
 
   if (dry_run) {
     std::printf("Dry-run. Exiting.\n");
     return 0;
   }
 
-  int count = 0;
-  std::atomic_int done_count{0};
-  ctpl::thread_pool pool(num_threads);
+  std::string metrics_file;
+  if (result.count("metrics")) {
+    metrics_file = result["metrics"].as<std::string>();
+  }
+  // With --journal, the outputs made from the same input with the same
+  // settings are not made again. The settings of a target are everything its
+  // outputs depend on besides the input.
+  std::unique_ptr<reproject::Journal> journal;
+  std::vector<uint64_t> target_settings;
+  // Whether the outputs of a target are reprojected on the GPU, which rounds
+  // differently, given inputs of its channels and size, see gpu_supports().
+  auto uses_gpu = [&](const Target &target) {
+    reproject::Image in{}, out{};
+    in.lens = input_lens;
+    out.lens = target.lens;
+    in.channels = out.channels = 1;
+    return gpu_streams[0] && stream_rows == 0 && !target.copy &&
+           reproject::gpu_supports(&in, &out, interpolation);
+  };
+  if (result.count("journal")) {
+    try {
+      journal.reset(
+          new reproject::Journal(result["journal"].as<std::string>()));
+    } catch (const std::exception &e) {
+      std::printf("Error: %s\n", e.what());
+      return 1;
+    }
+    for (const Target &target : targets) {
+      nlohmann::json settings;
+      settings["input"] = cfg;
+      settings["input"].erase("frames");
+      settings["output"] = target.out_cfg;
+      settings["output"].erase("frames");
+      settings["reproject"] = target.reproject;
+      settings["scale"] = target.scale;
+      settings["png"] = target.store_png;
+      settings["exr"] = target.store_exr;
+      settings["samples"] = num_samples;
+      settings["interpolation"] = int(interpolation);
+      settings["adaptive"] = adaptive_quality;
+      settings["fast_math"] = fast_lenses;
+      settings["compact_map"] = compact_map;
+      settings["half"] = pixel_format == reproject::F16;
+      settings["gpu"] = uses_gpu(target);
+      settings["exposure_scales"] = target.exposure_scales;
+      settings["auto_exposure"] = auto_exposure;
+      settings["reinhard"] = reinhard;
+      settings["fill_uncovered"] = fill_uncovered;
+      settings["fill"] = fill;
+      settings["exr_options"] = {int(exr_options.compression),
+                                 exr_options.zip_level, exr_options.dwa_level,
+                                 exr_options.tile_size};
+      settings["png_options"] = {int(png_options.filter), png_options.level};
+      std::string text = settings.dump();
+      target_settings.push_back(
+          reproject::hash_bytes(text.data(), text.size()));
+    }
+  }
+  // Saved every few seconds, such that a killed run loses little.
+  auto save_journal = [&](double seconds) {
+    if (!journal) {
+      return true;
+    }
+    try {
+      journal->save_if_due(seconds);
+    } catch (const std::exception &e) {
+      std::printf("Error: %s\n", e.what());
+      return false;
+    }
+    return true;
+  };
+  // Whether the outputs of a target at these paths are in the journal.
+  auto journal_done = [&](const fs::path &input, size_t t,
+                          const fs::path &output_png,
+                          const fs::path &output_exr) {
+    const Target &target = targets[t];
+    return journal &&
+           (!target.store_png ||
+            journal->done(input.string(), output_png.string(),
+                          target_settings[t])) &&
+           (!target.store_exr ||
+            journal->done(input.string(), output_exr.string(),
+                          target_settings[t]));
+  };
 
-  std::function<void(std::string)> submit_file = [&](fs::path p) {
-    pool.push([p, num_samples, interpolation, output_dir, scale, input_lens,
-               output_lens, &done_count, &count, reproject, auto_exposure, exposure, reinhard,
-               store_exr, store_png, skip_if_exists](int) {
-      ZoneScopedN("process_file");
+  const int stage_threads[] = {num_read_threads, num_threads,
+                               num_write_threads};
+  reproject::RunMetrics run_metrics(stage_threads);
+  auto save_metrics = [&]() {
+    if (metrics_file.empty()) {
+      return true;
+    }
+    std::printf("Saving metrics: %s\n", metrics_file.c_str());
+    try {
+      run_metrics.save(metrics_file);
+    } catch (const std::exception &e) {
+      std::printf("Error: %s\n", e.what());
+      return false;
+    }
+    return true;
+  };
+
+  // With --stream-rows, every image is reprojected band by band by a single
+  // worker: each band of output rows is sampled from the region of input
+  // pixels it maps to, read on demand, and written before the next band.
+  // Memory is proportional to the bands rather than to the images.
+  if (stream_rows > 0) {
+    if (exr_options.tile_size > 0) {
+      // Bands of tiled outputs hold whole rows of tiles.
+      int ts = exr_options.tile_size;
+      stream_rows = (stream_rows + ts - 1) / ts * ts;
+    }
+    const Target &target = targets[0];
+    std::atomic_int done_count{0};
+    const int count = files.size();
+    reproject::parallel_for(count, num_threads, [&](int i) {
+      ZoneScopedN("stream_file");
+      reproject::Stopwatch stage;
+      const fs::path &p = files[i];
+      fs::path output_exr = target.output_dir / p.filename();
+      output_exr.replace_extension(".exr");
+      if (skip_if_exists && fs::exists(output_exr)) {
+        std::printf("Skipping '%s'. Already exists.\n", output_exr.c_str());
+        done_count++;
+        return;
+      }
+      if (journal_done(p, 0, fs::path(), output_exr)) {
+        std::printf("Skipping '%s'. Up to date in the journal.\n",
+                    output_exr.c_str());
+        done_count++;
+        return;
+      }
+      reproject::FrameMetrics metrics;
+      metrics.name = p.filename().string();
+      std::error_code error;
+      reproject::FileStamp stamp;
       try {
-        fs::path output_path_base = output_dir / p.filename();
-        fs::path output_path_png = output_path_base.replace_extension(".png");
-        fs::path output_path_exr = output_path_base.replace_extension(".exr");
+        if (p.extension() != ".exr") {
+          throw std::invalid_argument("--stream-rows only reads EXR files: " +
+                                      p.string());
+        }
+        if (journal) {
+          stamp = reproject::stamp_file(p.string());
+        }
+        reproject::ExrRegionReader reader(p.string(), pixel_format,
+                                          tile_cache);
+        reproject::Image input = reader.frame();
+        input.lens = input_lens;
+        reproject::Image output = output_image(input, target);
+        reproject::ExrBandWriter writer(output_exr.string(), output,
+                                        exr_options);
 
-        bool exists = true;
-        if (store_png && !fs::exists(output_path_png)) {
-          exists = false;
+        reproject::OutputTransform transform;
+        transform.fill_uncovered = fill_uncovered;
+        transform.fill = fill;
+        if (exposure != 1.0 || reinhard != 1.0) {
+          transform.tonemap = true;
+          std::copy(target.exposure_scales, target.exposure_scales + 3,
+                    transform.scales);
+          transform.reinhard = reinhard;
         }
-        if (store_exr && !fs::exists(output_path_exr)) {
-          exists = false;
+        reproject::Image band = output;
+        band.height = std::min(stream_rows, output.height);
+        reproject::allocate_pixels(band);
+        for (int y = 0; y < output.height; y += stream_rows) {
+          band.height = std::min(stream_rows, output.height - y);
+          reproject::PixelRect rect = reproject::source_region(
+              input.lens, input.width, input.height, output.lens, output.width,
+              output.height, num_samples, fill_uncovered, y, y + band.height);
+          if (rect.empty()) {
+            // Nothing is sampled, but the kernels want a pixel.
+            rect = {0, 0, 1, 1};
+          }
+          reproject::Image source = reader.read(rect);
+          source.lens = input_lens;
+          reproject::reproject_region(&source, reader.x0(), reader.y0(),
+                                      input.width, input.height, &band, y,
+                                      output.height, num_samples,
+                                      interpolation, num_image_threads,
+                                      &transform);
+          writer.write(band);
         }
-        if (exists && skip_if_exists) {
-          std::printf("Skipping '%s'. Already exists.\n",
-                      output_path_png.c_str());
-          done_count++;
-          return;
+        metrics.bytes_read = fs::file_size(p);
+        metrics.pixels_read = reader.decoded_pixels();
+        metrics.pixels_written = uint64_t(output.width) * output.height;
+      } catch (const std::exception &e) {
+        std::printf("Error: %s\n", e.what());
+        run_metrics.add_failed();
+        return;
+      }
+      // The writer has closed the file.
+      metrics.bytes_written = fs::file_size(output_exr, error);
+      metrics.seconds[reproject::STAGE_PROCESS] = stage.seconds();
+      run_metrics.add(metrics);
+      if (journal && !error) {
+        try {
+          journal->record(p.string(), stamp, output_exr.string(),
+                          reproject::stamp_file(output_exr.string(), false),
+                          target_settings[0]);
+        } catch (const std::exception &e) {
+          std::printf("Error: %s\n", e.what());
         }
+      }
+      int dc = ++done_count;
+      std::printf("%4d / %4d: %s\n", dc, count, p.stem().c_str());
+      save_journal(5.0);
+    });
+    bool saved = save_journal(0.0);
+    return save_metrics() && saved ? 0 : 1;
+  }
+
+  // Frames flow through three stages connected by bounded queues: reading and
+  // decoding, reprojection and color processing, encoding and writing. This
+  // way I/O and compression overlap with the reprojection of other frames.
+  // Every frame is read once and reprojected to all targets while its pixels
+  // are at hand, each of them into one output.
+  struct FrameOutput {
+    fs::path output_png;
+    fs::path output_exr;
+    // Set for outputs that already exist with --skip-if-exists, or are up to
+    // date in the --journal.
+    bool skip{false};
+    reproject::Image image;
+    // Gamma encoded output when only PNGs are written, see OutputTransform.
+    std::shared_ptr<uint8_t> png;
+  };
+  struct Frame {
+    reproject::FrameMetrics metrics;
+    // Started when the frame is handed to the next stage.
+    reproject::Stopwatch queued;
+    fs::path path;
+    // Taken before reading, for the --journal.
+    reproject::FileStamp stamp;
+    reproject::Image input;
+    // One per target.
+    std::vector<FrameOutput> outputs;
+    // Estimated memory held until the input is dropped, and until the frame
+    // has been written, see MemoryBudget.
+    size_t input_memory{0};
+    size_t output_memory{0};
+  };
 
-        reproject::Image input;
-        if (p.extension() == ".exr") {
-          input = reproject::read_exr(p.string());
-        } else if (p.extension() == ".png") {
-          input = reproject::read_png(p.string());
+  // Estimates of the memory a frame holds, from its header: the input pixels
+  // and, for PNGs, the file and its 8-bit pixels while decoding; the output
+  // pixels and the gamma encoded pixels and file while encoding PNGs.
+  const size_t element_bytes =
+      pixel_format == reproject::F16 ? sizeof(half) : sizeof(float);
+  auto estimate_input_memory = [&](const reproject::ImageHeader &h,
+                                   const fs::path &p) {
+    size_t bytes = size_t(h.width) * h.height * h.channels * element_bytes;
+    if (p.extension() == ".png") {
+      bytes += size_t(h.width) * h.height * 3 + fs::file_size(p);
+    }
+    return bytes;
+  };
+  auto estimate_output_memory = [&](const reproject::ImageHeader &h,
+                                    const Target &t) {
+    size_t pixels = size_t(int(h.width * t.scale)) * int(h.height * t.scale);
+    size_t png = t.store_png ? 2 * pixels * std::min(h.channels, 4) : 0;
+    if (!t.copy && !auto_exposure && t.store_png && !t.store_exr) {
+      return png;
+    }
+    return pixels * h.channels * element_bytes + png;
+  };
+
+  // Files found so far, and the ones waiting to be read.
+  std::atomic_int count{0};
+  reproject::BoundedQueue<fs::path> inputs(4096);
+  std::atomic_int done_count{0};
+  reproject::BoundedQueue<Frame> decoded(queue_depth);
+  reproject::BoundedQueue<Frame> processed(queue_depth);
+  // One pool per worker thread: frames handled by the same worker recycle
+  // each other's buffers. Buffers return to the pool they came from.
+  std::vector<reproject::BufferPool> read_buffers(num_read_threads);
+  std::vector<reproject::BufferPool> compute_buffers(num_threads);
+  std::vector<reproject::BufferPool> write_buffers(num_write_threads);
+
+  std::vector<reproject::BufferPool *> all_buffers;
+  for (auto *pools : {&read_buffers, &compute_buffers, &write_buffers}) {
+    for (reproject::BufferPool &pool : *pools) {
+      all_buffers.push_back(&pool);
+    }
+  }
+  reproject::MemoryBudget budget(
+      memory_budget,
+      [&] {
+        size_t cached = 0;
+        for (reproject::BufferPool *pool : all_buffers) {
+          cached += pool->cached_bytes();
         }
-        input.lens = input_lens;
+        return cached;
+      },
+      [&] {
+        for (reproject::BufferPool *pool : all_buffers) {
+          pool->clear();
+        }
+      });
+
+  ctpl::thread_pool read_pool(num_read_threads);
+  ctpl::thread_pool compute_pool(num_threads);
+  ctpl::thread_pool write_pool(num_write_threads);
+
+  auto read_stage = [&](int worker) {
+    reproject::BufferPool &buffer_pool = read_buffers[worker];
+    fs::path input;
+    while (inputs.pop(input)) {
+      ZoneScopedN("read_file");
+      reproject::Stopwatch stage;
+      reproject::BufferPool::Stats allocated = buffer_pool.stats();
+      Frame frame;
+      frame.path = frame_file(input);
+      const fs::path &p = frame.path;
+      reproject::FrameMetrics &metrics = frame.metrics;
+      metrics.name = p.filename().string();
+      try {
+        bool all_exist = true;
+        bool up_to_date = false;
+        frame.outputs.resize(targets.size());
+        for (size_t t = 0; t < targets.size(); ++t) {
+          FrameOutput &out = frame.outputs[t];
+          fs::path output_path_base = targets[t].output_dir / p.filename();
+          out.output_png = output_path_base.replace_extension(".png");
+          out.output_exr = output_path_base.replace_extension(".exr");
 
-        reproject::Image output;
-        output.lens = output_lens;
-
-        output.width = int(input.width * scale);
-        output.height = int(input.height * scale);
-        output.channels = input.channels;
-        output.data_layout = input.data_layout;
-        output.data = new float[output.width * output.height * output.channels];
-
-        if (!reproject && scale == 1.0) {
-          uint64_t bytes = output.width * output.height;
-          bytes *= output.channels * sizeof(float);
-          std::memcpy(output.data, input.data, bytes);
-        } else {
-          reproject::reproject(&input, &output, num_samples, interpolation);
+          bool exists = true;
+          if (targets[t].store_png && !fs::exists(out.output_png)) {
+            exists = false;
+          }
+          if (targets[t].store_exr && !fs::exists(out.output_exr)) {
+            exists = false;
+          }
+          out.skip = exists && skip_if_exists;
+          if (!out.skip && journal_done(p, t, out.output_png, out.output_exr)) {
+            out.skip = true;
+            up_to_date = true;
+          }
+          all_exist &= out.skip;
+        }
+        if (all_exist) {
+          std::printf("Skipping '%s'. %s\n", p.c_str(),
+                      up_to_date ? "Up to date in the journal."
+                                 : "Already exists.");
+          done_count++;
+          continue;
+        }
+        if (journal) {
+          frame.stamp = reproject::stamp_file(p.string());
         }
 
-        if (auto_exposure) {
-          reproject::auto_exposure(&output, reinhard);
-        } else if (exposure != 1.0 || reinhard != 1.0) {
-          reproject::post_process(&output, exposure, reinhard);
+        if (memory_budget > 0) {
+          reproject::ImageHeader header =
+              reproject::read_image_header(p.string());
+          frame.input_memory = estimate_input_memory(header, p);
+          for (size_t t = 0; t < targets.size(); ++t) {
+            if (!frame.outputs[t].skip) {
+              frame.output_memory += estimate_output_memory(header, targets[t]);
+            }
+          }
+          budget.acquire(frame.input_memory + frame.output_memory);
         }
+        frame.input = reproject::read_image(p.string(), storage,
+                                            pixel_format, &buffer_pool);
+        frame.input.lens = input_lens;
+        metrics.bytes_read = fs::file_size(p);
+        metrics.pixels_read = uint64_t(frame.input.width) * frame.input.height;
+      } catch (const std::exception &e) {
+        std::printf("Error: %s\n", e.what());
+        run_metrics.add_failed();
+        frame.input = reproject::Image{};
+        budget.release(frame.input_memory + frame.output_memory);
+        continue;
+      }
+      metrics.allocations =
+          buffer_pool.stats().allocations - allocated.allocations;
+      metrics.allocated_bytes =
+          buffer_pool.stats().allocated_bytes - allocated.allocated_bytes;
+      metrics.seconds[reproject::STAGE_READ] = stage.seconds();
+      frame.queued = reproject::Stopwatch();
+      decoded.push(std::move(frame));
+    }
+  };
+
+  auto compute_stage = [&](int worker) {
+    reproject::BufferPool &buffer_pool = compute_buffers[worker];
+    reproject::GpuStream *gpu = gpu_streams[worker].get();
+    Frame frame;
+    while (decoded.pop(frame)) {
+      ZoneScopedN("process_file");
+      reproject::Stopwatch stage;
+      reproject::BufferPool::Stats allocated = buffer_pool.stats();
+      reproject::FrameMetrics &metrics = frame.metrics;
+      metrics.wait_seconds[reproject::STAGE_PROCESS] = frame.queued.seconds();
+      try {
+        reproject::Image &input = frame.input;
+        const size_t num_outputs = targets.size();
+        std::vector<std::shared_ptr<const reproject::ReprojectionMap>> maps(
+            num_outputs);
+        std::vector<char> tonemaps(num_outputs, false);
+        // Of the outputs reprojected on the GPU, for auto exposure.
+        std::vector<std::vector<uint8_t>> coverages(num_outputs);
+        bool uploaded = false;
+        for (size_t t = 0; t < num_outputs; ++t) {
+          const Target &target = targets[t];
+          FrameOutput &out = frame.outputs[t];
+          if (out.skip) {
+            continue;
+          }
+          reproject::Image &output = out.image;
+          output = output_image(input, target);
 
-        if (store_png) {
-          reproject::save_png(output, output_path_png.string());
+          if (target.copy) {
+            tonemaps[t] =
+                batch_exposure > 0 || exposure != 1.0 || reinhard != 1.0;
+            reproject::allocate_pixels(output, &buffer_pool);
+            uint64_t bytes = reproject::num_elements(output);
+            bytes *= reproject::element_size(output);
+            std::memcpy(reproject::pixel_data(output),
+                        reproject::pixel_data(input), bytes);
+            continue;
+          }
+          // Without auto exposure, the color processing (and for PNG only
+          // output, the gamma encoding) is done while reprojecting.
+          reproject::OutputTransform transform;
+          transform.fill_uncovered = fill_uncovered;
+          transform.fill = fill;
+          if (!auto_exposure &&
+              (batch_exposure > 0 || exposure != 1.0 || reinhard != 1.0)) {
+            transform.tonemap = true;
+            std::copy(target.exposure_scales, target.exposure_scales + 3,
+                      transform.scales);
+            transform.reinhard = reinhard;
+          }
+          if (!auto_exposure && target.store_png && !target.store_exr) {
+            transform.png_channels = reproject::png_channels(output);
+            out.png = buffer_pool.acquire_array<uint8_t>(
+                size_t(output.width) * output.height * transform.png_channels);
+            transform.png = out.png.get();
+          } else {
+            reproject::allocate_pixels(output, &buffer_pool);
+          }
+
+          if (gpu && reproject::gpu_supports(&input, &output, interpolation)) {
+            // The input is uploaded once, and each output downloaded while
+            // the next one is reprojected.
+            if (!uploaded) {
+              gpu->upload(input);
+              uploaded = true;
+            }
+            uint8_t *coverage = nullptr;
+            if (auto_exposure && fill_uncovered) {
+              coverages[t].resize(size_t(output.width) * output.height);
+              coverage = coverages[t].data();
+            }
+            gpu->reproject(output, num_samples, interpolation, &transform,
+                           coverage);
+            continue;
+          }
+          reproject::Stopwatch map_time;
+          maps[t] = get_map(&input, &output);
+          metrics.map_seconds += map_time.seconds();
+          reproject::reproject(&input, &output, *maps[t], interpolation,
+                               num_image_threads, &transform);
         }
-        if (store_exr) {
-          reproject::save_exr(output, output_path_exr.string());
+        if (uploaded) {
+          gpu->finish();
         }
+        // Hand the input buffer back before the frame waits in the queue.
+        input = reproject::Image{};
+        budget.release(frame.input_memory);
+        frame.input_memory = 0;
 
-        delete[] input.data;
-        delete[] output.data;
-
-        int dc = ++done_count;
-        std::printf("%4d / %4d: %s\n", dc, count, p.stem().c_str());
+        for (size_t t = 0; t < num_outputs; ++t) {
+          FrameOutput &out = frame.outputs[t];
+          if (out.skip) {
+            continue;
+          }
+          reproject::Image &output = out.image;
+          if (auto_exposure) {
+            // Filled pixels do not count towards the exposure.
+            const uint8_t *coverage = nullptr;
+            if (fill_uncovered && maps[t]) {
+              coverage = maps[t]->coverage;
+            } else if (fill_uncovered && !coverages[t].empty()) {
+              coverage = coverages[t].data();
+            }
+            reproject::auto_exposure(
+                &output,
+                reproject::exposure_histogram(&output, num_image_threads,
+                                              coverage),
+                reinhard, num_image_threads);
+          } else if (tonemaps[t]) {
+            reproject::post_process(&output, targets[t].exposure_scales,
+                                    reinhard, num_image_threads);
+          }
+          metrics.pixels_written += uint64_t(output.width) * output.height;
+        }
       } catch (const std::exception &e) {
         std::printf("Error: %s\n", e.what());
+        run_metrics.add_failed();
+        // Transfers from and to the buffers of the frame must be done before
+        // they are recycled.
+        if (gpu) {
+          try {
+            gpu->finish();
+          } catch (const std::exception &) {
+          }
+        }
+        size_t held = frame.input_memory + frame.output_memory;
+        frame = Frame{};
+        budget.release(held);
+        continue;
       }
-    });
-    count++;
+      metrics.allocations +=
+          buffer_pool.stats().allocations - allocated.allocations;
+      metrics.allocated_bytes +=
+          buffer_pool.stats().allocated_bytes - allocated.allocated_bytes;
+      metrics.seconds[reproject::STAGE_PROCESS] = stage.seconds();
+      frame.queued = reproject::Stopwatch();
+      processed.push(std::move(frame));
+    }
   };
 
-  if (!input_dir.empty()) {
-    fs::directory_iterator end;
-    fs::directory_iterator it{fs::path(input_dir)};
+  auto write_stage = [&](int worker) {
+    reproject::BufferPool &buffer_pool = write_buffers[worker];
+    Frame frame;
+    while (processed.pop(frame)) {
+      ZoneScopedN("write_file");
+      reproject::Stopwatch stage;
+      reproject::BufferPool::Stats allocated = buffer_pool.stats();
+      reproject::FrameMetrics &metrics = frame.metrics;
+      metrics.wait_seconds[reproject::STAGE_WRITE] = frame.queued.seconds();
+      try {
+        for (size_t t = 0; t < targets.size(); ++t) {
+          const Target &target = targets[t];
+          FrameOutput &out = frame.outputs[t];
+          if (out.skip) {
+            continue;
+          }
+          if (out.png) {
+            reproject::save_png(out.png.get(), out.image.width,
+                                out.image.height,
+                                reproject::png_channels(out.image),
+                                out.output_png.string(), png_options);
+          } else if (target.store_png) {
+            reproject::save_png(out.image, out.output_png.string(),
+                                png_options, &buffer_pool);
+          }
+          if (target.store_exr) {
+            reproject::save_exr(out.image, out.output_exr.string(),
+                                exr_options);
+          }
+          out.image = reproject::Image{};
+          out.png.reset();
+
+          // Recorded only once written, and closed.
+          std::string input = frame.path.string();
+          if (target.store_png) {
+            reproject::FileStamp written =
+                reproject::stamp_file(out.output_png.string(), false);
+            metrics.bytes_written += written.size;
+            if (journal) {
+              journal->record(input, frame.stamp, out.output_png.string(),
+                              written, target_settings[t]);
+            }
+          }
+          if (target.store_exr) {
+            reproject::FileStamp written =
+                reproject::stamp_file(out.output_exr.string(), false);
+            metrics.bytes_written += written.size;
+            if (journal) {
+              journal->record(input, frame.stamp, out.output_exr.string(),
+                              written, target_settings[t]);
+            }
+          }
+        }
 
-    std::vector<fs::path> paths;
-    for (; it != end; ++it) {
-      if (it->is_regular_file()) {
-        paths.push_back(*it);
+        int dc = ++done_count;
+        std::printf("%4d / %4d: %s\n", dc, count.load(),
+                    frame.path.stem().c_str());
+        metrics.allocations +=
+            buffer_pool.stats().allocations - allocated.allocations;
+        metrics.allocated_bytes +=
+            buffer_pool.stats().allocated_bytes - allocated.allocated_bytes;
+        metrics.seconds[reproject::STAGE_WRITE] = stage.seconds();
+        run_metrics.add(metrics);
+      } catch (const std::exception &e) {
+        std::printf("Error: %s\n", e.what());
+        run_metrics.add_failed();
       }
+      size_t held = frame.output_memory;
+      frame = Frame{};
+      budget.release(held);
+      save_journal(5.0);
     }
-    std::sort(paths.begin(), paths.end());
+  };
 
-    for (fs::path &p : paths) {
-      std::string fn = p.filename().string();
-      if (fn.size() < filter_prefix.size() ||
-          fn.size() < filter_suffix.size()) {
-        continue;
-      }
-      if (fn.substr(0, filter_prefix.size()) != filter_prefix) {
-        continue;
-      }
-      if (fn.substr(fn.size() - filter_suffix.size()) != filter_suffix) {
-        continue;
-      }
-      if (p.extension() == ".exr" || p.extension() == ".png") {
-        submit_file(p);
+  // The first frames are read while the others are still being discovered.
+  std::atomic_bool discovery_failed{false};
+  std::thread discovery([&] {
+    auto submit = [&](const fs::path &p) {
+      count++;
+      inputs.push(p);
+    };
+    try {
+      if (list_files) {
+        std::for_each(files.begin(), files.end(), submit);
+      } else {
+        discover(submit);
       }
+    } catch (const std::exception &e) {
+      std::printf("Error: %s\n", e.what());
+      discovery_failed = true;
     }
-  } else if (!input_single.empty()) {
-    fs::path p{input_single};
-    submit_file(p);
-  }
+    inputs.close();
+  });
+
+  reproject::run_stage(read_pool, num_read_threads, read_stage,
+                       [&] { decoded.close(); });
+  reproject::run_stage(compute_pool, num_threads, compute_stage,
+                       [&] { processed.close(); });
+  reproject::run_stage(write_pool, num_write_threads, write_stage, [] {});
 
-  pool.stop(true);
+  read_pool.stop(true);
+  compute_pool.stop(true);
+  write_pool.stop(true);
+  discovery.join();
 
-  return 0;
+  bool saved = save_journal(0.0);
+  return save_metrics() && saved && !discovery_failed ? 0 : 1;
 }
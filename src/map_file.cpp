@@ -0,0 +1,245 @@
+#include "map_file.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <new>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <Tracy.hpp>
+
+namespace reproject {
+
+namespace {
+
+const char MAP_MAGIC[8] = {'R', 'P', 'J', 'M', 'A', 'P', '\0', '\0'};
+const uint32_t MAP_VERSION = 2;
+// The arrays start at this offset in the file, such that they are as aligned
+// in the mapping as in an allocated map.
+const size_t MAP_DATA_OFFSET = 4096;
+
+struct MapFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t data_offset;
+  LensInfo in_lens, out_lens;
+  int32_t in_width, in_height;
+  int32_t out_width, out_height;
+  int32_t num_samples;
+  float adaptive_quality;
+  uint32_t fast_lenses;
+  uint32_t compact;
+  uint64_t num_coords;
+  uint64_t num_fixed;
+  uint64_t buffer_size;
+};
+static_assert(sizeof(MapFileHeader) <= MAP_DATA_OFFSET,
+              "Map file header overlaps the data.");
+
+class Fnv1a {
+public:
+  template <typename T> void add(const T &value) {
+    const uint8_t *bytes = (const uint8_t *)&value;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      hash_ = (hash_ ^ bytes[i]) * 0x100000001b3ull;
+    }
+  }
+  uint64_t hash() const { return hash_; }
+
+private:
+  uint64_t hash_{0xcbf29ce484222325ull};
+};
+
+// Only the fields compared by operator==(LensInfo, LensInfo), as the others
+// may hold anything.
+void add_lens(Fnv1a &h, const LensInfo &lens) {
+  h.add(int32_t(lens.type));
+  h.add(lens.sensor_width);
+  h.add(lens.sensor_height);
+  switch (lens.type) {
+  case RECTILINEAR:
+    h.add(lens.rectilinear.focal_length);
+    break;
+  case FISHEYE_EQUIDISTANT:
+    h.add(lens.fisheye_equidistant.fov);
+    break;
+  case FISHEYE_EQUISOLID:
+    h.add(lens.fisheye_equisolid.focal_length);
+    h.add(lens.fisheye_equisolid.fov);
+    break;
+  case EQUIRECTANGULAR:
+    h.add(lens.equirectangular.latitude_min);
+    h.add(lens.equirectangular.latitude_max);
+    h.add(lens.equirectangular.longitude_min);
+    h.add(lens.equirectangular.longitude_max);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Maps or reads the whole file. Returns nullptr if it cannot be opened.
+ */
+std::shared_ptr<void> map_file(const std::string &file, size_t &size) {
+#ifdef _WIN32
+  std::ifstream in(file, std::ios::binary | std::ios::ate);
+  if (!in) {
+    return nullptr;
+  }
+  size = size_t(in.tellg());
+  const std::align_val_t alignment{64};
+  std::shared_ptr<void> data(::operator new(size, alignment),
+                             [alignment](void *p) {
+                               ::operator delete(p, alignment);
+                             });
+  in.seekg(0);
+  if (!in.read((char *)data.get(), size)) {
+    return nullptr;
+  }
+  return data;
+#else
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  size = size_t(st.st_size);
+  void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open.
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  return std::shared_ptr<void>(addr, [size](void *p) { munmap(p, size); });
+#endif
+}
+
+} // namespace
+
+uint64_t map_key(const LensInfo &in_lens, int in_width, int in_height,
+                 const LensInfo &out_lens, int out_width, int out_height,
+                 int num_samples, float adaptive_quality, bool fast_lenses,
+                 bool compact) {
+  Fnv1a h;
+  h.add(MAP_VERSION);
+  add_lens(h, in_lens);
+  add_lens(h, out_lens);
+  h.add(int32_t(in_width));
+  h.add(int32_t(in_height));
+  h.add(int32_t(out_width));
+  h.add(int32_t(out_height));
+  h.add(int32_t(num_samples));
+  h.add(adaptive_quality);
+  h.add(uint8_t(fast_lenses));
+  h.add(uint8_t(compact));
+  return h.hash();
+}
+
+std::string map_file_name(const std::string &directory, uint64_t key) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "map-%016llx.bin",
+                (unsigned long long)key);
+  return directory + "/" + name;
+}
+
+void save_reprojection_map(const ReprojectionMap &map,
+                           const std::string &file) {
+  ZoneScoped;
+  MapFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+  header.version = MAP_VERSION;
+  header.data_offset = MAP_DATA_OFFSET;
+  header.in_lens = map.in_lens;
+  header.out_lens = map.out_lens;
+  header.in_width = map.in_width;
+  header.in_height = map.in_height;
+  header.out_width = map.out_width;
+  header.out_height = map.out_height;
+  header.num_samples = map.num_samples;
+  header.adaptive_quality = map.adaptive_quality;
+  header.fast_lenses = map.fast_lenses;
+  header.compact = map.compact;
+  header.num_coords = map.num_coords;
+  header.num_fixed = map.num_fixed;
+  header.buffer_size = map_buffer_size(map);
+
+  std::random_device random;
+  std::string tmp = file + ".tmp" + std::to_string(random());
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    std::vector<char> padding(MAP_DATA_OFFSET - sizeof(header), 0);
+    out.write((const char *)&header, sizeof(header));
+    out.write(padding.data(), padding.size());
+    // The arrays start at coords, see set_map_arrays().
+    out.write((const char *)map.coords, header.buffer_size);
+    if (!out) {
+      std::remove(tmp.c_str());
+      throw std::runtime_error("Could not write reprojection map " + tmp);
+    }
+  }
+  if (std::rename(tmp.c_str(), file.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    throw std::runtime_error("Could not write reprojection map " + file);
+  }
+}
+
+bool load_reprojection_map(const std::string &file, ReprojectionMap &map) {
+  ZoneScoped;
+  size_t size = 0;
+  std::shared_ptr<void> data = map_file(file, size);
+  if (!data || size < MAP_DATA_OFFSET) {
+    return false;
+  }
+  MapFileHeader header;
+  std::memcpy(&header, data.get(), sizeof(header));
+  if (std::memcmp(header.magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0 ||
+      header.version != MAP_VERSION ||
+      header.data_offset != MAP_DATA_OFFSET) {
+    return false;
+  }
+
+  ReprojectionMap loaded;
+  loaded.in_lens = header.in_lens;
+  loaded.out_lens = header.out_lens;
+  loaded.in_width = header.in_width;
+  loaded.in_height = header.in_height;
+  loaded.out_width = header.out_width;
+  loaded.out_height = header.out_height;
+  loaded.num_samples = header.num_samples;
+  loaded.adaptive_quality = header.adaptive_quality;
+  loaded.fast_lenses = header.fast_lenses != 0;
+  loaded.compact = header.compact != 0;
+  loaded.num_coords = header.num_coords;
+  loaded.num_fixed = header.num_fixed;
+  if (loaded.out_width <= 0 || loaded.out_height <= 0 ||
+      map_buffer_size(loaded) != header.buffer_size ||
+      size < MAP_DATA_OFFSET + header.buffer_size) {
+    return false;
+  }
+  set_map_arrays(loaded, (uint8_t *)data.get() + MAP_DATA_OFFSET);
+  if (!map_arrays_valid(loaded)) {
+    return false;
+  }
+  loaded.buffer = std::move(data);
+  map = std::move(loaded);
+  return true;
+}
+
+} // namespace reproject
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "reproject.hpp"
+
+namespace reproject {
+
+/**
+ * 64-bit FNV-1a hash of everything a reprojection map depends on: the fields
+ * of both lenses that are relevant for their type, the image dimensions and
+ * the sample settings.
+ */
+uint64_t map_key(const LensInfo &in_lens, int in_width, int in_height,
+                 const LensInfo &out_lens, int out_width, int out_height,
+                 int num_samples, float adaptive_quality, bool fast_lenses,
+                 bool compact);
+
+/**
+ * Path of the file of the map with the given key in directory.
+ */
+std::string map_file_name(const std::string &directory, uint64_t key);
+
+/**
+ * Writes map to file, through a temporary file that is renamed into place,
+ * such that other processes never load a partially written map. The layout
+ * is the in-memory layout of the map, so files are specific to the platform.
+ * @throws std::runtime_error if the file cannot be written.
+ */
+void save_reprojection_map(const ReprojectionMap &map, const std::string &file);
+
+/**
+ * Maps a file written by save_reprojection_map() into memory, read-only. The
+ * arrays of map point into the file, which stays mapped as long as map.buffer
+ * lives. Returns false if the file does not exist or does not hold a valid
+ * map, see map_arrays_valid().
+ */
+bool load_reprojection_map(const std::string &file, ReprojectionMap &map);
+
+} // namespace reproject
@@ -0,0 +1,95 @@
+#include "metrics.hpp"
+
+#include <fstream>
+#include <stdexcept>
+
+#include <nlohmann/json.hpp>
+
+namespace reproject {
+
+static const char *STAGE_NAMES[NUM_STAGES] = {"read", "process", "write"};
+
+RunMetrics::RunMetrics(const int *workers) {
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    workers_[s] = workers[s];
+  }
+}
+
+void RunMetrics::add(const FrameMetrics &frame) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  frames_.push_back(frame);
+}
+
+void RunMetrics::add_failed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  failed_++;
+}
+
+void RunMetrics::save(const std::string &file) const {
+  double wall_seconds = run_.seconds();
+  nlohmann::json report;
+  nlohmann::json per_frame = nlohmann::json::array();
+  FrameMetrics total;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const FrameMetrics &f : frames_) {
+      nlohmann::json frame;
+      frame["name"] = f.name;
+      for (int s = 0; s < NUM_STAGES; ++s) {
+        frame[STAGE_NAMES[s]] = {{"seconds", f.seconds[s]},
+                                 {"wait_seconds", f.wait_seconds[s]}};
+        total.seconds[s] += f.seconds[s];
+        total.wait_seconds[s] += f.wait_seconds[s];
+      }
+      frame["map_seconds"] = f.map_seconds;
+      frame["bytes_read"] = f.bytes_read;
+      frame["bytes_written"] = f.bytes_written;
+      frame["pixels_read"] = f.pixels_read;
+      frame["pixels_written"] = f.pixels_written;
+      frame["allocations"] = f.allocations;
+      frame["allocated_bytes"] = f.allocated_bytes;
+      per_frame.push_back(frame);
+
+      total.map_seconds += f.map_seconds;
+      total.bytes_read += f.bytes_read;
+      total.bytes_written += f.bytes_written;
+      total.pixels_read += f.pixels_read;
+      total.pixels_written += f.pixels_written;
+      total.allocations += f.allocations;
+      total.allocated_bytes += f.allocated_bytes;
+    }
+    report["frames"] = frames_.size();
+    report["failed_frames"] = failed_;
+  }
+
+  report["wall_seconds"] = wall_seconds;
+  // The busiest stage is the bottleneck: with a utilization near 1 its threads
+  // never wait, and the others wait on it.
+  for (int s = 0; s < NUM_STAGES; ++s) {
+    double capacity = wall_seconds * workers_[s];
+    report["stages"][STAGE_NAMES[s]] = {
+        {"threads", workers_[s]},
+        {"seconds", total.seconds[s]},
+        {"wait_seconds", total.wait_seconds[s]},
+        {"utilization", capacity > 0.0 ? total.seconds[s] / capacity : 0.0},
+    };
+  }
+  report["stages"]["process"]["map_seconds"] = total.map_seconds;
+  report["bytes_read"] = total.bytes_read;
+  report["bytes_written"] = total.bytes_written;
+  report["pixels_read"] = total.pixels_read;
+  report["pixels_written"] = total.pixels_written;
+  report["megapixels_per_second"] =
+      wall_seconds > 0.0 ? total.pixels_written / wall_seconds * 1e-6 : 0.0;
+  report["allocations"] = total.allocations;
+  report["allocated_bytes"] = total.allocated_bytes;
+  report["per_frame"] = per_frame;
+
+  std::ofstream out(file);
+  out << report.dump(2) << "\n";
+  if (!out) {
+    throw std::runtime_error("Could not write metrics " + file);
+  }
+}
+
+} // namespace reproject
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace reproject {
+
+/**
+ * The stages of the frame pipeline: reading and decoding, reprojection and
+ * color processing, encoding and writing.
+ */
+enum Stage { STAGE_READ, STAGE_PROCESS, STAGE_WRITE, NUM_STAGES };
+
+/**
+ * Wall clock stopwatch for the metrics, started on construction.
+ */
+class Stopwatch {
+public:
+  Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * What one frame cost in each stage. wait_seconds[s] is the time the frame
+ * spent in the queue in front of stage s, including the time the previous
+ * stage was blocked on that queue being full. Allocations are the new buffers
+ * of the pools of the stages while they handled the frame.
+ */
+struct FrameMetrics {
+  std::string name;
+  double seconds[NUM_STAGES]{};
+  double wait_seconds[NUM_STAGES]{};
+  // Part of the process stage spent getting the reprojection map.
+  double map_seconds{0.0};
+  uint64_t bytes_read{0};
+  uint64_t bytes_written{0};
+  uint64_t pixels_read{0};
+  uint64_t pixels_written{0};
+  uint64_t allocations{0};
+  uint64_t allocated_bytes{0};
+};
+
+/**
+ * Thread-safe collection of the metrics of all frames of a run.
+ */
+class RunMetrics {
+public:
+  /** workers[s] is the number of threads of stage s. */
+  explicit RunMetrics(const int *workers);
+
+  void add(const FrameMetrics &frame);
+  void add_failed();
+
+  /**
+   * Writes the totals per stage, their utilization of the threads of the
+   * stage over the run so far, and the per-frame breakdown as JSON.
+   * @throws std::runtime_error if the file cannot be written.
+   */
+  void save(const std::string &file) const;
+
+private:
+  Stopwatch run_;
+  int workers_[NUM_STAGES];
+  mutable std::mutex mutex_;
+  std::vector<FrameMetrics> frames_;
+  int failed_{0};
+};
+
+} // namespace reproject
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace reproject {
+
+/**
+ * Threads kept alive between parallel_for() calls, for programs that make many
+ * short ones, like the reproject_server. While a Workers::Scope is alive,
+ * parallel_for() on its thread runs on these threads instead of starting new
+ * ones. Runs are serialized.
+ */
+class Workers {
+public:
+  /** num_threads threads besides the ones calling run(). */
+  explicit Workers(int num_threads) {
+    for (int t = 0; t < num_threads; ++t) {
+      threads_.emplace_back([this] { loop(); });
+    }
+  }
+
+  ~Workers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &t : threads_) {
+      t.join();
+    }
+  }
+
+  Workers(const Workers &) = delete;
+  Workers &operator=(const Workers &) = delete;
+
+  int size() const { return int(threads_.size()); }
+
+  /**
+   * Calls work on the calling thread and on up to count of the threads, and
+   * returns once all calls are done. Threads that have not started work by
+   * the time the calling thread is done skip it, so work must take its items
+   * from a shared counter, as parallel_for() does.
+   */
+  void run(int count, const std::function<void()> &work) {
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      work_ = &work;
+      wanted_ = std::min(count, size());
+    }
+    wake_.notify_all();
+    {
+      // Nested calls start their own threads.
+      Scope nested(nullptr);
+      work();
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    wanted_ = 0;
+    done_.wait(lock, [this] { return running_ == 0; });
+    work_ = nullptr;
+  }
+
+  /** Workers the calling thread runs parallel_for() on, if any. */
+  static Workers *current() { return current_slot(); }
+
+  /**
+   * Makes parallel_for() on the constructing thread use workers, or start
+   * threads of its own if null.
+   */
+  class Scope {
+  public:
+    explicit Scope(Workers *workers) : previous_(current_slot()) {
+      current_slot() = workers;
+    }
+    ~Scope() { current_slot() = previous_; }
+
+  private:
+    Workers *previous_;
+  };
+
+private:
+  static Workers *&current_slot() {
+    thread_local Workers *workers = nullptr;
+    return workers;
+  }
+
+  void loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [this] { return stop_ || wanted_ > 0; });
+      if (stop_) {
+        return;
+      }
+      wanted_--;
+      running_++;
+      const std::function<void()> &work = *work_;
+      lock.unlock();
+      work();
+      lock.lock();
+      if (--running_ == 0) {
+        done_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void()> *work_{nullptr};
+  // Threads still to start on work_, and threads running it.
+  int wanted_{0};
+  int running_{0};
+  bool stop_{false};
+};
+
+/**
+ * Calls f(i) for every i in [0, count) using num_threads threads (including
+ * the calling one), those of Workers::current() if set. Threads take the next
+ * index from a shared counter, so uneven work items balance out on their own.
+ * The first exception thrown by f is rethrown on the calling thread once all
+ * threads are done.
+ */
+template <typename F> void parallel_for(int count, int num_threads, F f) {
+  num_threads = std::min(num_threads, count);
+  if (num_threads <= 1) {
+    for (int i = 0; i < count; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  std::atomic_int next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto work = [&]() {
+    try {
+      for (int i = next++; i < count; i = next++) {
+        f(i);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      next = count;
+    }
+  };
+
+  Workers *workers = Workers::current();
+  if (workers != nullptr && workers->size() > 0) {
+    workers->run(num_threads - 1, work);
+  } else {
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads; ++t) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (std::thread &t : threads) {
+      t.join();
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Splits a width x height area in square tiles and calls f(x0, y0, x1, y1)
+ * for each of them, in parallel. The ranges are half-open.
+ */
+template <typename F>
+void parallel_for_tiles(int width, int height, int tile_size, int num_threads,
+                        F f) {
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  parallel_for(tiles_x * tiles_y, num_threads, [&](int i) {
+    int x0 = (i % tiles_x) * tile_size;
+    int y0 = (i / tiles_x) * tile_size;
+    f(x0, y0, std::min(x0 + tile_size, width), std::min(y0 + tile_size, height));
+  });
+}
+
+} // namespace reproject
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <ctpl_stl.h>
+
+namespace reproject {
+
+/**
+ * Fixed-capacity queue connecting two pipeline stages. Producers block while
+ * the queue is full, which bounds the number of frames in flight and thereby
+ * the memory they use.
+ */
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  /**
+   * Blocks while the queue is full. Returns false if the queue was closed, in
+   * which case value is dropped.
+   */
+  bool push(T value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(value));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Blocks while the queue is empty. Returns false once the queue is closed
+   * and all remaining items have been taken.
+   */
+  bool pop(T &value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return false;
+    }
+    value = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /** No more items will be pushed. Wakes up all waiting threads. */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+private:
+  size_t capacity_;
+  bool closed_{false};
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+/**
+ * Admits frames into a pipeline while the memory they are estimated to hold
+ * fits a budget, such that the number of frames in flight adapts to their
+ * size instead of being fixed. Memory cached for reuse counts towards the
+ * budget too: it is given up through reclaim() when a frame would not fit
+ * next to it.
+ */
+class MemoryBudget {
+public:
+  /**
+   * A budget of 0 admits everything. cached() returns the memory held for
+   * reuse, reclaim() frees it.
+   */
+  MemoryBudget(size_t budget, std::function<size_t()> cached,
+               std::function<void()> reclaim)
+      : budget_(budget), cached_(std::move(cached)),
+        reclaim_(std::move(reclaim)) {}
+
+  /**
+   * Blocks until bytes more fit in the budget. A frame that does not fit on
+   * its own is admitted once nothing else is in flight.
+   */
+  void acquire(size_t bytes) {
+    if (budget_ == 0) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (used_ > 0 && used_ + bytes > budget_) {
+      released_.wait(lock);
+    }
+    if (used_ + cached_() + bytes > budget_) {
+      reclaim_();
+    }
+    used_ += bytes;
+  }
+
+  void release(size_t bytes) {
+    if (budget_ == 0 || bytes == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= bytes;
+    released_.notify_all();
+  }
+
+private:
+  size_t budget_;
+  size_t used_{0};
+  std::function<size_t()> cached_;
+  std::function<void()> reclaim_;
+  std::mutex mutex_;
+  std::condition_variable released_;
+};
+
+/**
+ * Runs body(worker) for worker in [0, num_workers) on the threads of pool,
+ * which should have num_workers threads. done() is called once, by the worker
+ * that finishes last, also if body throws; stages use it to close their output
+ * queue.
+ */
+template <typename F, typename D>
+void run_stage(ctpl::thread_pool &pool, int num_workers, F body, D done) {
+  auto remaining = std::make_shared<std::atomic_int>(num_workers);
+  for (int w = 0; w < num_workers; ++w) {
+    pool.push([w, body, done, remaining](int) {
+      struct Finish {
+        const D &done;
+        std::atomic_int &remaining;
+        ~Finish() {
+          if (--remaining == 0) {
+            done();
+          }
+        }
+      } finish{done, *remaining};
+      body(w);
+    });
+  }
+}
+
+} // namespace reproject
@@ -2,15 +2,30 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <stdexcept>
 
 #include <Tracy.hpp>
 
+#include "buffer_pool.hpp"
+#include "color.hpp"
+#include "kernel_dispatch.hpp"
+#include "map_file.hpp"
+#include "parallel.hpp"
+#include "sample_simd.hpp"
+
 namespace reproject {
 
-typedef void (*from_func_t)(const LensInfo &li, float img_w, float img_h,
+// Lens functions return false for points outside the field of view of the
+// lens.
+typedef bool (*from_func_t)(const LensInfo &li, float img_w, float img_h,
                             float cx, float cy, float &alpha, float &theta);
-typedef void (*to_func_t)(const LensInfo &li, float img_w, float img_h,
+typedef bool (*to_func_t)(const LensInfo &li, float img_w, float img_h,
                           float cx, float cy, float &alpha, float &theta);
 
 typedef void (*sample_func_t)(const Image *img, float sx, float sy, float *out);
@@ -19,22 +34,39 @@ template <typename T> inline T clamp(T x, T min, T max) {
   return std::max(min, std::min(max, x));
 }
 
+// The sampling and accumulation code is instantiated for a fixed channel count
+// C (3, 4 or 5, see DataLayout), Storage S and element type T (float or half),
+// such that the channel loops have a constant trip count and the strides are
+// known. C = 0 is the generic version that uses img->channels.
+
+template <int C, Storage S, typename T>
 inline void sample_nearest(const Image *img, float sx, float sy, float *out) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
   int lx = clamp(int(sx + 0.5f), 0, img->width - 1);
   int ly = clamp(int(sy + 0.5f), 0, img->height - 1);
 
-  int pitch = img->width * img->channels;
-  for (int c = 0; c < img->channels; ++c) {
-    out[c] = img->data[ly * pitch + lx * img->channels + c];
+  int pitch = img->width * ps;
+  for (int c = 0; c < channels; ++c) {
+    out[c] = pixels<T>(*img)[ly * pitch + lx * ps + c * cs];
   }
 }
 
+template <int C, Storage S, typename T>
 inline void sample_bilinear(const Image *img, float sx, float sy, float *out) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  // The upper taps are derived from the lower ones rather than from sx + 1,
+  // which rounds up to the next integer just below integers from 1024 on.
+  int ix = int(sx);
+  int iy = int(sy);
   // clang-format off
-    int lx = clamp(int(sx)       , 0, img->width - 1);
-    int ux = clamp(int(sx + 1.0f), 0, img->width - 1);
-    int ly = clamp(int(sy)       , 0, img->height - 1);
-    int uy = clamp(int(sy + 1.0f), 0, img->height - 1);
+    int lx = clamp(ix    , 0, img->width - 1);
+    int ux = clamp(ix + 1, 0, img->width - 1);
+    int ly = clamp(iy    , 0, img->height - 1);
+    int uy = clamp(iy + 1, 0, img->height - 1);
   // clang-format on
 
   float fx = std::max(0.0f, std::min(1.0f, sx - lx));
@@ -42,12 +74,13 @@ inline void sample_bilinear(const Image *img, float sx, float sy, float *out) {
   float cfx = 1.0f - fx;
   float cfy = 1.0f - fy;
 
-  int pitch = img->width * img->channels;
-  for (int c = 0; c < img->channels; ++c) {
-    float ll = img->data[ly * pitch + lx * img->channels + c];
-    float lu = img->data[ly * pitch + ux * img->channels + c];
-    float ul = img->data[uy * pitch + lx * img->channels + c];
-    float uu = img->data[uy * pitch + ux * img->channels + c];
+  int pitch = img->width * ps;
+  for (int c = 0; c < channels; ++c) {
+    const T *plane = pixels<T>(*img) + c * cs;
+    float ll = plane[ly * pitch + lx * ps];
+    float lu = plane[ly * pitch + ux * ps];
+    float ul = plane[uy * pitch + lx * ps];
+    float uu = plane[uy * pitch + ux * ps];
 
     // interpolate horizontally
     float l = fx * lu + cfx * ll;
@@ -59,69 +92,76 @@ inline void sample_bilinear(const Image *img, float sx, float sy, float *out) {
   }
 }
 
-inline float cubicInterpolate(float p[4], float x) {
+/**
+ * Catmull-Rom weights of the four taps around a sample at fraction x, such
+ * that the interpolated value is w[0] p[0] + w[1] p[1] + w[2] p[2] + w[3] p[3].
+ */
+inline void cubic_weights(float x, float w[4]) {
+  float x2 = x * x;
+  float x3 = x2 * x;
   // clang-format off
-    return p[1] + 0.5 * x * (p[2] - p[0] + x *
-            (2.0 * p[0] - 5.0 * p[1] + 4.0 * p[2] - p[3] + x *
-             (3.0 * (p[1] - p[2]) + p[3] - p[0])));
+  w[0] = 0.5f * (2.0f * x2 - (x + x3));
+  w[1] = 0.5f * (3.0f * x3 - 5.0f * x2 + 2.0f);
+  w[2] = 0.5f * (-3.0f * x3 + (4.0f * x2 + x));
+  w[3] = 0.5f * (x3 - x2);
   // clang-format on
 }
 
-inline float bicubicInterpolate(float p[4][4], float x, float y) {
-  float arr[4];
-  arr[0] = cubicInterpolate(p[0], y);
-  arr[1] = cubicInterpolate(p[1], y);
-  arr[2] = cubicInterpolate(p[2], y);
-  arr[3] = cubicInterpolate(p[3], y);
-  return cubicInterpolate(arr, x);
-}
-
+template <int C, Storage S, typename T>
 inline void sample_bicubic(const Image *img, float sx, float sy, float *out) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  // See sample_bilinear() for why the taps are derived from one index.
+  int ix = int(sx);
+  int iy = int(sy);
   // clang-format off
-    int x0 = clamp(int(sx - 1.0f), 0, img->width - 1);
-    int x1 = clamp(int(sx       ), 0, img->width - 1);
-    int x2 = clamp(int(sx + 1.0f), 0, img->width - 1);
-    int x3 = clamp(int(sx + 2.0f), 0, img->width - 1);
-    int y0 = clamp(int(sy - 1.0f), 0, img->height - 1);
-    int y1 = clamp(int(sy       ), 0, img->height - 1);
-    int y2 = clamp(int(sy + 1.0f), 0, img->height - 1);
-    int y3 = clamp(int(sy + 2.0f), 0, img->height - 1);
+    int x0 = clamp(ix - 1, 0, img->width - 1);
+    int x1 = clamp(ix    , 0, img->width - 1);
+    int x2 = clamp(ix + 1, 0, img->width - 1);
+    int x3 = clamp(ix + 2, 0, img->width - 1);
+    int y0 = clamp(iy - 1, 0, img->height - 1);
+    int y1 = clamp(iy    , 0, img->height - 1);
+    int y2 = clamp(iy + 1, 0, img->height - 1);
+    int y3 = clamp(iy + 2, 0, img->height - 1);
   // clang-format on
-  //
-  float fx = std::max(0.0f, std::min(1.0f, sx - x1));
-  float fy = std::max(0.0f, std::min(1.0f, sy - y1));
 
-  int pitch = img->width * img->channels;
-  for (int c = 0; c < img->channels; ++c) {
-    float p[4][4];
-#define FETCH(xi, yi)                                                          \
-  p[xi][yi] = img->data[y##yi * pitch + x##xi * img->channels + c]
-    // clang-format off
-        FETCH(0, 0); FETCH(1, 0); FETCH(2, 0); FETCH(3, 0);
-        FETCH(0, 1); FETCH(1, 1); FETCH(2, 1); FETCH(3, 1);
-        FETCH(0, 2); FETCH(1, 2); FETCH(2, 2); FETCH(3, 2);
-        FETCH(0, 3); FETCH(1, 3); FETCH(2, 3); FETCH(3, 3);
-    // clang-format on
-#undef FETCH
+  // The weights and offsets are shared by all channels, which then take a
+  // separable dot product with the 16 taps: rows first, then columns.
+  float wx[4], wy[4];
+  cubic_weights(std::max(0.0f, std::min(1.0f, sx - x1)), wx);
+  cubic_weights(std::max(0.0f, std::min(1.0f, sy - y1)), wy);
 
-    out[c] = bicubicInterpolate(p, fx, fy);
+  int pitch = img->width * ps;
+  const int cols[4] = {x0 * ps, x1 * ps, x2 * ps, x3 * ps};
+  const int rows[4] = {y0 * pitch, y1 * pitch, y2 * pitch, y3 * pitch};
+  for (int c = 0; c < channels; ++c) {
+    const T *plane = pixels<T>(*img) + c * cs;
+    float r = 0.0f;
+    for (int j = 0; j < 4; ++j) {
+      const T *line = plane + rows[j];
+      float h = wx[0] * float(line[cols[0]]) + wx[1] * float(line[cols[1]]) +
+                wx[2] * float(line[cols[2]]) + wx[3] * float(line[cols[3]]);
+      r += wy[j] * h;
+    }
+    out[c] = r;
   }
 }
 
 // === RECTILINEAR ===
 
-inline void rectilinear_to_spherical(const LensInfo &li, float img_w,
+inline bool rectilinear_to_spherical(const LensInfo &li, float img_w,
                                      float img_h, float cx, float cy,
                                      float &alpha, float &theta) {
   float r_px = std::sqrt(cx * cx + cy * cy); // [px]
   alpha = std::atan2(cy, cx);
   float factor = li.sensor_width / img_w; // [mm / px]
   // r_mm = focal_length_mm * tan(theta)
-  // TODO validate
   theta = std::atan(r_px / li.rectilinear.focal_length * factor);
+  return true;
 }
 
-inline void spherical_to_rectilinear(const LensInfo &li, float img_w,
+inline bool spherical_to_rectilinear(const LensInfo &li, float img_w,
                                      float img_h, float alpha, float theta,
                                      float &cx, float &cy) {
   float x = std::cos(alpha);
@@ -130,12 +170,13 @@ inline void spherical_to_rectilinear(const LensInfo &li, float img_w,
   float r_px = r_mm / li.sensor_width * img_w;
   cx = r_px * x;
   cy = r_px * y;
-  // TODO valide
+  // Directions at or behind the image plane do not project.
+  return theta < 1.57079633f;
 }
 
 // === EQUIDISTANT ===
 
-inline void equidistant_to_spherical(const LensInfo &li, float img_w,
+inline bool equidistant_to_spherical(const LensInfo &li, float img_w,
                                      float img_h, float cx, float cy,
                                      float &alpha, float &theta) {
   float r_px = std::sqrt(cx * cx + cy * cy); // [px]
@@ -146,9 +187,10 @@ inline void equidistant_to_spherical(const LensInfo &li, float img_w,
   // theta = r_mm / f
   theta = r_mm / focal_length;
   alpha = std::atan2(cy, cx);
+  return theta <= 0.5f * li.fisheye_equidistant.fov;
 }
 
-inline void spherical_to_equidistant(const LensInfo &li, float img_w,
+inline bool spherical_to_equidistant(const LensInfo &li, float img_w,
                                      float img_h, float alpha, float theta,
                                      float &cx, float &cy) {
   float x = std::cos(alpha);
@@ -168,200 +210,1399 @@ inline void spherical_to_equidistant(const LensInfo &li, float img_w,
   float r_px = r_mm / li.sensor_width * img_w;
   cx = r_px * x;
   cy = r_px * y;
+  return theta <= 0.5f * li.fisheye_equidistant.fov;
 }
 
-template <from_func_t ff, to_func_t tf, sample_func_t sf>
-void reproject_from_to(const Image *in, Image *out, int num_samples) {
-  ZoneScoped;
+typedef void (*map_row_func_t)(const LensInfo &in_lens, int in_w, int in_h,
+                               const LensInfo &out_lens, int out_w, int out_h,
+                               int num_samples, int y, int x0, int x1,
+                               float *coords, uint8_t *coverage);
 
-  int pitch = out->width * out->channels;
-  float normalize = (1.0f / (num_samples * num_samples));
-  for (int y = 0; y < out->height; ++y) {
-    for (int x = 0; x < out->width; ++x) {
-      // Center around (0,0)
-      float cx = (x + 0.5f) - out->width * 0.5f;
-      float cy = (y + 0.5f) - out->height * 0.5f;
-
-      float sample_accumulator[out->channels];
-      for (int c = 0; c < out->channels; ++c) {
-        sample_accumulator[c] = 0.0f;
-      }
+// Output is processed in square tiles of this size, both when building maps
+// and when sampling.
+const int TILE_SIZE = 64;
 
-      for (int ssx = 0; ssx < num_samples; ++ssx) {
-        float scx = cx + (ssx + 1.0f) / (num_samples + 1.0f) - 0.5f;
+/**
+ * Computes the source coordinates of all subsamples of pixels [x0, x1) of
+ * output row y. Writes num_samples^2 (sx, sy) pairs per pixel to coords, and
+ * to coverage whether any of them lies inside the input image. Subsamples
+ * outside of it still get (clamped) coordinates.
+ */
+template <from_func_t ff, to_func_t tf>
+void map_row(const LensInfo &in_lens, int in_w, int in_h,
+             const LensInfo &out_lens, int out_w, int out_h, int num_samples,
+             int y, int x0, int x1, float *coords, uint8_t *coverage) {
+  for (int x = x0; x < x1; ++x) {
+    bool covered = false;
+    // Center around (0,0)
+    float cx = (x + 0.5f) - out_w * 0.5f;
+    float cy = (y + 0.5f) - out_h * 0.5f;
 
-        for (int ssy = 0; ssy < num_samples; ++ssy) {
-          float scy = cy + (ssy + 1.0f) / (num_samples + 1.0f) - 0.5f;
+    for (int ssx = 0; ssx < num_samples; ++ssx) {
+      float scx = cx + (ssx + 1.0f) / (num_samples + 1.0f) - 0.5f;
 
-          float alpha;
-          float theta;
-          ff(out->lens, out->width, out->height, scx, scy, alpha, theta);
+      for (int ssy = 0; ssy < num_samples; ++ssy) {
+        float scy = cy + (ssy + 1.0f) / (num_samples + 1.0f) - 0.5f;
 
-          float sx, sy; // source coordinate on input image
-          tf(in->lens, in->width, in->height, alpha, theta, sx, sy);
+        float alpha;
+        float theta;
+        bool valid = ff(out_lens, out_w, out_h, scx, scy, alpha, theta);
 
-          // convert back to top-left aligned coordinates
-          sx = (sx - 0.5f) + in->width * 0.5f;
-          sy = (sy - 0.5f) + in->height * 0.5f;
+        float sx, sy; // source coordinate on input image
+        valid &= tf(in_lens, in_w, in_h, alpha, theta, sx, sy);
 
-          // bilinear interpolation from source image
-          float sample[out->channels];
-          sf(in, sx, sy, sample);
-
-          for (int c = 0; c < out->channels; ++c) {
-            sample_accumulator[c] += sample[c];
-          }
-        }
-        float *dst = &out->data[y * pitch + x * out->channels];
-        for (int c = 0; c < out->channels; ++c) {
-          dst[c] = sample_accumulator[c] * normalize;
-        }
+        // convert back to top-left aligned coordinates
+        sx = (sx - 0.5f) + in_w * 0.5f;
+        sy = (sy - 0.5f) + in_h * 0.5f;
+        *coords++ = sx;
+        *coords++ = sy;
+        covered |= valid && sx >= -0.5f && sx <= in_w - 0.5f &&
+                   sy >= -0.5f && sy <= in_h - 0.5f;
       }
     }
+    *coverage++ = covered;
   }
 }
 
-template <from_func_t ff, sample_func_t sf>
-void reproject_from(const Image *in, Image *out, int num_samples) {
-  if (in->lens.type == RECTILINEAR) {
-    reproject_from_to<ff, spherical_to_rectilinear, sf>(in, out, num_samples);
-  } else if (in->lens.type == FISHEYE_EQUIDISTANT) {
-    reproject_from_to<ff, spherical_to_equidistant, sf>(in, out, num_samples);
-  } else if (in->lens.type == EQUIRECTANGULAR) {
+template <from_func_t ff> map_row_func_t map_row_from(const LensInfo &in_lens) {
+  if (in_lens.type == RECTILINEAR) {
+    return map_row<ff, spherical_to_rectilinear>;
+  } else if (in_lens.type == FISHEYE_EQUIDISTANT) {
+    return map_row<ff, spherical_to_equidistant>;
+  } else if (in_lens.type == EQUIRECTANGULAR) {
     throw std::runtime_error("Equirectangular not supported.");
   }
+  throw std::runtime_error("Input lens type not supported.");
 }
 
-template <sample_func_t sf>
-void reproject_with_sample_method(const Image *in, Image *out,
-                                  int num_samples) {
-  if (out->lens.type == RECTILINEAR) {
-    reproject_from<rectilinear_to_spherical, sf>(in, out, num_samples);
-  } else if (out->lens.type == FISHEYE_EQUIDISTANT) {
-    reproject_from<equidistant_to_spherical, sf>(in, out, num_samples);
-  } else if (out->lens.type == EQUIRECTANGULAR) {
+map_row_func_t map_row_func(const LensInfo &in_lens, const LensInfo &out_lens) {
+  if (out_lens.type == RECTILINEAR) {
+    return map_row_from<rectilinear_to_spherical>(in_lens);
+  } else if (out_lens.type == FISHEYE_EQUIDISTANT) {
+    return map_row_from<equidistant_to_spherical>(in_lens);
+  } else if (out_lens.type == EQUIRECTANGULAR) {
     throw std::runtime_error("Equirectangular not supported.");
   }
+  throw std::runtime_error("Output lens type not supported.");
 }
 
-void reproject_nearest_neighbor(const Image *in, Image *out, int num_samples) {
-  ZoneScoped;
-  reproject_with_sample_method<sample_nearest>(in, out, num_samples);
+from_func_t from_func(const LensInfo &lens) {
+  if (lens.type == RECTILINEAR) {
+    return rectilinear_to_spherical;
+  } else if (lens.type == FISHEYE_EQUIDISTANT) {
+    return equidistant_to_spherical;
+  }
+  throw std::runtime_error("Output lens type not supported.");
 }
-void reproject_bilinear(const Image *in, Image *out, int num_samples) {
-  ZoneScoped;
-  reproject_with_sample_method<sample_bilinear>(in, out, num_samples);
+
+to_func_t to_func(const LensInfo &lens) {
+  if (lens.type == RECTILINEAR) {
+    return spherical_to_rectilinear;
+  } else if (lens.type == FISHEYE_EQUIDISTANT) {
+    return spherical_to_equidistant;
+  }
+  throw std::runtime_error("Input lens type not supported.");
+}
+
+/**
+ * Maps rows of output pixels to source coordinates for one pair of lenses and
+ * image dimensions, see map_row.
+ *
+ * All lenses are radially symmetric around the image center, so a point at
+ * (cx, cy) maps to (cx, cy) * g(r^2), where g is the ratio of the input to the
+ * output radius. The fast path looks g up in a table over r^2 instead of
+ * going through the polar angle and the trigonometry of both lenses.
+ */
+struct RowMapper {
+  map_row_func_t exact;
+  LensInfo in_lens, out_lens;
+  int in_w, in_h, out_w, out_h;
+  // Fast path if not empty: g at r^2 = i / inv_r2_step, interpolated
+  // linearly. Points are in the field of view of both lenses below valid_r2.
+  std::vector<float> radial;
+  float inv_r2_step{0.0f};
+  float valid_r2{0.0f};
+
+  void operator()(int num_samples, int y, int x0, int x1, float *coords,
+                  uint8_t *coverage) const;
+};
+
+/**
+ * Like map_row, with the radial table of mapper.
+ */
+void map_row_radial(const RowMapper &mapper, int num_samples, int y, int x0,
+                    int x1, float *coords, uint8_t *coverage) {
+  const float *radial = mapper.radial.data();
+  const int last = int(mapper.radial.size()) - 2;
+  const float in_cx = mapper.in_w * 0.5f - 0.5f;
+  const float in_cy = mapper.in_h * 0.5f - 0.5f;
+  for (int x = x0; x < x1; ++x) {
+    bool covered = false;
+    float cx = (x + 0.5f) - mapper.out_w * 0.5f;
+    float cy = (y + 0.5f) - mapper.out_h * 0.5f;
+
+    for (int ssx = 0; ssx < num_samples; ++ssx) {
+      float scx = cx + (ssx + 1.0f) / (num_samples + 1.0f) - 0.5f;
+
+      for (int ssy = 0; ssy < num_samples; ++ssy) {
+        float scy = cy + (ssy + 1.0f) / (num_samples + 1.0f) - 0.5f;
+
+        float r2 = scx * scx + scy * scy;
+        float t = r2 * mapper.inv_r2_step;
+        int i = std::min(int(t), last);
+        float g = radial[i] + (t - i) * (radial[i + 1] - radial[i]);
+        float sx = scx * g + in_cx;
+        float sy = scy * g + in_cy;
+        *coords++ = sx;
+        *coords++ = sy;
+        covered |= r2 < mapper.valid_r2 && sx >= -0.5f &&
+                   sx <= mapper.in_w - 0.5f && sy >= -0.5f &&
+                   sy <= mapper.in_h - 0.5f;
+      }
+    }
+    *coverage++ = covered;
+  }
+}
+
+void RowMapper::operator()(int num_samples, int y, int x0, int x1,
+                           float *coords, uint8_t *coverage) const {
+  if (radial.empty()) {
+    exact(in_lens, in_w, in_h, out_lens, out_w, out_h, num_samples, y, x0, x1,
+          coords, coverage);
+  } else {
+    map_row_radial(*this, num_samples, y, x0, x1, coords, coverage);
+  }
 }
-void reproject_bicubic(const Image *in, Image *out, int num_samples) {
+
+// Maximum error of the fast path, in input pixels.
+const float RADIAL_TOLERANCE = 1.0f / 256.0f;
+
+/**
+ * Builds the radial table of mapper. The table is refined until linear
+ * interpolation is within RADIAL_TOLERANCE of the exact mapping at the
+ * midpoints of all its intervals that map inside the input image.
+ */
+void build_radial_table(RowMapper &mapper) {
   ZoneScoped;
-  reproject_with_sample_method<sample_bicubic>(in, out, num_samples);
+  from_func_t ff = from_func(mapper.out_lens);
+  to_func_t tf = to_func(mapper.in_lens);
+  // Exact input radius at output radius r, along the x axis.
+  auto radius = [&](float r, float &r_in) {
+    float alpha, theta, sy;
+    bool valid = ff(mapper.out_lens, mapper.out_w, mapper.out_h, r, 0.0f,
+                    alpha, theta);
+    valid &= tf(mapper.in_lens, mapper.in_w, mapper.in_h, alpha, theta, r_in,
+                sy);
+    return valid;
+  };
+
+  float max_r = 0.5f * std::sqrt(float(mapper.out_w) * mapper.out_w +
+                                 float(mapper.out_h) * mapper.out_h) +
+                1.0f;
+  float max_r2 = max_r * max_r;
+  float in_r = 0.5f * std::sqrt(float(mapper.in_w) * mapper.in_w +
+                                float(mapper.in_h) * mapper.in_h) +
+               2.0f;
+  std::vector<float> radial;
+  std::vector<uint8_t> valid;
+  for (int size = 1024; size <= (1 << 22); size *= 2) {
+    float step = max_r2 / size;
+    radial.resize(size + 2);
+    valid.resize(size + 2);
+    for (int i = 0; i < size + 2; ++i) {
+      // g is even in r, so the limit at 0 is close to its value at a tiny r.
+      float r = std::max(std::sqrt(i * step), 1e-3f);
+      float r_in;
+      valid[i] = radius(r, r_in);
+      // Outside the field of view the lens functions may diverge, e.g. the
+      // tangent of rectilinear lenses. Hold the last value there, such that
+      // the interval at the edge does not mix it into valid points.
+      radial[i] = valid[i] || i == 0 ? r_in / r : radial[i - 1];
+    }
+    bool accurate = true;
+    for (int i = 0; i < size + 1 && accurate; ++i) {
+      if (!valid[i] || !valid[i + 1]) {
+        continue;
+      }
+      float r = std::sqrt((i + 0.5f) * step);
+      float r_in;
+      radius(r, r_in);
+      if (std::abs(r_in) > in_r) {
+        continue;
+      }
+      float g = 0.5f * (radial[i] + radial[i + 1]);
+      accurate = std::abs(r * g - r_in) <= RADIAL_TOLERANCE;
+    }
+    if (accurate) {
+      break;
+    }
+  }
+
+  // Points stay in the field of view up to some radius, found by bisection
+  // from the first table entry outside of it.
+  mapper.valid_r2 = std::numeric_limits<float>::infinity();
+  float step = max_r2 / (radial.size() - 2);
+  for (size_t i = 0; i < valid.size(); ++i) {
+    if (!valid[i]) {
+      float lo = i > 0 ? std::sqrt((i - 1) * step) : 0.0f;
+      float hi = std::sqrt(i * step);
+      for (int k = 0; k < 40; ++k) {
+        float r_in;
+        float mid = 0.5f * (lo + hi);
+        (radius(mid, r_in) ? lo : hi) = mid;
+      }
+      mapper.valid_r2 = lo * lo;
+      break;
+    }
+  }
+  mapper.radial = std::move(radial);
+  mapper.inv_r2_step = 1.0f / step;
+}
+
+RowMapper make_row_mapper(const LensInfo &in_lens, int in_w, int in_h,
+                          const LensInfo &out_lens, int out_w, int out_h,
+                          bool fast_lenses) {
+  RowMapper mapper;
+  mapper.exact = map_row_func(in_lens, out_lens);
+  mapper.in_lens = in_lens;
+  mapper.out_lens = out_lens;
+  mapper.in_w = in_w;
+  mapper.in_h = in_h;
+  mapper.out_w = out_w;
+  mapper.out_h = out_h;
+  if (fast_lenses) {
+    build_radial_table(mapper);
+  }
+  return mapper;
 }
-void reproject(const Image *in, Image *out, int num_samples, Interpolation im) {
+
+/**
+ * Scalar fallback for the vectorized batch kernels in sample_simd.cpp.
+ */
+template <int C, sample_func_t sf>
+void sample_batch(const Image *img, const float *coords, int n, float *out) {
+  const int channels = C > 0 ? C : img->channels;
+  // The generic version has no compile-time bound on the channel count.
+  float fixed_sample[C > 0 ? C : 1];
+  std::vector<float> dynamic_sample(C > 0 ? 0 : channels);
+  float *sample = C > 0 ? fixed_sample : dynamic_sample.data();
+  for (int i = 0; i < n; ++i) {
+    sf(img, coords[2 * i], coords[2 * i + 1], sample);
+    for (int c = 0; c < channels; ++c) {
+      out[c * n + i] = sample[c];
+    }
+  }
+}
+
+template <int C, Storage S, typename T>
+sample_batch_func_t sample_batch_func(const Image *in, Interpolation im) {
+  if (sample_batch_func_t simd = simd_sample_batch_func(in, im)) {
+    return simd;
+  }
   if (im == NEAREST) {
-    reproject_nearest_neighbor(in, out, num_samples);
+    return sample_batch<C, sample_nearest<C, S, T>>;
   } else if (im == BILINEAR) {
-    reproject_bilinear(in, out, num_samples);
+    return sample_batch<C, sample_bilinear<C, S, T>>;
   } else if (im == BICUBIC) {
-    reproject_bicubic(in, out, num_samples);
+    return sample_batch<C, sample_bicubic<C, S, T>>;
   }
+  throw std::invalid_argument("Unknown interpolation method.");
+}
+
+/**
+ * Successively halved versions of an image, each level a 2x2 box filter of the
+ * previous one, down to 1x1. Level 0 is the image itself.
+ */
+struct MipPyramid {
+  std::vector<Image> levels;
+};
+
+template <int C, Storage S, typename T>
+void downsample(const Image &src, Image &dst, int num_threads) {
+  const int channels = C > 0 ? C : src.channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t src_cs = S == PLANAR ? size_t(src.width) * src.height : 1;
+  const size_t dst_cs = S == PLANAR ? size_t(dst.width) * dst.height : 1;
+  parallel_for(dst.height, num_threads, [&](int y) {
+    size_t r0 = size_t(std::min(2 * y, src.height - 1)) * src.width;
+    size_t r1 = size_t(std::min(2 * y + 1, src.height - 1)) * src.width;
+    for (int x = 0; x < dst.width; ++x) {
+      int x0 = std::min(2 * x, src.width - 1);
+      int x1 = std::min(2 * x + 1, src.width - 1);
+      for (int c = 0; c < channels; ++c) {
+        const T *plane = pixels<T>(src) + c * src_cs;
+        float v = float(plane[(r0 + x0) * ps]) + float(plane[(r0 + x1) * ps]) +
+                  float(plane[(r1 + x0) * ps]) + float(plane[(r1 + x1) * ps]);
+        pixels<T>(dst)[(size_t(y) * dst.width + x) * ps + c * dst_cs] =
+            0.25f * v;
+      }
+    }
+  });
 }
 
-void auto_exposure(const Image *img, float reinhard) {
+template <int C, Storage S, typename T>
+MipPyramid build_mip_pyramid(const Image *img, int num_threads) {
   ZoneScoped;
-  int ch = std::min(img->channels, 3);
-  
-  // determine per-channel median
-  float *medians = new float[ch];
-  int i = 0;
-  float *values = new float[img->height*img->width];
-  for ( int k = 0; k < ch; ++k) {
-    int n = 0;
-    i = 0;
-    for (int y = 0; y < img->height; ++y) {
-      for (int x = 0; x < img->width; ++x) {
-        for (int c = 0; c < ch; ++c) {
-          if ( c == k ) {
-            if ( !std::isnan(img->data[i]) ) {
-              values[n++] = img->data[i];
-            }
+  MipPyramid pyramid;
+  pyramid.levels.push_back(*img);
+  while (pyramid.levels.back().width > 1 || pyramid.levels.back().height > 1) {
+    const Image &src = pyramid.levels.back();
+    Image dst = src;
+    dst.width = (src.width + 1) / 2;
+    dst.height = (src.height + 1) / 2;
+    allocate_pixels(dst);
+    downsample<C, S, T>(src, dst, num_threads);
+    pyramid.levels.push_back(dst);
+  }
+  return pyramid;
+}
+
+typedef void (*sample_mip_batch_func_t)(const MipPyramid &pyramid,
+                                        const float *coords, const float *lods,
+                                        int spp, int n, float *out);
+
+/**
+ * Like sample_batch, but interpolates bilinearly between the two mip levels
+ * around lods[i / spp]. Coordinates are in pixels of level 0.
+ */
+template <int C, Storage S, typename T>
+void sample_trilinear_batch(const MipPyramid &pyramid, const float *coords,
+                            const float *lods, int spp, int n, float *out) {
+  const Image &base = pyramid.levels[0];
+  const int channels = C > 0 ? C : base.channels;
+  float fixed_samples[2][C > 0 ? C : 1];
+  std::vector<float> dynamic_samples(C > 0 ? 0 : 2 * channels);
+  float *lower = C > 0 ? fixed_samples[0] : dynamic_samples.data();
+  float *upper = C > 0 ? fixed_samples[1] : lower + channels;
+  auto sample_level = [&](int l, float sx, float sy, float *sample) {
+    const Image &level = pyramid.levels[l];
+    sample_bilinear<C, S, T>(
+        &level, (sx + 0.5f) * level.width / base.width - 0.5f,
+        (sy + 0.5f) * level.height / base.height - 0.5f, sample);
+  };
+  for (int i = 0; i < n; ++i) {
+    float sx = coords[2 * i];
+    float sy = coords[2 * i + 1];
+    float lod = lods[i / spp];
+    int l = int(lod);
+    float f = lod - l;
+    sample_level(l, sx, sy, lower);
+    if (f > 0.0f) {
+      sample_level(l + 1, sx, sy, upper);
+      for (int c = 0; c < channels; ++c) {
+        lower[c] += f * (upper[c] - lower[c]);
+      }
+    }
+    for (int c = 0; c < channels; ++c) {
+      out[c * n + i] = lower[c];
+    }
+  }
+}
+
+/**
+ * How sample_span samples the input: with batch, or for TRILINEAR with
+ * mip_batch on pyramid, given the mip level of every pixel.
+ */
+struct Sampler {
+  sample_batch_func_t batch{nullptr};
+  sample_mip_batch_func_t mip_batch{nullptr};
+  MipPyramid pyramid;
+};
+
+template <int C, Storage S, typename T>
+Sampler make_sampler(const Image *in, Interpolation im, int num_threads) {
+  Sampler sampler;
+  if (im == TRILINEAR) {
+    sampler.mip_batch = sample_trilinear_batch<C, S, T>;
+    sampler.pyramid = build_mip_pyramid<C, S, T>(in, num_threads);
+  } else {
+    sampler.batch = sample_batch_func<C, S, T>(in, im);
+  }
+  return sampler;
+}
+
+/**
+ * Mip level of each of the n pixels of a row of source coordinates, as
+ * produced by map_row: the log2 of the distance on the input between the
+ * first subsample of a pixel and that of its right and lower neighbours (left
+ * and upper ones at the edges), divided by num_samples. above and below are
+ * the coordinates of the adjacent rows, if any.
+ */
+void mip_lods(const float *row, const float *above, const float *below, int n,
+              int num_samples, int max_level, float *lods) {
+  const size_t pixel_floats = size_t(num_samples) * num_samples * 2;
+  const float *other = below ? below : above;
+  auto distance = [](const float *a, const float *b) {
+    float dx = b[0] - a[0];
+    float dy = b[1] - a[1];
+    return std::sqrt(dx * dx + dy * dy);
+  };
+  for (int i = 0; i < n; ++i) {
+    const float *p = row + i * pixel_floats;
+    float footprint = 0.0f;
+    if (n > 1) {
+      int j = i + 1 < n ? i + 1 : i - 1;
+      footprint = distance(p, row + j * pixel_floats);
+    }
+    if (other) {
+      footprint = std::max(footprint, distance(p, other + i * pixel_floats));
+    }
+    // Also maps NaNs, from points outside of the lenses, to level 0.
+    float lod = std::log2(footprint / num_samples);
+    lods[i] = lod > 0.0f ? std::min(lod, float(max_level)) : 0.0f;
+  }
+}
+
+/**
+ * Mip levels for output row y of tile [y0, y1), with rows of coordinates
+ * stride floats apart, or nullptr if the sampler does not use them.
+ */
+const float *row_lods(const Sampler &sampler, const float *row, size_t stride,
+                      int y, int y0, int y1, int n, int num_samples,
+                      std::vector<float> &lods) {
+  if (!sampler.mip_batch) {
+    return nullptr;
+  }
+  lods.resize(n);
+  mip_lods(row, y > y0 ? row - stride : nullptr,
+           y + 1 < y1 ? row + stride : nullptr, n, num_samples,
+           int(sampler.pyramid.levels.size()) - 1, lods.data());
+  return lods.data();
+}
+
+/**
+ * Samples and averages the subsamples of pixels [x0, x1) of output row y,
+ * given the source coordinates produced by map_row, then applies the optional
+ * transform. samples is scratch space.
+ */
+template <int C>
+void sample_span(const Image *in, Image *out, const Sampler &sampler,
+                int num_samples, int y, int x0, int x1, const float *coords,
+                const float *lods, const OutputTransform *transform,
+                std::vector<float> &samples) {
+  const int channels = C > 0 ? C : out->channels;
+  const int ps = pixel_stride(*out);
+  const size_t cs = channel_stride(*out);
+  float normalize = (1.0f / (num_samples * num_samples));
+  int spp = num_samples * num_samples;
+  int n = (x1 - x0) * spp;
+  samples.resize(size_t(n) * channels);
+  if (sampler.mip_batch) {
+    sampler.mip_batch(sampler.pyramid, coords, lods, spp, n, samples.data());
+  } else {
+    sampler.batch(in, coords, n, samples.data());
+  }
+  const float *thresholds = linear_to_png_thresholds().data();
+
+  for (int x = x0; x < x1; ++x) {
+    size_t dst = (size_t(y) * out->width + x) * ps;
+    const float *src = &samples[(x - x0) * spp];
+    for (int c = 0; c < channels; ++c) {
+      float sample_accumulator = 0.0f;
+      for (int s = 0; s < spp; ++s) {
+        sample_accumulator += src[c * n + s];
+      }
+      float v = sample_accumulator * normalize;
+      if (transform) {
+        if (transform->tonemap && c < 3) {
+          v = reinhard_tonemap(v * transform->scales[c], transform->reinhard);
+        }
+        if (transform->png) {
+          if (c < transform->png_channels) {
+            size_t p = size_t(y) * out->width + x;
+            transform->png[p * transform->png_channels + c] =
+                linear_to_png(v, thresholds);
           }
-          i++;
+          continue;
         }
-        i += img->channels - ch;
       }
+      if (out->format == F16) {
+        out->data_f16[dst + c * cs] = v;
+      } else {
+        out->data[dst + c * cs] = v;
+      }
+    }
+    if (transform && transform->png) {
+      // Channels the image does not have, as written by save_png().
+      for (int c = channels; c < transform->png_channels; ++c) {
+        size_t p = size_t(y) * out->width + x;
+        transform->png[p * transform->png_channels + c] = 0;
+      }
+    }
+  }
+}
+
+/**
+ * Sets pixels [x0, x1) of output row y to the fill value of transform.
+ */
+template <int C>
+void fill_span(Image *out, const OutputTransform *transform, int y, int x0,
+               int x1) {
+  const int channels = C > 0 ? C : out->channels;
+  const int ps = pixel_stride(*out);
+  const size_t cs = channel_stride(*out);
+  const int alpha =
+      out->data_layout == RGBA || out->data_layout == RGBAZ ? 3 : -1;
+  for (int x = x0; x < x1; ++x) {
+    size_t p = size_t(y) * out->width + x;
+    if (transform->png) {
+      const float *thresholds = linear_to_png_thresholds().data();
+      uint8_t fill = std::isnan(transform->fill)
+                         ? 0
+                         : linear_to_png(transform->fill, thresholds);
+      for (int c = 0; c < transform->png_channels; ++c) {
+        transform->png[p * transform->png_channels + c] =
+            c < channels && c != alpha ? fill : 0;
+      }
+      continue;
+    }
+    for (int c = 0; c < channels; ++c) {
+      float v = c == alpha ? 0.0f : transform->fill;
+      if (out->format == F16) {
+        out->data_f16[p * ps + c * cs] = v;
+      } else {
+        out->data[p * ps + c * cs] = v;
+      }
+    }
+  }
+}
+
+/**
+ * Like sample_span, but with coverage (one value per pixel of [x0, x1), see
+ * map_row) and transform->fill_uncovered, uncovered pixels are filled instead
+ * of sampled. lods holds one mip level per pixel for TRILINEAR samplers.
+ */
+template <int C>
+void sample_row(const Image *in, Image *out, const Sampler &sampler,
+                int num_samples, int y, int x0, int x1, const float *coords,
+                const float *lods, const uint8_t *coverage,
+                const OutputTransform *transform,
+                std::vector<float> &samples) {
+  if (!coverage || !transform || !transform->fill_uncovered) {
+    sample_span<C>(in, out, sampler, num_samples, y, x0, x1, coords, lods,
+                   transform, samples);
+    return;
+  }
+  const size_t pixel_floats = size_t(num_samples) * num_samples * 2;
+  int x = x0;
+  while (x < x1) {
+    bool covered = coverage[x - x0];
+    int end = x + 1;
+    while (end < x1 && bool(coverage[end - x0]) == covered) {
+      end++;
     }
-    if ( n % 2 == 0 ) {
-        std::nth_element(values, values + n / 2, values + n);
-        std::nth_element(values, values + (n - 1) / 2, values + n);
-        medians[k] = (values[(n-1)/2] + values[n/2])/2;
+    if (covered) {
+      sample_span<C>(in, out, sampler, num_samples, y, x, end,
+                     coords + (x - x0) * pixel_floats,
+                     lods ? lods + (x - x0) : nullptr, transform, samples);
     } else {
-        std::nth_element(values, values + n / 2, values + n );
-        medians[k] = values[n/2];
+      fill_span<C>(out, transform, y, x, end);
     }
+    x = end;
   }
-    
-  /*
-  // determine per-channel average 
-  float *sums = new float[ch];
-  for (int c = 0; c < ch; ++c) sums[c] = 0;
-  int i = 0;
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      for (int c = 0; c < ch; ++c) {
-        if ( !std::isnan(img->data[i]) ) {
-            sums[c] += img->data[i];
+}
+
+/**
+ * Number of subsamples per dimension for output tile [x0, x1) x [y0, y1) of an
+ * adaptive map. The local scale of the mapping is estimated by finite
+ * differences of the pixel centers, on a grid with a spacing of 8 pixels over
+ * the tile. Subsamples are then spaced at most 1 / quality input pixels apart
+ * along either output axis. Uncovered points do not count.
+ */
+int adaptive_samples(const RowMapper &mapper, int max_samples, float quality,
+                     int x0, int y0, int x1, int y1) {
+  const int step = 8;
+  const int max_points = TILE_SIZE / step + 1;
+  int xs[max_points + 1], ys[max_points + 1];
+  int nx = 0, ny = 0;
+  for (int x = x0; x < x1 - 1; x += step) {
+    xs[nx++] = x;
+  }
+  xs[nx++] = x1 - 1;
+  for (int y = y0; y < y1 - 1; y += step) {
+    ys[ny++] = y;
+  }
+  ys[ny++] = y1 - 1;
+
+  float coords[(max_points + 1) * (max_points + 1)][2];
+  uint8_t covered[(max_points + 1) * (max_points + 1)];
+  for (int j = 0; j < ny; ++j) {
+    for (int i = 0; i < nx; ++i) {
+      mapper(1, ys[j], xs[i], xs[i] + 1, coords[j * nx + i],
+             &covered[j * nx + i]);
+    }
+  }
+
+  // Largest distance on the input between neighbouring output pixels.
+  float scale = 0.0f;
+  auto measure = [&](int a, int b, int pixels) {
+    if (pixels == 0 || !covered[a] || !covered[b]) {
+      return;
+    }
+    float dx = coords[b][0] - coords[a][0];
+    float dy = coords[b][1] - coords[a][1];
+    scale = std::max(scale, std::sqrt(dx * dx + dy * dy) / pixels);
+  };
+  for (int j = 0; j < ny; ++j) {
+    for (int i = 0; i < nx; ++i) {
+      if (i + 1 < nx) {
+        measure(j * nx + i, j * nx + i + 1, xs[i + 1] - xs[i]);
+      }
+      if (j + 1 < ny) {
+        measure(j * nx + i, (j + 1) * nx + i, ys[j + 1] - ys[j]);
+      }
+    }
+  }
+  int n = int(std::ceil(scale * quality - 1e-3f));
+  return clamp(n, 1, max_samples);
+}
+
+// Fixed point tiles of compact maps have steps of at most this many input
+// pixels, so their coordinates are within half of it.
+const float MAX_FIXED_STEP = 1.0f / 128.0f;
+
+/**
+ * Encodes the coordinates of a tile of a compact map as 16-bit fixed point, if
+ * that is accurate to MAX_FIXED_STEP / 2. Coordinates are first clamped to just
+ * beyond the edges of the input, where all interpolation methods sample the
+ * same as further out. Returns whether the tile was encoded.
+ */
+static bool encode_tile(const std::vector<float> &coords, int in_w, int in_h,
+                        TileCoding &coding, std::vector<uint16_t> &fixed) {
+  const float min[2] = {-2.0f, -2.0f};
+  const float max[2] = {in_w + 1.0f, in_h + 1.0f};
+  float lo[2] = {max[0], max[1]};
+  float hi[2] = {min[0], min[1]};
+  for (size_t i = 0; i < coords.size(); ++i) {
+    int a = i & 1;
+    float v = clamp(coords[i], min[a], max[a]);
+    lo[a] = std::min(lo[a], v);
+    hi[a] = std::max(hi[a], v);
+  }
+  coding.fixed = 0;
+  for (int a = 0; a < 2; ++a) {
+    coding.origin[a] = lo[a];
+    coding.step[a] = (hi[a] - lo[a]) / 65535.0f;
+    if (!(coding.step[a] <= MAX_FIXED_STEP)) {
+      return false;
+    }
+  }
+  coding.fixed = 1;
+  fixed.resize(coords.size());
+  for (size_t i = 0; i < coords.size(); ++i) {
+    int a = i & 1;
+    float v = clamp(coords[i], min[a], max[a]);
+    float q = coding.step[a] > 0.0f ? (v - lo[a]) / coding.step[a] : 0.0f;
+    fixed[i] = uint16_t(std::min(std::lround(q), 65535l));
+  }
+  return true;
+}
+
+/**
+ * Decodes count coordinates of a fixed point tile of a compact map.
+ */
+static void decode_tile(const ReprojectionMap &map, int tile, size_t count,
+                        std::vector<float> &coords) {
+  const TileCoding &coding = map.tile_coding[tile];
+  const uint16_t *fixed = map.fixed_coords + map.tile_offsets[tile];
+  coords.resize(count);
+  for (size_t i = 0; i < count; i += 2) {
+    coords[i] = coding.origin[0] + coding.step[0] * fixed[i];
+    coords[i + 1] = coding.origin[1] + coding.step[1] * fixed[i + 1];
+  }
+}
+
+/**
+ * With offsets, in holds the pixels from (in_x0, in_y0) on of a frame in_w x
+ * in_h pixels, and out rows [out_y0, out_y0 + out->height) of a frame out_h
+ * rows high, see reproject_region().
+ */
+template <int C, Storage S, typename T>
+void reproject_from_to(const Image *in, Image *out, int num_samples,
+                       Interpolation im, int num_threads,
+                       const OutputTransform *transform, int in_x0, int in_y0,
+                       int in_w, int in_h, int out_y0, int out_h) {
+  ZoneScoped;
+  RowMapper mapper = make_row_mapper(in->lens, in_w, in_h, out->lens,
+                                     out->width, out_h, false);
+  Sampler sampler = make_sampler<C, S, T>(in, im, num_threads);
+  parallel_for_tiles(
+      out->width, out->height, TILE_SIZE, num_threads,
+      [&](int x0, int y0, int x1, int y1) {
+        // Mip levels depend on the coordinates of the adjacent rows, so then
+        // the whole tile is mapped up front.
+        const int rows = sampler.mip_batch ? y1 - y0 : 1;
+        const size_t row_floats =
+            size_t(x1 - x0) * num_samples * num_samples * 2;
+        std::vector<float> coords(row_floats * rows);
+        std::vector<uint8_t> coverage(size_t(x1 - x0) * rows);
+        std::vector<float> lods, samples;
+        auto map_tile_row = [&](int y, int r) {
+          float *row = &coords[r * row_floats];
+          mapper(num_samples, out_y0 + y, x0, x1, row,
+                 &coverage[r * (x1 - x0)]);
+          // Exact, as the offsets are integers not above the coordinates
+          // that are sampled, so the taps and weights are those of the whole
+          // frame.
+          if (in_x0 != 0 || in_y0 != 0) {
+            for (size_t i = 0; i < row_floats; i += 2) {
+              row[i] -= in_x0;
+              row[i + 1] -= in_y0;
+            }
+          }
+        };
+        if (rows > 1) {
+          for (int y = y0; y < y1; ++y) {
+            map_tile_row(y, y - y0);
+          }
+        }
+        for (int y = y0; y < y1; ++y) {
+          int r = rows > 1 ? y - y0 : 0;
+          if (rows == 1) {
+            map_tile_row(y, 0);
+          }
+          const float *row = &coords[r * row_floats];
+          const float *lod = row_lods(sampler, row, row_floats, y, y0, y1,
+                                      x1 - x0, num_samples, lods);
+          sample_row<C>(in, out, sampler, num_samples, y, x0, x1, row, lod,
+                        &coverage[r * (x1 - x0)], transform, samples);
+        }
+      });
+}
+
+template <int C, Storage S, typename T>
+void reproject_with_map(const Image *in, Image *out, const ReprojectionMap &map,
+                        Interpolation im, int num_threads,
+                        const OutputTransform *transform) {
+  ZoneScoped;
+  Sampler sampler = make_sampler<C, S, T>(in, im, num_threads);
+  size_t pixel_floats = size_t(map.num_samples) * map.num_samples * 2;
+  const bool fill = transform && transform->fill_uncovered;
+  const int tiles_x = (out->width + TILE_SIZE - 1) / TILE_SIZE;
+  parallel_for_tiles(
+      out->width, out->height, TILE_SIZE, num_threads,
+      [&](int x0, int y0, int x1, int y1) {
+        TileCoverage tc = TILE_FULL;
+        if (fill) {
+          tc = map.tile_coverage[(y0 / TILE_SIZE) * tiles_x + x0 / TILE_SIZE];
+        }
+        if (tc == TILE_EMPTY) {
+          for (int y = y0; y < y1; ++y) {
+            fill_span<C>(out, transform, y, x0, x1);
+          }
+          return;
         }
-        i++;
+        int tile = (y0 / TILE_SIZE) * tiles_x + x0 / TILE_SIZE;
+        int num_samples = map.num_samples;
+        const float *coords = nullptr;
+        size_t row_floats = out->width * pixel_floats;
+        std::vector<float> decoded, lods, samples;
+        if (map.tile_offsets) {
+          if (map.tile_samples) {
+            num_samples = map.tile_samples[tile];
+          }
+          row_floats = size_t(x1 - x0) * num_samples * num_samples * 2;
+          if (map.tile_coding && map.tile_coding[tile].fixed) {
+            decode_tile(map, tile, row_floats * (y1 - y0), decoded);
+            coords = decoded.data();
+          } else {
+            coords = &map.coords[map.tile_offsets[tile]];
+          }
+        }
+        for (int y = y0; y < y1; ++y) {
+          size_t p = size_t(y) * out->width + x0;
+          const uint8_t *coverage =
+              tc == TILE_PARTIAL ? &map.coverage[p] : nullptr;
+          const float *row_coords = map.tile_offsets
+                                        ? coords + (y - y0) * row_floats
+                                        : &map.coords[p * pixel_floats];
+          const float *lod =
+              row_lods(sampler, row_coords, row_floats, y, y0, y1, x1 - x0,
+                       num_samples, lods);
+          sample_row<C>(in, out, sampler, num_samples, y, x0, x1, row_coords,
+                        lod, coverage, transform, samples);
+        }
+      });
+}
+
+int num_tiles(const ReprojectionMap &map) {
+  int tiles_x = (map.out_width + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (map.out_height + TILE_SIZE - 1) / TILE_SIZE;
+  return tiles_x * tiles_y;
+}
+
+// Alignment of the arrays within the buffer of a map.
+const size_t MAP_ARRAY_ALIGNMENT = 64;
+
+/**
+ * Lays out the arrays of map one after the other from base, in the order
+ * coords, fixed_coords, tile_offsets, tile_coding, coverage, tile_samples,
+ * tile_coverage. Returns the end offset. Arrays the map does not have are set
+ * to nullptr.
+ */
+static size_t layout_map_arrays(ReprojectionMap &map, uint8_t *base) {
+  size_t tiles = num_tiles(map);
+  size_t pixels = size_t(map.out_width) * map.out_height;
+  bool adaptive = map.adaptive_quality > 0.0f;
+  bool tile_major = adaptive || map.compact;
+  size_t offset = 0;
+  auto place = [&](auto *&array, size_t count) {
+    offset = (offset + MAP_ARRAY_ALIGNMENT - 1) / MAP_ARRAY_ALIGNMENT *
+             MAP_ARRAY_ALIGNMENT;
+    using T = std::remove_reference_t<decltype(*array)>;
+    array = base ? (T *)(base + offset) : nullptr;
+    offset += count * sizeof(T);
+  };
+  place(map.coords, map.num_coords);
+  place(map.fixed_coords, map.compact ? map.num_fixed : 0);
+  place(map.tile_offsets, tile_major ? tiles : 0);
+  place(map.tile_coding, map.compact ? tiles : 0);
+  place(map.coverage, pixels);
+  place(map.tile_samples, adaptive ? tiles : 0);
+  place(map.tile_coverage, tiles);
+  if (!map.compact) {
+    map.fixed_coords = nullptr;
+    map.tile_coding = nullptr;
+  }
+  if (!tile_major) {
+    map.tile_offsets = nullptr;
+  }
+  if (!adaptive) {
+    map.tile_samples = nullptr;
+  }
+  return offset;
+}
+
+size_t map_buffer_size(const ReprojectionMap &map) {
+  ReprojectionMap layout = map;
+  return layout_map_arrays(layout, nullptr);
+}
+
+void set_map_arrays(ReprojectionMap &map, void *base) {
+  layout_map_arrays(map, (uint8_t *)base);
+}
+
+bool map_arrays_valid(const ReprojectionMap &map) {
+  if (map.num_samples < 1) {
+    return false;
+  }
+  if (!map.tile_offsets) {
+    // Rows of num_samples^2 pairs per pixel, divided to avoid overflow.
+    size_t pixel_floats = size_t(map.num_samples) * map.num_samples * 2;
+    return map.num_coords % pixel_floats == 0 &&
+           map.num_coords / pixel_floats ==
+               size_t(map.out_width) * map.out_height;
+  }
+  const int max_samples =
+      map.tile_samples ? std::min(map.num_samples, MAX_ADAPTIVE_SAMPLES)
+                       : map.num_samples;
+  const int tiles_x = (map.out_width + TILE_SIZE - 1) / TILE_SIZE;
+  const int tiles = num_tiles(map);
+  for (int t = 0; t < tiles; ++t) {
+    int x0 = (t % tiles_x) * TILE_SIZE;
+    int y0 = (t / tiles_x) * TILE_SIZE;
+    size_t w = std::min(TILE_SIZE, map.out_width - x0);
+    size_t h = std::min(TILE_SIZE, map.out_height - y0);
+    int n = map.tile_samples ? map.tile_samples[t] : map.num_samples;
+    if (n < 1 || n > max_samples) {
+      return false;
+    }
+    size_t count = w * h * n * n * 2;
+    size_t size = map.tile_coding && map.tile_coding[t].fixed ? map.num_fixed
+                                                              : map.num_coords;
+    if (map.tile_offsets[t] > size || count > size - map.tile_offsets[t]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Allocates the buffer of map for its dimensions and num_coords.
+ */
+static void allocate_map(ReprojectionMap &map) {
+  size_t bytes = map_buffer_size(map);
+  const std::align_val_t alignment{MAP_ARRAY_ALIGNMENT};
+  void *base = ::operator new(bytes, alignment);
+  map.buffer = std::shared_ptr<void>(
+      base, [alignment](void *p) { ::operator delete(p, alignment); });
+  set_map_arrays(map, base);
+}
+
+ReprojectionMap build_reprojection_map(const LensInfo &in_lens, int in_width,
+                                       int in_height, const LensInfo &out_lens,
+                                       int out_width, int out_height,
+                                       int num_samples, int num_threads,
+                                       float adaptive_quality,
+                                       bool fast_lenses, bool compact) {
+  ZoneScoped;
+  if (adaptive_quality > 0.0f && num_samples > MAX_ADAPTIVE_SAMPLES) {
+    throw std::invalid_argument("Adaptive maps support at most " +
+                                std::to_string(MAX_ADAPTIVE_SAMPLES) +
+                                " samples per dimension.");
+  }
+  RowMapper mapper = make_row_mapper(in_lens, in_width, in_height, out_lens,
+                                     out_width, out_height, fast_lenses);
+
+  ReprojectionMap map;
+  map.in_lens = in_lens;
+  map.out_lens = out_lens;
+  map.in_width = in_width;
+  map.in_height = in_height;
+  map.out_width = out_width;
+  map.out_height = out_height;
+  map.num_samples = num_samples;
+  map.adaptive_quality = adaptive_quality;
+  map.fast_lenses = fast_lenses;
+  map.compact = compact;
+
+  int tiles_x = (out_width + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles = num_tiles(map);
+  if (adaptive_quality > 0.0f || compact) {
+    // Only adaptive maps have samples per tile, others have num_samples.
+    std::vector<uint8_t> tile_samples;
+    if (adaptive_quality > 0.0f) {
+      tile_samples.resize(tiles);
+      parallel_for_tiles(
+          out_width, out_height, TILE_SIZE, num_threads,
+          [&](int x0, int y0, int x1, int y1) {
+            tile_samples[(y0 / TILE_SIZE) * tiles_x + x0 / TILE_SIZE] =
+                adaptive_samples(mapper, num_samples, adaptive_quality, x0,
+                                 y0, x1, y1);
+          });
+    }
+
+    // The size of compact tiles is only known once they are encoded, so
+    // tiles are mapped on their own first and then packed into the map.
+    std::vector<std::vector<float>> float_tiles(tiles);
+    std::vector<std::vector<uint16_t>> fixed_tiles(tiles);
+    std::vector<TileCoding> tile_coding(tiles);
+    std::vector<uint8_t> coverage(size_t(out_width) * out_height);
+    parallel_for_tiles(
+        out_width, out_height, TILE_SIZE, num_threads,
+        [&](int x0, int y0, int x1, int y1) {
+          int t = (y0 / TILE_SIZE) * tiles_x + x0 / TILE_SIZE;
+          int n = tile_samples.empty() ? num_samples : tile_samples[t];
+          size_t row_floats = size_t(x1 - x0) * n * n * 2;
+          std::vector<float> &coords = float_tiles[t];
+          coords.resize(row_floats * (y1 - y0));
+          for (int y = y0; y < y1; ++y) {
+            mapper(n, y, x0, x1, &coords[(y - y0) * row_floats],
+                   &coverage[size_t(y) * out_width + x0]);
+          }
+          if (compact &&
+              encode_tile(coords, in_width, in_height, tile_coding[t],
+                          fixed_tiles[t])) {
+            std::vector<float>().swap(coords);
+          }
+        });
+
+    std::vector<uint64_t> tile_offsets(tiles);
+    for (int t = 0; t < tiles; ++t) {
+      if (tile_coding[t].fixed) {
+        tile_offsets[t] = map.num_fixed;
+        map.num_fixed += fixed_tiles[t].size();
+      } else {
+        tile_offsets[t] = map.num_coords;
+        map.num_coords += float_tiles[t].size();
       }
-      i += img->channels - ch;
     }
+    allocate_map(map);
+    if (map.tile_samples) {
+      std::copy(tile_samples.begin(), tile_samples.end(), map.tile_samples);
+    }
+    if (map.tile_coding) {
+      std::copy(tile_coding.begin(), tile_coding.end(), map.tile_coding);
+    }
+    std::copy(tile_offsets.begin(), tile_offsets.end(), map.tile_offsets);
+    std::copy(coverage.begin(), coverage.end(), map.coverage);
+    parallel_for(tiles, num_threads, [&](int t) {
+      if (tile_coding[t].fixed) {
+        std::copy(fixed_tiles[t].begin(), fixed_tiles[t].end(),
+                  map.fixed_coords + tile_offsets[t]);
+      } else {
+        std::copy(float_tiles[t].begin(), float_tiles[t].end(),
+                  map.coords + tile_offsets[t]);
+      }
+    });
+  } else {
+    size_t row_floats = size_t(out_width) * num_samples * num_samples * 2;
+    map.num_coords = row_floats * out_height;
+    allocate_map(map);
+    parallel_for(out_height, num_threads, [&](int y) {
+      mapper(num_samples, y, 0, out_width, &map.coords[y * row_floats],
+             &map.coverage[size_t(y) * out_width]);
+    });
   }
-  double *means = new double[ch];
-  for (int c = 0; c < ch; ++c) means[c] = sums[c]/(img->width*img->height);
-  */
 
-  // simple exposure compensation and white balance:
-  // adjust so that per-channel mean is 0.5
-  double *scales = new double[ch];
-  //for (int c = 0; c < ch; ++c) scales[c] = 0.5/means[c];
-  for (int c = 0; c < ch; ++c) scales[c] = 0.5/medians[c];
+  parallel_for_tiles(
+      out_width, out_height, TILE_SIZE, num_threads,
+      [&](int x0, int y0, int x1, int y1) {
+        size_t covered = 0;
+        for (int y = y0; y < y1; ++y) {
+          for (int x = x0; x < x1; ++x) {
+            covered += map.coverage[size_t(y) * out_width + x];
+          }
+        }
+        TileCoverage &tc =
+            map.tile_coverage[(y0 / TILE_SIZE) * tiles_x + x0 / TILE_SIZE];
+        if (covered == 0) {
+          tc = TILE_EMPTY;
+        } else if (covered == size_t(x1 - x0) * (y1 - y0)) {
+          tc = TILE_FULL;
+        } else {
+          tc = TILE_PARTIAL;
+        }
+      });
+  return map;
+}
+
+bool map_matches(const ReprojectionMap &map, const Image *in, const Image *out,
+                 int num_samples, float adaptive_quality, bool fast_lenses,
+                 bool compact) {
+  return map.num_samples == num_samples &&
+         map.adaptive_quality == adaptive_quality &&
+         map.fast_lenses == fast_lenses && map.compact == compact &&
+         map.in_width == in->width &&
+         map.in_height == in->height && map.out_width == out->width &&
+         map.out_height == out->height && map.in_lens == in->lens &&
+         map.out_lens == out->lens;
+}
+
+ReprojectionMapCache::ReprojectionMapCache(std::string directory)
+    : directory_(std::move(directory)) {}
+
+std::shared_ptr<const ReprojectionMap>
+ReprojectionMapCache::get(const Image *in, const Image *out, int num_samples,
+                          int num_threads, float adaptive_quality,
+                          bool fast_lenses, bool compact) {
+  // Build while holding the lock: concurrent workers asking for the same map
+  // wait for it instead of all building their own copy.
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &map : maps_) {
+    if (map_matches(*map, in, out, num_samples, adaptive_quality, fast_lenses,
+                    compact)) {
+      return map;
+    }
+  }
+  std::string file;
+  if (!directory_.empty()) {
+    file = map_file_name(directory_,
+                         map_key(in->lens, in->width, in->height, out->lens,
+                                 out->width, out->height, num_samples,
+                                 adaptive_quality, fast_lenses, compact));
+    auto map = std::make_shared<ReprojectionMap>();
+    // The key may collide, so the loaded map is checked as well.
+    if (load_reprojection_map(file, *map) &&
+        map_matches(*map, in, out, num_samples, adaptive_quality, fast_lenses,
+                    compact)) {
+      maps_.push_back(map);
+      return map;
+    }
+  }
+  auto map = std::make_shared<ReprojectionMap>(
+      build_reprojection_map(in->lens, in->width, in->height, out->lens,
+                             out->width, out->height, num_samples,
+                             num_threads, adaptive_quality, fast_lenses,
+                             compact));
+  if (!file.empty()) {
+    try {
+      save_reprojection_map(*map, file);
+    } catch (const std::runtime_error &e) {
+      save_error_ = e.what();
+    }
+  }
+  maps_.push_back(map);
+  return map;
+}
+
+std::string ReprojectionMapCache::take_save_error() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string error;
+  error.swap(save_error_);
+  return error;
+}
 
-  i = 0;
-  for (int y = 0; y < img->height; ++y) {
+void check_channels(const Image *in, const Image *out) {
+  if (in->channels != out->channels) {
+    throw std::invalid_argument("Input and output channel count differ.");
+  }
+}
+
+void reproject(const Image *in, Image *out, int num_samples, Interpolation im,
+               int num_threads, const OutputTransform *transform) {
+  check_channels(in, out);
+  with_layout(in, [&](auto c, auto s, auto t) {
+    reproject_from_to<decltype(c)::value, decltype(s)::value,
+                      typename decltype(t)::type>(
+        in, out, num_samples, im, num_threads, transform, 0, 0, in->width,
+        in->height, 0, out->height);
+  });
+}
+
+PixelRect source_region(const LensInfo &in_lens, int in_width, int in_height,
+                        const LensInfo &out_lens, int out_width,
+                        int out_height, int num_samples, bool fill_uncovered,
+                        int out_y0, int out_y1) {
+  ZoneScoped;
+  RowMapper mapper = make_row_mapper(in_lens, in_width, in_height, out_lens,
+                                     out_width, out_height, false);
+  const int spp = num_samples * num_samples;
+  std::vector<float> coords(size_t(out_width) * spp * 2);
+  std::vector<uint8_t> coverage(out_width);
+  float min_x = INFINITY, min_y = INFINITY;
+  float max_x = -INFINITY, max_y = -INFINITY;
+  for (int y = out_y0; y < out_y1; ++y) {
+    mapper(num_samples, y, 0, out_width, coords.data(), coverage.data());
+    for (int x = 0; x < out_width; ++x) {
+      if (fill_uncovered && !coverage[x]) {
+        continue;
+      }
+      for (int s = 0; s < spp; ++s) {
+        float sx = coords[(size_t(x) * spp + s) * 2];
+        float sy = coords[(size_t(x) * spp + s) * 2 + 1];
+        // The kernels clamp to the edges, and sample non-finite coordinates
+        // at the top-left pixel.
+        sx = std::isfinite(sx) ? clamp(sx, 0.0f, in_width - 1.0f) : 0.0f;
+        sy = std::isfinite(sy) ? clamp(sy, 0.0f, in_height - 1.0f) : 0.0f;
+        min_x = std::min(min_x, sx);
+        max_x = std::max(max_x, sx);
+        min_y = std::min(min_y, sy);
+        max_y = std::max(max_y, sy);
+      }
+    }
+  }
+  PixelRect rect{0, 0, 0, 0};
+  if (min_y > max_y) {
+    return rect;
+  }
+  // The taps of the widest kernel, bicubic, reach 1 pixel before and 2 after
+  // the pixel of a coordinate.
+  rect.x0 = std::max(0, int(std::floor(min_x)) - 1);
+  rect.x1 = std::min(in_width, int(std::floor(max_x)) + 3);
+  rect.y0 = std::max(0, int(std::floor(min_y)) - 1);
+  rect.y1 = std::min(in_height, int(std::floor(max_y)) + 3);
+  return rect;
+}
+
+void reproject_region(const Image *in, int in_x0, int in_y0, int in_width,
+                      int in_height, Image *out, int out_y0, int out_height,
+                      int num_samples, Interpolation im, int num_threads,
+                      const OutputTransform *transform) {
+  if (im == TRILINEAR) {
+    throw std::invalid_argument(
+        "Trilinear interpolation needs the whole input frame.");
+  }
+  check_channels(in, out);
+  with_layout(in, [&](auto c, auto s, auto t) {
+    reproject_from_to<decltype(c)::value, decltype(s)::value,
+                      typename decltype(t)::type>(
+        in, out, num_samples, im, num_threads, transform, in_x0, in_y0,
+        in_width, in_height, out_y0, out_height);
+  });
+}
+
+void reproject(const Image *in, Image *out, const ReprojectionMap &map,
+               Interpolation im, int num_threads,
+               const OutputTransform *transform) {
+  if (!map_matches(map, in, out, map.num_samples, map.adaptive_quality,
+                   map.fast_lenses, map.compact)) {
+    throw std::invalid_argument("Reprojection map does not match images.");
+  }
+  check_channels(in, out);
+  with_layout(in, [&](auto c, auto s, auto t) {
+    reproject_with_map<decltype(c)::value, decltype(s)::value,
+                       typename decltype(t)::type>(in, out, map, im,
+                                                   num_threads, transform);
+  });
+}
+
+/**
+ * Maps the bits of a float to an unsigned key with the same ordering as the
+ * float values.
+ */
+static inline uint32_t float_key(float v) {
+  uint32_t u;
+  std::memcpy(&u, &v, sizeof(float));
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+static inline float key_float(uint32_t key) {
+  uint32_t u = (key & 0x80000000u) ? (key & 0x7fffffffu) : ~key;
+  float v;
+  std::memcpy(&v, &u, sizeof(float));
+  return v;
+}
+
+ExposureHistogram::ExposureHistogram()
+    : counts_(size_t(CHANNELS) * BINS, 0), totals_{} {}
+
+template <typename T>
+static void add_rows(const Image *img, int y0, int y1,
+                     const uint8_t *coverage, uint32_t *counts,
+                     uint64_t *totals) {
+  int ch = std::min(img->channels, int(ExposureHistogram::CHANNELS));
+  const int ps = pixel_stride(*img);
+  const size_t cs = channel_stride(*img);
+  const T *data = pixels<T>(*img);
+  for (int y = y0; y < y1; ++y) {
     for (int x = 0; x < img->width; ++x) {
+      if (coverage && !coverage[size_t(y) * img->width + x]) {
+        continue;
+      }
+      size_t i = (size_t(y) * img->width + x) * ps;
       for (int c = 0; c < ch; ++c) {
-        float v = img->data[i];
-        v *= scales[c];
-        v = v * (1.0f + v / (reinhard * reinhard)) / (1.0f + v);
-        img->data[i] = v;
-        i++;
+        float v = data[i + c * cs];
+        if (!std::isnan(v)) {
+          counts[size_t(c) * ExposureHistogram::BINS + (float_key(v) >> 16)]++;
+          totals[c]++;
+        }
       }
-      i += img->channels - ch;
     }
   }
-  //delete [] sums;
-  //delete [] means;
-  delete [] medians;
-  delete [] values;
-  delete [] scales;
 }
 
-void post_process(const Image *img, float exposure, float reinhard) {
+void ExposureHistogram::add(const Image *img, int y0, int y1,
+                            const uint8_t *coverage) {
+  if (img->format == F16) {
+    add_rows<half>(img, y0, y1, coverage, counts_.data(), totals_);
+  } else {
+    add_rows<float>(img, y0, y1, coverage, counts_.data(), totals_);
+  }
+}
+
+void ExposureHistogram::merge(const ExposureHistogram &other) {
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  for (int c = 0; c < CHANNELS; ++c) {
+    totals_[c] += other.totals_[c];
+  }
+}
+
+float ExposureHistogram::value_at_rank(int c, uint64_t rank) const {
+  const uint32_t *counts = &counts_[size_t(c) * BINS];
+  uint64_t below = 0;
+  for (uint32_t b = 0; b < uint32_t(BINS); ++b) {
+    if (below + counts[b] > rank) {
+      // Assume the values are spread evenly over the bin.
+      float lo = key_float(b << 16);
+      float hi = key_float((b << 16) | 0xffffu);
+      if (!std::isfinite(hi) || !std::isfinite(lo)) {
+        return lo;
+      }
+      float t = (float(rank - below) + 0.5f) / float(counts[b]);
+      return lo + (hi - lo) * t;
+    }
+    below += counts[b];
+  }
+  return std::nanf("");
+}
+
+float ExposureHistogram::median(int c) const {
+  uint64_t n = totals_[c];
+  if (n == 0) {
+    return std::nanf("");
+  }
+  if (n % 2 == 0) {
+    return (value_at_rank(c, (n - 1) / 2) + value_at_rank(c, n / 2)) / 2;
+  }
+  return value_at_rank(c, n / 2);
+}
+
+ExposureHistogram exposure_histogram(const Image *img, int num_threads,
+                                     const uint8_t *coverage) {
   ZoneScoped;
+  // One histogram per thread over a band of rows, merged at the end.
+  int num_bands = std::max(1, std::min(num_threads, img->height));
+  ExposureHistogram histogram;
+  std::mutex mutex;
+  parallel_for(num_bands, num_threads, [&](int band) {
+    int y0 = int(int64_t(img->height) * band / num_bands);
+    int y1 = int(int64_t(img->height) * (band + 1) / num_bands);
+    if (num_bands == 1) {
+      histogram.add(img, y0, y1, coverage);
+      return;
+    }
+    ExposureHistogram local;
+    local.add(img, y0, y1, coverage);
+    std::lock_guard<std::mutex> lock(mutex);
+    histogram.merge(local);
+  });
+  return histogram;
+}
+
+/**
+ * Scales the first three channels by scales[c] and applies the Reinhard
+ * tonemap, in parallel over bands of rows.
+ */
+template <typename T>
+void tonemap(const Image *img, const float *scales, float reinhard,
+             int num_threads) {
   int ch = std::min(img->channels, 3);
-  int i = 0;
-  for (int y = 0; y < img->height; ++y) {
-    for (int x = 0; x < img->width; ++x) {
-      for (int c = 0; c < ch; ++c) {
-        float v = img->data[i];
-        v *= exposure;
-        v = v * (1.0f + v / (reinhard * reinhard)) / (1.0f + v);
-        img->data[i] = v;
-        i++;
+  const int ps = pixel_stride(*img);
+  const size_t cs = channel_stride(*img);
+  const int rows_per_band = 16;
+  int num_bands = (img->height + rows_per_band - 1) / rows_per_band;
+  parallel_for(num_bands, num_threads, [&](int band) {
+    size_t p0 = size_t(band) * rows_per_band * img->width;
+    size_t p1 = size_t(std::min(img->height, (band + 1) * rows_per_band)) *
+                img->width;
+    for (int c = 0; c < ch; ++c) {
+      T *plane = pixels<T>(*img) + c * cs;
+      for (size_t i = p0; i < p1; ++i) {
+        float v = plane[i * ps];
+        plane[i * ps] = reinhard_tonemap(v * scales[c], reinhard);
       }
-      i += img->channels - ch;
+    }
+  });
+}
+
+static void tonemap(const Image *img, const float *scales, float reinhard,
+                    int num_threads) {
+  if (img->format == F16) {
+    tonemap<half>(img, scales, reinhard, num_threads);
+  } else {
+    tonemap<float>(img, scales, reinhard, num_threads);
+  }
+}
+
+void exposure_scales(const ExposureHistogram &histogram, float *scales) {
+  // simple exposure compensation and white balance:
+  // adjust so that per-channel median is 0.5
+  for (int c = 0; c < ExposureHistogram::CHANNELS; ++c) {
+    float median = histogram.median(c);
+    scales[c] = 1.0f;
+    if (median > 0.0f && std::isfinite(median)) {
+      scales[c] = 0.5f / median;
     }
   }
 }
 
+void auto_exposure(const Image *img, const ExposureHistogram &histogram,
+                   float reinhard, int num_threads) {
+  ZoneScoped;
+  float scales[3];
+  exposure_scales(histogram, scales);
+  tonemap(img, scales, reinhard, num_threads);
+}
+
+void auto_exposure(const Image *img, float reinhard, int num_threads) {
+  auto_exposure(img, exposure_histogram(img, num_threads), reinhard,
+                num_threads);
+}
+
+void post_process(const Image *img, float exposure, float reinhard,
+                  int num_threads) {
+  ZoneScoped;
+  float scales[3] = {exposure, exposure, exposure};
+  tonemap(img, scales, reinhard, num_threads);
+}
+
+void post_process(const Image *img, const float *scales, float reinhard,
+                  int num_threads) {
+  ZoneScoped;
+  tonemap(img, scales, reinhard, num_threads);
+}
+
 } // namespace reproject
@@ -2,27 +2,348 @@
 
 #include "config.hpp"
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <half.h>
+
 namespace reproject {
 
 enum DataLayout { RGB, RGBA, RGBZ, RGBAZ };
 
+/**
+ * INTERLEAVED stores all channels of a pixel next to each other (RGBRGB...).
+ * PLANAR stores one full width x height plane per channel (RR..GG..BB..).
+ */
+enum Storage { INTERLEAVED, PLANAR };
+
+/**
+ * Element type of the pixel data. F32 images keep their pixels in data, F16
+ * images in data_f16. Kernels accumulate in float either way.
+ */
+enum PixelFormat { F32, F16 };
+
 struct Image {
   LensInfo lens;
   int width, height, channels;
   float *data;
   DataLayout data_layout;
+  Storage storage{INTERLEAVED};
+  PixelFormat format{F32};
+  half *data_f16{nullptr};
+  // Owns data or data_f16 when the image owns its pixels, see
+  // allocate_pixels().
+  std::shared_ptr<void> buffer;
 };
 
+template <typename T> T *pixels(const Image &img);
+template <> inline float *pixels<float>(const Image &img) { return img.data; }
+template <> inline half *pixels<half>(const Image &img) { return img.data_f16; }
+
+inline void *pixel_data(const Image &img) {
+  return img.format == F16 ? (void *)img.data_f16 : (void *)img.data;
+}
+
+inline size_t element_size(const Image &img) {
+  return img.format == F16 ? sizeof(half) : sizeof(float);
+}
+
+inline size_t num_elements(const Image &img) {
+  return size_t(img.width) * img.height * img.channels;
+}
+
+/**
+ * Distance between the values of one channel of two horizontally adjacent
+ * pixels.
+ */
+inline int pixel_stride(const Image &img) {
+  return img.storage == PLANAR ? 1 : img.channels;
+}
+
+/**
+ * Distance between the values of two subsequent channels of one pixel.
+ */
+inline size_t channel_stride(const Image &img) {
+  return img.storage == PLANAR ? size_t(img.width) * img.height : 1;
+}
+
+/**
+ * TRILINEAR samples a mip pyramid of the input, built once per reprojection,
+ * at the level matching the footprint of each output pixel on the input. It
+ * avoids aliasing when minifying without raising the number of samples.
+ */
 enum Interpolation {
   NEAREST,
   BILINEAR,
   BICUBIC,
+  TRILINEAR,
+};
+
+/**
+ * Whether none, some or all pixels of an output tile are covered by the input.
+ */
+enum TileCoverage : uint8_t { TILE_EMPTY, TILE_PARTIAL, TILE_FULL };
+
+/**
+ * Encoding of the coordinates of one tile of a compact map. Fixed tiles store
+ * 16-bit values v for the coordinates origin + step * v, per axis. Others
+ * store floats.
+ */
+struct TileCoding {
+  float origin[2];
+  float step[2];
+  uint32_t fixed;
+};
+
+/**
+ * Source coordinates of every subsample of every output pixel, for one pair of
+ * lenses, image dimensions and sample count. The map does not depend on the
+ * pixel data, so it can be built once and shared by all frames of a batch.
+ *
+ * Adaptive maps (adaptive_quality > 0) pick the number of subsamples per tile
+ * from the local scale of the mapping, up to num_samples per dimension: tiles
+ * where the input is minified get more subsamples than tiles where it is
+ * magnified.
+ *
+ * Maps built with fast_lenses look the mapping up in a table of the radial
+ * scale between the lenses, within 1/256 input pixels of the exact lens
+ * functions, instead of evaluating those for every subsample.
+ *
+ * Compact maps store the coordinates of most tiles as 16-bit fixed point,
+ * within 1/256 input pixels, halving the size of the map.
+ */
+struct ReprojectionMap {
+  LensInfo in_lens, out_lens;
+  int in_width, in_height;
+  int out_width, out_height;
+  int num_samples;
+  float adaptive_quality{0.0f};
+  bool fast_lenses{false};
+  bool compact{false};
+  // (sx, sy) pairs, num_samples^2 per output pixel, rows top to bottom. For
+  // adaptive and compact maps tile by tile instead, starting at tile_offsets,
+  // with tile_samples^2 pairs per pixel and the rows of the tile top to
+  // bottom. Fixed point tiles of compact maps are in fixed_coords.
+  float *coords{nullptr};
+  size_t num_coords{0};
+  uint16_t *fixed_coords{nullptr};
+  size_t num_fixed{0};
+  // Per output tile of adaptive and compact maps, nullptr otherwise.
+  uint64_t *tile_offsets{nullptr};
+  // Per output tile of adaptive maps, nullptr otherwise.
+  uint8_t *tile_samples{nullptr};
+  // Per output tile of compact maps, nullptr otherwise.
+  TileCoding *tile_coding{nullptr};
+  // Per output pixel, whether any of its subsamples lies inside the input
+  // image and the fields of view of both lenses.
+  uint8_t *coverage{nullptr};
+  // Per output tile (see reproject()), row by row.
+  TileCoverage *tile_coverage{nullptr};
+  // Owns the arrays above: a single allocation, or a mapped file (see
+  // load_reprojection_map()) with the same layout.
+  std::shared_ptr<void> buffer;
 };
 
+int num_tiles(const ReprojectionMap &map);
+
+/**
+ * Size in bytes of the buffer holding all arrays of map, given its dimensions,
+ * settings, num_coords and num_fixed.
+ */
+size_t map_buffer_size(const ReprojectionMap &map);
+
+/**
+ * Points the arrays of map into base, which holds map_buffer_size(map) bytes.
+ */
+void set_map_arrays(ReprojectionMap &map, void *base);
+
+/**
+ * Whether the arrays of map, as set by set_map_arrays(), are consistent: the
+ * coordinates of every pixel or tile lie within coords or fixed_coords, and
+ * every tile has between 1 and num_samples samples per dimension. For maps
+ * from files, which may be corrupt.
+ */
+bool map_arrays_valid(const ReprojectionMap &map);
+
+// Most subsamples per dimension of adaptive maps, which store them per tile
+// in a byte.
+const int MAX_ADAPTIVE_SAMPLES = 255;
+
+/**
+ * With adaptive_quality > 0 each tile gets the smallest number of subsamples
+ * per dimension, up to num_samples, that spaces them at most 1 /
+ * adaptive_quality input pixels apart.
+ * @throws std::runtime_error if the lens pair is not supported.
+ * @throws std::invalid_argument if adaptive_quality > 0 and num_samples is
+ * above MAX_ADAPTIVE_SAMPLES.
+ */
+ReprojectionMap build_reprojection_map(const LensInfo &in_lens, int in_width,
+                                       int in_height, const LensInfo &out_lens,
+                                       int out_width, int out_height,
+                                       int num_samples, int num_threads = 1,
+                                       float adaptive_quality = 0.0f,
+                                       bool fast_lenses = false,
+                                       bool compact = false);
+
+bool map_matches(const ReprojectionMap &map, const Image *in, const Image *out,
+                 int num_samples, float adaptive_quality = 0.0f,
+                 bool fast_lenses = false, bool compact = false);
+
+/**
+ * Thread-safe store of reprojection maps. Maps are built on first use and
+ * handed out as shared read-only objects. With a directory, maps are also
+ * kept there between runs (see map_file.hpp): they are memory mapped from it
+ * if present, and written to it after being built otherwise.
+ */
+class ReprojectionMapCache {
+public:
+  explicit ReprojectionMapCache(std::string directory = "");
+
+  std::shared_ptr<const ReprojectionMap> get(const Image *in, const Image *out,
+                                             int num_samples,
+                                             int num_threads = 1,
+                                             float adaptive_quality = 0.0f,
+                                             bool fast_lenses = false,
+                                             bool compact = false);
+
+  /**
+   * Why maps could not be written to the directory since the last call, or
+   * empty. get() still hands those maps out, and builds them again next run.
+   */
+  std::string take_save_error();
+
+private:
+  std::string directory_;
+  std::mutex mutex_;
+  std::string save_error_;
+  std::vector<std::shared_ptr<const ReprojectionMap>> maps_;
+};
+
+/**
+ * Color processing applied to every output pixel while it is produced, such
+ * that the frame does not have to be read back for it.
+ */
+struct OutputTransform {
+  // The first three channels are multiplied by scales[c] and tonemapped, as by
+  // post_process().
+  bool tonemap{false};
+  float scales[3]{1.0f, 1.0f, 1.0f};
+  float reinhard{1.0f};
+  // If set, the pixels are gamma encoded to 8 bits and written to png, with
+  // png_channels interleaved channels, instead of to the pixels of out.
+  uint8_t *png{nullptr};
+  int png_channels{3};
+  // If set, pixels not covered by the input are not sampled, but set to fill
+  // (0 in PNGs) with alpha 0. Otherwise they are sampled clamped to the edge
+  // of the input like all others.
+  bool fill_uncovered{false};
+  float fill{0.0f};
+};
+
+/**
+ * Reprojects in onto out. The output is split in tiles, which num_threads
+ * threads pick up one by one. With a map and fill_uncovered, tiles without
+ * coverage are filled without computing anything.
+ */
 void reproject(const Image *in, Image *out, int num_samples,
-               Interpolation interpolation);
+               Interpolation interpolation, int num_threads = 1,
+               const OutputTransform *transform = nullptr);
+void reproject(const Image *in, Image *out, const ReprojectionMap &map,
+               Interpolation interpolation, int num_threads = 1,
+               const OutputTransform *transform = nullptr);
+
+/**
+ * Pixels [x0, x1) x [y0, y1) of an image.
+ */
+struct PixelRect {
+  int x0, y0, x1, y1;
+
+  bool empty() const { return x0 >= x1 || y0 >= y1; }
+};
+
+/**
+ * Input pixels that reproject_region() samples for output rows [out_y0,
+ * out_y1), with any interpolation but TRILINEAR and with fill_uncovered as in
+ * its transform. Empty if those rows sample nothing, e.g. when all their
+ * pixels are uncovered and filled. Maps the rows to find it.
+ */
+PixelRect source_region(const LensInfo &in_lens, int in_width, int in_height,
+                        const LensInfo &out_lens, int out_width,
+                        int out_height, int num_samples, bool fill_uncovered,
+                        int out_y0, int out_y1);
+
+/**
+ * Like reproject(), for frames that are processed in parts because they do
+ * not fit in memory: in holds the pixels from (in_x0, in_y0) on of an input
+ * frame in_width x in_height pixels, which must include the source_region()
+ * of the rows [out_y0, out_y0 + out->height) of an output frame out_height
+ * rows high that out holds. The result equals that of reproject() on the
+ * whole frames.
+ * @throws std::invalid_argument for TRILINEAR, which needs the whole input.
+ */
+void reproject_region(const Image *in, int in_x0, int in_y0, int in_width,
+                      int in_height, Image *out, int out_y0, int out_height,
+                      int num_samples, Interpolation interpolation,
+                      int num_threads = 1,
+                      const OutputTransform *transform = nullptr);
+
+/**
+ * Per-channel histograms of the first three channels of an image, used to
+ * estimate their medians. Values are binned on the upper 16 bits of their
+ * float representation, so bins are log-spaced and 2^-7 wide relative to their
+ * value. Medians are interpolated within their bin. NaNs are ignored.
+ */
+class ExposureHistogram {
+public:
+  static const int CHANNELS = 3;
+  static const int BINS = 1 << 16;
+
+  ExposureHistogram();
+
+  /** Adds the pixels of rows [y0, y1) of img, optionally masked. */
+  void add(const Image *img, int y0, int y1,
+           const uint8_t *coverage = nullptr);
+  void merge(const ExposureHistogram &other);
+
+  /** NaN if the channel has no values. */
+  float median(int c) const;
+
+private:
+  float value_at_rank(int c, uint64_t rank) const;
+
+  std::vector<uint32_t> counts_;
+  uint64_t totals_[CHANNELS];
+};
+
+/**
+ * Builds the histogram of img in a single pass, using num_threads threads on
+ * bands of rows. If coverage is given, only pixels with a non-zero coverage
+ * value are counted, see ReprojectionMap.
+ */
+ExposureHistogram exposure_histogram(const Image *img, int num_threads = 1,
+                                     const uint8_t *coverage = nullptr);
+
+/**
+ * Scales that bring the median of each color channel to 0.5. Channels without
+ * a positive median get a scale of 1.
+ */
+void exposure_scales(const ExposureHistogram &histogram, float *scales);
 
-void auto_exposure(const Image *img, float reinhard);
-void post_process(const Image *img, float exposure, float reinhard);
+/**
+ * Scales each color channel such that its median becomes 0.5, then applies
+ * the Reinhard tonemap. Channels without a positive median are not scaled.
+ */
+void auto_exposure(const Image *img, float reinhard, int num_threads = 1);
+void auto_exposure(const Image *img, const ExposureHistogram &histogram,
+                   float reinhard, int num_threads = 1);
+void post_process(const Image *img, float exposure, float reinhard,
+                  int num_threads = 1);
+/** Per-channel exposure scales, e.g. shared by a batch of frames. */
+void post_process(const Image *img, const float *scales, float reinhard,
+                  int num_threads = 1);
 
 } // namespace reproject
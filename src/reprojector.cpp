@@ -0,0 +1,82 @@
+#include "reprojector.hpp"
+
+#include <stdexcept>
+
+#include "Tracy.hpp"
+
+namespace reproject {
+
+Reprojector::Reprojector(const ReprojectorOptions &options)
+    : options_(options), maps_(options.map_cache_dir),
+      workers_(std::max(0, options.num_threads - 1)) {
+  if (options.gpu && options.adaptive_quality == 0.0f && gpu_available()) {
+    try {
+      gpu_.reset(new GpuStream());
+    } catch (const std::exception &e) {
+      // The device was found, but its queues or kernels failed.
+      gpu_error_ = e.what();
+    }
+  }
+}
+
+bool Reprojector::uses_gpu(const Image &in, const Image &out) const {
+  return gpu_ && gpu_supports(&in, &out, options_.interpolation);
+}
+
+std::shared_ptr<const ReprojectionMap> Reprojector::map(const Image &in,
+                                                        const Image &out) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Workers::Scope scope(&workers_);
+  return maps_.get(&in, &out, options_.num_samples, options_.num_threads,
+                   options_.adaptive_quality, options_.fast_lenses,
+                   options_.compact_map);
+}
+
+void Reprojector::reproject(const Image &in, Image &out,
+                            const OutputTransform *transform) {
+  ZoneScoped;
+  const bool png = transform != nullptr && transform->png != nullptr;
+  if (pixel_data(in) == nullptr || (!png && pixel_data(out) == nullptr)) {
+    throw std::invalid_argument("Images to reproject need pixels.");
+  }
+  if (in.channels != out.channels || in.storage != out.storage ||
+      in.format != out.format) {
+    throw std::invalid_argument(
+        "Images to reproject differ in channels, storage or format.");
+  }
+  if (uses_gpu(in, out)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gpu_->upload(in);
+    gpu_->reproject(out, options_.num_samples, options_.interpolation,
+                    transform);
+    gpu_->finish();
+    return;
+  }
+  std::shared_ptr<const ReprojectionMap> m = map(in, out);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Workers::Scope scope(&workers_);
+  reproject::reproject(&in, &out, *m, options_.interpolation,
+                       options_.num_threads, transform);
+}
+
+Image image_view(void *pixels, int width, int height, DataLayout layout,
+                 const LensInfo &lens, PixelFormat format, Storage storage) {
+  // clang-format off
+  static const int channels[] = {
+    /* RGB */ 3, /* RGBA */ 4, /* RGBZ */ 4, /* RGBAZ */ 5,
+  };
+  // clang-format on
+  Image img;
+  img.lens = lens;
+  img.width = width;
+  img.height = height;
+  img.channels = channels[layout];
+  img.data_layout = layout;
+  img.storage = storage;
+  img.format = format;
+  img.data = format == F32 ? (float *)pixels : nullptr;
+  img.data_f16 = format == F16 ? (half *)pixels : nullptr;
+  return img;
+}
+
+} // namespace reproject
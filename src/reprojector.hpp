@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "gpu.hpp"
+#include "parallel.hpp"
+#include "reproject.hpp"
+
+namespace reproject {
+
+/**
+ * Settings of a Reprojector, fixed for its lifetime.
+ */
+struct ReprojectorOptions {
+  // Threads reprojecting each frame, including the calling one.
+  int num_threads{1};
+  int num_samples{1};
+  Interpolation interpolation{BICUBIC};
+  // See build_reprojection_map().
+  float adaptive_quality{0.0f};
+  bool fast_lenses{false};
+  bool compact_map{false};
+  // Directory to keep maps in between runs, see ReprojectionMapCache.
+  std::string map_cache_dir;
+  // Reproject on the GPU the images it supports, without maps, see
+  // gpu_supports(). Not with adaptive_quality.
+  bool gpu{false};
+};
+
+/**
+ * Entry point for programs that link the reprojection library and reproject
+ * many frames, like the reproject_server. The map of every pair of lenses and
+ * resolutions is built on first use and kept, and the threads live as long as
+ * the Reprojector, so a frame only costs its sampling. Thread-safe, calls are
+ * serialized.
+ */
+class Reprojector {
+public:
+  explicit Reprojector(const ReprojectorOptions &options = {});
+
+  /**
+   * Reprojects in onto out, of which the caller owns the pixels, see
+   * image_view(). With a transform that writes PNG pixels, out needs none.
+   * @throws std::invalid_argument if the images differ in channels, storage
+   * or format, or lack pixels.
+   */
+  void reproject(const Image &in, Image &out,
+                 const OutputTransform *transform = nullptr);
+
+  /** Whether reproject() of in onto out runs on the GPU, without a map. */
+  bool uses_gpu(const Image &in, const Image &out) const;
+
+  /**
+   * Why the GPU of options.gpu could not be set up, in which case everything
+   * runs on the CPU, or empty.
+   */
+  const std::string &gpu_error() const { return gpu_error_; }
+
+  /** Map from in onto out, built on first use. */
+  std::shared_ptr<const ReprojectionMap> map(const Image &in,
+                                             const Image &out);
+
+  /** See ReprojectionMapCache::take_save_error(). */
+  std::string take_map_save_error() { return maps_.take_save_error(); }
+
+  const ReprojectorOptions &options() const { return options_; }
+
+private:
+  ReprojectorOptions options_;
+  ReprojectionMapCache maps_;
+  std::mutex mutex_;
+  Workers workers_;
+  std::unique_ptr<GpuStream> gpu_;
+  std::string gpu_error_;
+};
+
+/**
+ * Image over caller-owned pixels, which must stay valid while it is used.
+ * Channels follow from the layout.
+ */
+Image image_view(void *pixels, int width, int height, DataLayout layout,
+                 const LensInfo &lens, PixelFormat format = F32,
+                 Storage storage = INTERLEAVED);
+
+} // namespace reproject
@@ -0,0 +1,603 @@
+#include "sample_simd.hpp"
+
+#include "kernel_dispatch.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__))
+#define REPROJECT_SIMD_X86 1
+#include <immintrin.h>
+// The x86 kernels are compiled for their instruction set with function
+// attributes rather than per-file compiler flags, such that no code that can
+// run before the CPU check is built with those instructions.
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define REPROJECT_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace reproject {
+
+namespace {
+
+// Catmull-Rom weights of the four taps around a sample at fraction x, as in
+// cubic_weights() of the scalar kernel:
+//   w0 = 0.5 * (-x + 2x^2 - x^3)
+//   w1 = 0.5 * (2 - 5x^2 + 3x^3)
+//   w2 = 0.5 * (x + 4x^2 - 3x^3)
+//   w3 = 0.5 * (-x^2 + x^3)
+
+typedef void (*sample_step_func_t)(const Image *img, const float *coords,
+                                   float *out, int out_stride);
+
+/**
+ * Runs a kernel that samples LANES positions per step over a batch of n
+ * positions. The remainder is padded to a full step through a scratch buffer.
+ */
+template <int LANES, sample_step_func_t step>
+void run_batched(const Image *img, const float *coords, int n, float *out) {
+  int i = 0;
+  for (; i + LANES <= n; i += LANES) {
+    step(img, coords + 2 * i, out + i, n);
+  }
+  int rest = n - i;
+  if (rest > 0) {
+    float tail_coords[2 * LANES] = {0.0f};
+    std::memcpy(tail_coords, coords + 2 * i, 2 * rest * sizeof(float));
+    std::vector<float> tail_out(LANES * img->channels);
+    step(img, tail_coords, tail_out.data(), LANES);
+    for (int c = 0; c < img->channels; ++c) {
+      std::memcpy(out + c * n + i, &tail_out[c * LANES], rest * sizeof(float));
+    }
+  }
+}
+
+#if REPROJECT_SIMD_X86
+
+// === AVX2 ===
+
+TARGET_AVX2 inline __m256i clamp_avx2(__m256i v, __m256i max) {
+  return _mm256_max_epi32(_mm256_setzero_si256(), _mm256_min_epi32(v, max));
+}
+
+/**
+ * Gathers base[idx] of every lane, where last is the index of the last
+ * element of the buffer, see the half overload.
+ */
+TARGET_AVX2 inline __m256 gather_avx2(const float *base, __m256i idx,
+                                      int /* last */) {
+  return _mm256_i32gather_ps(base, idx, 4);
+}
+
+/**
+ * There is no 16-bit gather: this gathers the aligned 32-bit words holding
+ * the wanted halves, picks the right half of each, and widens with F16C.
+ * The word holding base[last] may reach past the buffer, so lanes of last
+ * are left out of the gather and loaded on their own.
+ */
+TARGET_AVX2 inline __m256 gather_avx2(const half *base, __m256i idx,
+                                      int last) {
+  uintptr_t addr = uintptr_t(base);
+  const int *words = (const int *)(addr & ~uintptr_t(3));
+  __m256i e = _mm256_add_epi32(idx, _mm256_set1_epi32(int(addr & 3) >> 1));
+  __m256i is_last = _mm256_cmpeq_epi32(idx, _mm256_set1_epi32(last));
+  __m256i w = _mm256_mask_i32gather_epi32(
+      _mm256_setzero_si256(), words, _mm256_srli_epi32(e, 1),
+      _mm256_andnot_si256(is_last, _mm256_set1_epi32(-1)), 4);
+  __m256i shift =
+      _mm256_slli_epi32(_mm256_and_si256(e, _mm256_set1_epi32(1)), 4);
+  __m256i h =
+      _mm256_and_si256(_mm256_srlv_epi32(w, shift), _mm256_set1_epi32(0xFFFF));
+  h = _mm256_blendv_epi8(h, _mm256_set1_epi32(base[last].bits()), is_last);
+  __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(h, h),
+                                            _MM_SHUFFLE(3, 1, 2, 0));
+  return _mm256_cvtph_ps(_mm256_castsi256_si128(packed));
+}
+
+TARGET_AVX2 inline __m256 clamp01_avx2(__m256 v) {
+  return _mm256_max_ps(_mm256_setzero_ps(),
+                       _mm256_min_ps(_mm256_set1_ps(1.0f), v));
+}
+
+/**
+ * Loads 8 interleaved (sx, sy) pairs into separate sx and sy vectors.
+ */
+TARGET_AVX2 inline void load_coords_avx2(const float *coords, __m256 &sx,
+                                         __m256 &sy) {
+  __m256 a = _mm256_loadu_ps(coords);
+  __m256 b = _mm256_loadu_ps(coords + 8);
+  // Within 128-bit lanes: x0 x1 x4 x5 | x2 x3 x6 x7, then fix the order.
+  __m256 x = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+  __m256 y = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+  sx = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(x),
+                                              _MM_SHUFFLE(3, 1, 2, 0)));
+  sy = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(y),
+                                              _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+TARGET_AVX2 inline void cubic_weights_avx2(__m256 x, __m256 w[4]) {
+  __m256 half = _mm256_set1_ps(0.5f);
+  __m256 x2 = _mm256_mul_ps(x, x);
+  __m256 x3 = _mm256_mul_ps(x2, x);
+  // clang-format off
+  w[0] = _mm256_mul_ps(half, _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(2.0f), x2), _mm256_add_ps(x, x3)));
+  w[1] = _mm256_mul_ps(half, _mm256_fmadd_ps(_mm256_set1_ps(3.0f), x3, _mm256_fnmadd_ps(_mm256_set1_ps(5.0f), x2, _mm256_set1_ps(2.0f))));
+  w[2] = _mm256_mul_ps(half, _mm256_fmadd_ps(_mm256_set1_ps(-3.0f), x3, _mm256_fmadd_ps(_mm256_set1_ps(4.0f), x2, x)));
+  w[3] = _mm256_mul_ps(half, _mm256_sub_ps(x3, x2));
+  // clang-format on
+}
+
+template <int C, Storage S, typename T>
+TARGET_AVX2 void bilinear_step_avx2(const Image *img, const float *coords,
+                                    float *out, int out_stride) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  __m256i wmax = _mm256_set1_epi32(img->width - 1);
+  __m256i hmax = _mm256_set1_epi32(img->height - 1);
+  __m256i pitch = _mm256_set1_epi32(img->width * ps);
+  __m256i vps = _mm256_set1_epi32(ps);
+  __m256 one = _mm256_set1_ps(1.0f);
+
+  __m256 sx, sy;
+  load_coords_avx2(coords, sx, sy);
+
+  // See sample_bilinear() for why the upper taps are derived from the lower.
+  __m256i ix = _mm256_cvttps_epi32(sx);
+  __m256i iy = _mm256_cvttps_epi32(sy);
+  __m256i ione = _mm256_set1_epi32(1);
+  // clang-format off
+  __m256i lx = clamp_avx2(ix                         , wmax);
+  __m256i ux = clamp_avx2(_mm256_add_epi32(ix, ione), wmax);
+  __m256i ly = clamp_avx2(iy                         , hmax);
+  __m256i uy = clamp_avx2(_mm256_add_epi32(iy, ione), hmax);
+  // clang-format on
+
+  __m256 fx = clamp01_avx2(_mm256_sub_ps(sx, _mm256_cvtepi32_ps(lx)));
+  __m256 fy = clamp01_avx2(_mm256_sub_ps(sy, _mm256_cvtepi32_ps(ly)));
+  __m256 cfx = _mm256_sub_ps(one, fx);
+  __m256 cfy = _mm256_sub_ps(one, fy);
+
+  lx = _mm256_mullo_epi32(lx, vps);
+  ux = _mm256_mullo_epi32(ux, vps);
+  ly = _mm256_mullo_epi32(ly, pitch);
+  uy = _mm256_mullo_epi32(uy, pitch);
+  __m256i ill = _mm256_add_epi32(ly, lx);
+  __m256i ilu = _mm256_add_epi32(ly, ux);
+  __m256i iul = _mm256_add_epi32(uy, lx);
+  __m256i iuu = _mm256_add_epi32(uy, ux);
+
+  for (int c = 0; c < channels; ++c) {
+    const T *base = pixels<T>(*img) + c * cs;
+    int last = int(num_elements(*img) - 1 - c * cs);
+    __m256 ll = gather_avx2(base, ill, last);
+    __m256 lu = gather_avx2(base, ilu, last);
+    __m256 ul = gather_avx2(base, iul, last);
+    __m256 uu = gather_avx2(base, iuu, last);
+
+    __m256 l = _mm256_fmadd_ps(fx, lu, _mm256_mul_ps(cfx, ll));
+    __m256 u = _mm256_fmadd_ps(fx, uu, _mm256_mul_ps(cfx, ul));
+    __m256 r = _mm256_fmadd_ps(fy, u, _mm256_mul_ps(cfy, l));
+    _mm256_storeu_ps(out + c * out_stride, r);
+  }
+}
+
+template <int C, Storage S, typename T>
+TARGET_AVX2 void bicubic_step_avx2(const Image *img, const float *coords,
+                                   float *out, int out_stride) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  __m256i wmax = _mm256_set1_epi32(img->width - 1);
+  __m256i hmax = _mm256_set1_epi32(img->height - 1);
+  __m256i pitch = _mm256_set1_epi32(img->width * ps);
+  __m256i vps = _mm256_set1_epi32(ps);
+
+  __m256 sx, sy;
+  load_coords_avx2(coords, sx, sy);
+
+  __m256i ix = _mm256_cvttps_epi32(sx);
+  __m256i iy = _mm256_cvttps_epi32(sy);
+  __m256i col[4], row[4];
+  for (int k = 0; k < 4; ++k) {
+    __m256i offset = _mm256_set1_epi32(k - 1);
+    col[k] = clamp_avx2(_mm256_add_epi32(ix, offset), wmax);
+    row[k] = clamp_avx2(_mm256_add_epi32(iy, offset), hmax);
+  }
+
+  __m256 wx[4], wy[4];
+  cubic_weights_avx2(clamp01_avx2(_mm256_sub_ps(sx, _mm256_cvtepi32_ps(col[1]))),
+                     wx);
+  cubic_weights_avx2(clamp01_avx2(_mm256_sub_ps(sy, _mm256_cvtepi32_ps(row[1]))),
+                     wy);
+
+  for (int k = 0; k < 4; ++k) {
+    col[k] = _mm256_mullo_epi32(col[k], vps);
+    row[k] = _mm256_mullo_epi32(row[k], pitch);
+  }
+
+  for (int c = 0; c < channels; ++c) {
+    const T *base = pixels<T>(*img) + c * cs;
+    int last = int(num_elements(*img) - 1 - c * cs);
+    __m256 r = _mm256_setzero_ps();
+    for (int j = 0; j < 4; ++j) {
+      __m256 h = _mm256_setzero_ps();
+      for (int i = 0; i < 4; ++i) {
+        __m256 p = gather_avx2(base, _mm256_add_epi32(row[j], col[i]), last);
+        h = _mm256_fmadd_ps(wx[i], p, h);
+      }
+      r = _mm256_fmadd_ps(wy[j], h, r);
+    }
+    _mm256_storeu_ps(out + c * out_stride, r);
+  }
+}
+
+// === AVX-512 ===
+
+TARGET_AVX512 inline __m512i clamp_avx512(__m512i v, __m512i max) {
+  return _mm512_max_epi32(_mm512_setzero_si512(), _mm512_min_epi32(v, max));
+}
+
+TARGET_AVX512 inline __m512 gather_avx512(const float *base, __m512i idx,
+                                          int /* last */) {
+  return _mm512_i32gather_ps(idx, base, 4);
+}
+
+/**
+ * See gather_avx2() for half.
+ */
+TARGET_AVX512 inline __m512 gather_avx512(const half *base, __m512i idx,
+                                          int last) {
+  uintptr_t addr = uintptr_t(base);
+  const int *words = (const int *)(addr & ~uintptr_t(3));
+  __m512i e = _mm512_add_epi32(idx, _mm512_set1_epi32(int(addr & 3) >> 1));
+  __mmask16 is_last = _mm512_cmpeq_epi32_mask(idx, _mm512_set1_epi32(last));
+  __m512i w = _mm512_mask_i32gather_epi32(
+      _mm512_setzero_si512(), __mmask16(~is_last), _mm512_srli_epi32(e, 1),
+      words, 4);
+  __m512i shift =
+      _mm512_slli_epi32(_mm512_and_si512(e, _mm512_set1_epi32(1)), 4);
+  __m512i h =
+      _mm512_and_si512(_mm512_srlv_epi32(w, shift), _mm512_set1_epi32(0xFFFF));
+  h = _mm512_mask_mov_epi32(h, is_last, _mm512_set1_epi32(base[last].bits()));
+  return _mm512_cvtph_ps(_mm512_cvtepi32_epi16(h));
+}
+
+TARGET_AVX512 inline __m512 clamp01_avx512(__m512 v) {
+  return _mm512_max_ps(_mm512_setzero_ps(),
+                       _mm512_min_ps(_mm512_set1_ps(1.0f), v));
+}
+
+TARGET_AVX512 inline void load_coords_avx512(const float *coords, __m512 &sx,
+                                             __m512 &sy) {
+  __m512 a = _mm512_loadu_ps(coords);
+  __m512 b = _mm512_loadu_ps(coords + 16);
+  __m512i even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10,
+                                  8, 6, 4, 2, 0);
+  __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+  sx = _mm512_permutex2var_ps(a, even, b);
+  sy = _mm512_permutex2var_ps(a, odd, b);
+}
+
+TARGET_AVX512 inline void cubic_weights_avx512(__m512 x, __m512 w[4]) {
+  __m512 half = _mm512_set1_ps(0.5f);
+  __m512 x2 = _mm512_mul_ps(x, x);
+  __m512 x3 = _mm512_mul_ps(x2, x);
+  // clang-format off
+  w[0] = _mm512_mul_ps(half, _mm512_sub_ps(_mm512_mul_ps(_mm512_set1_ps(2.0f), x2), _mm512_add_ps(x, x3)));
+  w[1] = _mm512_mul_ps(half, _mm512_fmadd_ps(_mm512_set1_ps(3.0f), x3, _mm512_fnmadd_ps(_mm512_set1_ps(5.0f), x2, _mm512_set1_ps(2.0f))));
+  w[2] = _mm512_mul_ps(half, _mm512_fmadd_ps(_mm512_set1_ps(-3.0f), x3, _mm512_fmadd_ps(_mm512_set1_ps(4.0f), x2, x)));
+  w[3] = _mm512_mul_ps(half, _mm512_sub_ps(x3, x2));
+  // clang-format on
+}
+
+template <int C, Storage S, typename T>
+TARGET_AVX512 void bilinear_step_avx512(const Image *img, const float *coords,
+                                        float *out, int out_stride) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  __m512i wmax = _mm512_set1_epi32(img->width - 1);
+  __m512i hmax = _mm512_set1_epi32(img->height - 1);
+  __m512i pitch = _mm512_set1_epi32(img->width * ps);
+  __m512i vps = _mm512_set1_epi32(ps);
+  __m512 one = _mm512_set1_ps(1.0f);
+
+  __m512 sx, sy;
+  load_coords_avx512(coords, sx, sy);
+
+  __m512i ix = _mm512_cvttps_epi32(sx);
+  __m512i iy = _mm512_cvttps_epi32(sy);
+  __m512i ione = _mm512_set1_epi32(1);
+  // clang-format off
+  __m512i lx = clamp_avx512(ix                         , wmax);
+  __m512i ux = clamp_avx512(_mm512_add_epi32(ix, ione), wmax);
+  __m512i ly = clamp_avx512(iy                         , hmax);
+  __m512i uy = clamp_avx512(_mm512_add_epi32(iy, ione), hmax);
+  // clang-format on
+
+  __m512 fx = clamp01_avx512(_mm512_sub_ps(sx, _mm512_cvtepi32_ps(lx)));
+  __m512 fy = clamp01_avx512(_mm512_sub_ps(sy, _mm512_cvtepi32_ps(ly)));
+  __m512 cfx = _mm512_sub_ps(one, fx);
+  __m512 cfy = _mm512_sub_ps(one, fy);
+
+  lx = _mm512_mullo_epi32(lx, vps);
+  ux = _mm512_mullo_epi32(ux, vps);
+  ly = _mm512_mullo_epi32(ly, pitch);
+  uy = _mm512_mullo_epi32(uy, pitch);
+  __m512i ill = _mm512_add_epi32(ly, lx);
+  __m512i ilu = _mm512_add_epi32(ly, ux);
+  __m512i iul = _mm512_add_epi32(uy, lx);
+  __m512i iuu = _mm512_add_epi32(uy, ux);
+
+  for (int c = 0; c < channels; ++c) {
+    const T *base = pixels<T>(*img) + c * cs;
+    int last = int(num_elements(*img) - 1 - c * cs);
+    __m512 ll = gather_avx512(base, ill, last);
+    __m512 lu = gather_avx512(base, ilu, last);
+    __m512 ul = gather_avx512(base, iul, last);
+    __m512 uu = gather_avx512(base, iuu, last);
+
+    __m512 l = _mm512_fmadd_ps(fx, lu, _mm512_mul_ps(cfx, ll));
+    __m512 u = _mm512_fmadd_ps(fx, uu, _mm512_mul_ps(cfx, ul));
+    __m512 r = _mm512_fmadd_ps(fy, u, _mm512_mul_ps(cfy, l));
+    _mm512_storeu_ps(out + c * out_stride, r);
+  }
+}
+
+template <int C, Storage S, typename T>
+TARGET_AVX512 void bicubic_step_avx512(const Image *img, const float *coords,
+                                       float *out, int out_stride) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  __m512i wmax = _mm512_set1_epi32(img->width - 1);
+  __m512i hmax = _mm512_set1_epi32(img->height - 1);
+  __m512i pitch = _mm512_set1_epi32(img->width * ps);
+  __m512i vps = _mm512_set1_epi32(ps);
+
+  __m512 sx, sy;
+  load_coords_avx512(coords, sx, sy);
+
+  __m512i ix = _mm512_cvttps_epi32(sx);
+  __m512i iy = _mm512_cvttps_epi32(sy);
+  __m512i col[4], row[4];
+  for (int k = 0; k < 4; ++k) {
+    __m512i offset = _mm512_set1_epi32(k - 1);
+    col[k] = clamp_avx512(_mm512_add_epi32(ix, offset), wmax);
+    row[k] = clamp_avx512(_mm512_add_epi32(iy, offset), hmax);
+  }
+
+  __m512 wx[4], wy[4];
+  cubic_weights_avx512(
+      clamp01_avx512(_mm512_sub_ps(sx, _mm512_cvtepi32_ps(col[1]))), wx);
+  cubic_weights_avx512(
+      clamp01_avx512(_mm512_sub_ps(sy, _mm512_cvtepi32_ps(row[1]))), wy);
+
+  for (int k = 0; k < 4; ++k) {
+    col[k] = _mm512_mullo_epi32(col[k], vps);
+    row[k] = _mm512_mullo_epi32(row[k], pitch);
+  }
+
+  for (int c = 0; c < channels; ++c) {
+    const T *base = pixels<T>(*img) + c * cs;
+    int last = int(num_elements(*img) - 1 - c * cs);
+    __m512 r = _mm512_setzero_ps();
+    for (int j = 0; j < 4; ++j) {
+      __m512 h = _mm512_setzero_ps();
+      for (int i = 0; i < 4; ++i) {
+        __m512 p = gather_avx512(base, _mm512_add_epi32(row[j], col[i]),
+                                  last);
+        h = _mm512_fmadd_ps(wx[i], p, h);
+      }
+      r = _mm512_fmadd_ps(wy[j], h, r);
+    }
+    _mm512_storeu_ps(out + c * out_stride, r);
+  }
+}
+
+#endif // REPROJECT_SIMD_X86
+
+#if REPROJECT_SIMD_NEON
+
+// === NEON ===
+// NEON has no gather instruction: tap indices are computed in vectors and the
+// taps are then loaded lane by lane.
+
+inline int32x4_t clamp_neon(int32x4_t v, int32x4_t max) {
+  return vmaxq_s32(vdupq_n_s32(0), vminq_s32(v, max));
+}
+
+inline float32x4_t clamp01_neon(float32x4_t v) {
+  return vmaxq_f32(vdupq_n_f32(0.0f), vminq_f32(vdupq_n_f32(1.0f), v));
+}
+
+inline float32x4_t gather_neon(const float *base, int32x4_t idx) {
+  int32_t i[4];
+  vst1q_s32(i, idx);
+  float v[4] = {base[i[0]], base[i[1]], base[i[2]], base[i[3]]};
+  return vld1q_f32(v);
+}
+
+inline float32x4_t gather_neon(const half *base, int32x4_t idx) {
+  int32_t i[4];
+  vst1q_s32(i, idx);
+  uint16_t v[4] = {base[i[0]].bits(), base[i[1]].bits(), base[i[2]].bits(),
+                   base[i[3]].bits()};
+  return vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(v)));
+}
+
+inline void cubic_weights_neon(float32x4_t x, float32x4_t w[4]) {
+  float32x4_t half = vdupq_n_f32(0.5f);
+  float32x4_t x2 = vmulq_f32(x, x);
+  float32x4_t x3 = vmulq_f32(x2, x);
+  // clang-format off
+  w[0] = vmulq_f32(half, vsubq_f32(vmulq_n_f32(x2, 2.0f), vaddq_f32(x, x3)));
+  w[1] = vmulq_f32(half, vmlaq_n_f32(vmlsq_n_f32(vdupq_n_f32(2.0f), x2, 5.0f), x3, 3.0f));
+  w[2] = vmulq_f32(half, vmlsq_n_f32(vmlaq_n_f32(x, x2, 4.0f), x3, 3.0f));
+  w[3] = vmulq_f32(half, vsubq_f32(x3, x2));
+  // clang-format on
+}
+
+template <int C, Storage S, typename T>
+void bilinear_step_neon(const Image *img, const float *coords, float *out,
+                        int out_stride) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  int32x4_t wmax = vdupq_n_s32(img->width - 1);
+  int32x4_t hmax = vdupq_n_s32(img->height - 1);
+  int32_t pitch = img->width * ps;
+  float32x4_t one = vdupq_n_f32(1.0f);
+
+  float32x4x2_t xy = vld2q_f32(coords);
+  float32x4_t sx = xy.val[0];
+  float32x4_t sy = xy.val[1];
+
+  int32x4_t ix = vcvtq_s32_f32(sx);
+  int32x4_t iy = vcvtq_s32_f32(sy);
+  int32x4_t ione = vdupq_n_s32(1);
+  // clang-format off
+  int32x4_t lx = clamp_neon(ix                 , wmax);
+  int32x4_t ux = clamp_neon(vaddq_s32(ix, ione), wmax);
+  int32x4_t ly = clamp_neon(iy                 , hmax);
+  int32x4_t uy = clamp_neon(vaddq_s32(iy, ione), hmax);
+  // clang-format on
+
+  float32x4_t fx = clamp01_neon(vsubq_f32(sx, vcvtq_f32_s32(lx)));
+  float32x4_t fy = clamp01_neon(vsubq_f32(sy, vcvtq_f32_s32(ly)));
+  float32x4_t cfx = vsubq_f32(one, fx);
+  float32x4_t cfy = vsubq_f32(one, fy);
+
+  lx = vmulq_n_s32(lx, ps);
+  ux = vmulq_n_s32(ux, ps);
+  ly = vmulq_n_s32(ly, pitch);
+  uy = vmulq_n_s32(uy, pitch);
+  int32x4_t ill = vaddq_s32(ly, lx);
+  int32x4_t ilu = vaddq_s32(ly, ux);
+  int32x4_t iul = vaddq_s32(uy, lx);
+  int32x4_t iuu = vaddq_s32(uy, ux);
+
+  for (int c = 0; c < channels; ++c) {
+    const T *base = pixels<T>(*img) + c * cs;
+    float32x4_t ll = gather_neon(base, ill);
+    float32x4_t lu = gather_neon(base, ilu);
+    float32x4_t ul = gather_neon(base, iul);
+    float32x4_t uu = gather_neon(base, iuu);
+
+    float32x4_t l = vmlaq_f32(vmulq_f32(cfx, ll), fx, lu);
+    float32x4_t u = vmlaq_f32(vmulq_f32(cfx, ul), fx, uu);
+    float32x4_t r = vmlaq_f32(vmulq_f32(cfy, l), fy, u);
+    vst1q_f32(out + c * out_stride, r);
+  }
+}
+
+template <int C, Storage S, typename T>
+void bicubic_step_neon(const Image *img, const float *coords, float *out,
+                       int out_stride) {
+  const int channels = C > 0 ? C : img->channels;
+  const int ps = S == PLANAR ? 1 : channels;
+  const size_t cs = S == PLANAR ? size_t(img->width) * img->height : 1;
+  int32x4_t wmax = vdupq_n_s32(img->width - 1);
+  int32x4_t hmax = vdupq_n_s32(img->height - 1);
+  int32_t pitch = img->width * ps;
+
+  float32x4x2_t xy = vld2q_f32(coords);
+  float32x4_t sx = xy.val[0];
+  float32x4_t sy = xy.val[1];
+
+  int32x4_t ix = vcvtq_s32_f32(sx);
+  int32x4_t iy = vcvtq_s32_f32(sy);
+  int32x4_t col[4], row[4];
+  for (int k = 0; k < 4; ++k) {
+    int32x4_t offset = vdupq_n_s32(k - 1);
+    col[k] = clamp_neon(vaddq_s32(ix, offset), wmax);
+    row[k] = clamp_neon(vaddq_s32(iy, offset), hmax);
+  }
+
+  float32x4_t wx[4], wy[4];
+  cubic_weights_neon(clamp01_neon(vsubq_f32(sx, vcvtq_f32_s32(col[1]))), wx);
+  cubic_weights_neon(clamp01_neon(vsubq_f32(sy, vcvtq_f32_s32(row[1]))), wy);
+
+  for (int k = 0; k < 4; ++k) {
+    col[k] = vmulq_n_s32(col[k], ps);
+    row[k] = vmulq_n_s32(row[k], pitch);
+  }
+
+  for (int c = 0; c < channels; ++c) {
+    const T *base = pixels<T>(*img) + c * cs;
+    float32x4_t r = vdupq_n_f32(0.0f);
+    for (int j = 0; j < 4; ++j) {
+      float32x4_t h = vdupq_n_f32(0.0f);
+      for (int i = 0; i < 4; ++i) {
+        float32x4_t p = gather_neon(base, vaddq_s32(row[j], col[i]));
+        h = vmlaq_f32(h, wx[i], p);
+      }
+      r = vmlaq_f32(r, wy[j], h);
+    }
+    vst1q_f32(out + c * out_stride, r);
+  }
+}
+
+#endif // REPROJECT_SIMD_NEON
+
+} // namespace
+
+sample_batch_func_t simd_sample_batch_func(const Image *img,
+                                           Interpolation interpolation) {
+  // Tap offsets within a plane are computed in 32-bit lanes.
+  int64_t elements = int64_t(img->width) * img->height * pixel_stride(*img);
+  if (elements >= std::numeric_limits<int32_t>::max()) {
+    return nullptr;
+  }
+
+#if REPROJECT_SIMD_X86
+  if (__builtin_cpu_supports("avx512f")) {
+    return with_layout(img, [&](auto c, auto s, auto t) -> sample_batch_func_t {
+      constexpr int C = decltype(c)::value;
+      constexpr Storage S = decltype(s)::value;
+      using T = typename decltype(t)::type;
+      if (interpolation == BILINEAR) {
+        return run_batched<16, bilinear_step_avx512<C, S, T>>;
+      } else if (interpolation == BICUBIC) {
+        return run_batched<16, bicubic_step_avx512<C, S, T>>;
+      }
+      return nullptr;
+    });
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+      __builtin_cpu_supports("f16c")) {
+    return with_layout(img, [&](auto c, auto s, auto t) -> sample_batch_func_t {
+      constexpr int C = decltype(c)::value;
+      constexpr Storage S = decltype(s)::value;
+      using T = typename decltype(t)::type;
+      if (interpolation == BILINEAR) {
+        return run_batched<8, bilinear_step_avx2<C, S, T>>;
+      } else if (interpolation == BICUBIC) {
+        return run_batched<8, bicubic_step_avx2<C, S, T>>;
+      }
+      return nullptr;
+    });
+  }
+#elif REPROJECT_SIMD_NEON
+  return with_layout(img, [&](auto c, auto s, auto t) -> sample_batch_func_t {
+    constexpr int C = decltype(c)::value;
+    constexpr Storage S = decltype(s)::value;
+    using T = typename decltype(t)::type;
+    if (interpolation == BILINEAR) {
+      return run_batched<4, bilinear_step_neon<C, S, T>>;
+    } else if (interpolation == BICUBIC) {
+      return run_batched<4, bicubic_step_neon<C, S, T>>;
+    }
+    return nullptr;
+  });
+#endif
+  return nullptr;
+}
+
+} // namespace reproject
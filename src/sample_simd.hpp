@@ -0,0 +1,22 @@
+#pragma once
+
+#include "reproject.hpp"
+
+namespace reproject {
+
+/**
+ * Samples n source positions at once. coords holds n (sx, sy) pairs, and out
+ * receives the samples channel-major: out[c * n + i].
+ */
+typedef void (*sample_batch_func_t)(const Image *img, const float *coords,
+                                    int n, float *out);
+
+/**
+ * Returns the widest vectorized sampling kernel the running CPU supports for
+ * the given image and interpolation method, or nullptr if there is none and
+ * the scalar kernels should be used.
+ */
+sample_batch_func_t simd_sample_batch_func(const Image *img,
+                                           Interpolation interpolation);
+
+} // namespace reproject
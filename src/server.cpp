@@ -0,0 +1,308 @@
+#define CXXOPTS_NO_REGEX 1
+#include <Tracy.hpp>
+#include <cxxopts.hpp>
+
+#include "buffer_pool.hpp"
+#include "config.hpp"
+#include "image_formats.hpp"
+#include "metrics.hpp"
+#include "reprojector.hpp"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+reproject::Interpolation parse_interpolation(const std::string &name) {
+  // clang-format off
+  if (name == "nn") return reproject::NEAREST;
+  if (name == "bl") return reproject::BILINEAR;
+  if (name == "bc") return reproject::BICUBIC;
+  if (name == "tl") return reproject::TRILINEAR;
+  // clang-format on
+  throw std::invalid_argument("Unknown interpolation: " + name);
+}
+
+std::string extension(const std::string &file) {
+  size_t dot = file.rfind('.');
+  return dot == std::string::npos ? "" : file.substr(dot);
+}
+
+/**
+ * Serves requests on one process, such that the reprojection maps, threads
+ * and buffers stay warm between them.
+ */
+class Server {
+public:
+  Server(const reproject::ReprojectorOptions &options,
+         reproject::Storage storage, reproject::PixelFormat format,
+         const reproject::ExrOptions &exr_options,
+         const reproject::PngOptions &png_options)
+      : reprojector_(options), storage_(storage), format_(format),
+        exr_options_(exr_options), png_options_(png_options) {}
+
+  /** See Reprojector::gpu_error(). */
+  const std::string &gpu_error() const { return reprojector_.gpu_error(); }
+
+  /** Handles one request, see the README, and returns its response. */
+  nlohmann::json handle(const nlohmann::json &request) {
+    ZoneScoped;
+    reproject::Stopwatch total;
+    nlohmann::json response;
+    response["id"] = request.value("id", nlohmann::json());
+
+    const std::string input_file = request.at("input").get<std::string>();
+    const std::string output_file = request.at("output").get<std::string>();
+    const nlohmann::json &output_cfg = config(request.at("output_cfg"));
+    reproject::LensInfo input_lens = lens(request.at("input_cfg"));
+    reproject::LensInfo output_lens = lens(output_cfg);
+    const bool png = extension(output_file) == ".png";
+    if (!png && extension(output_file) != ".exr") {
+      throw std::invalid_argument("Unsupported image file: " + output_file);
+    }
+    const nlohmann::json &resolution = output_cfg.at("resolution");
+    const int width = resolution.at(0).get<int>();
+    const int height = resolution.at(1).get<int>();
+    if (width <= 0 || height <= 0) {
+      throw std::invalid_argument("Output resolution must be positive.");
+    }
+
+    reproject::Stopwatch read;
+    reproject::Image input =
+        reproject::read_image(input_file, storage_, format_, &pool_);
+    input.lens = input_lens;
+    response["read_seconds"] = read.seconds();
+
+    reproject::Image output = input;
+    output.buffer = nullptr;
+    output.data = nullptr;
+    output.data_f16 = nullptr;
+    output.lens = output_lens;
+    output.width = width;
+    output.height = height;
+
+    reproject::OutputTransform transform;
+    std::string fill = request.value("fill", "black");
+    if (fill == "nan") {
+      transform.fill = std::nanf("");
+    } else if (fill != "black" && fill != "clamp") {
+      throw std::invalid_argument("Unknown fill mode: " + fill);
+    }
+    transform.fill_uncovered = fill != "clamp";
+    float exposure = std::pow(2.0f, request.value("exposure", 0.0f));
+    float reinhard = request.value("reinhard", 1.0f);
+    if (exposure != 1.0f || reinhard != 1.0f) {
+      transform.tonemap = true;
+      std::fill(transform.scales, transform.scales + 3, exposure);
+      transform.reinhard = reinhard;
+    }
+    // PNGs are gamma encoded while reprojecting, see OutputTransform.
+    std::shared_ptr<uint8_t> png_pixels;
+    if (png) {
+      transform.png_channels = reproject::png_channels(output);
+      png_pixels = pool_.acquire_array<uint8_t>(
+          size_t(output.width) * output.height * transform.png_channels);
+      transform.png = png_pixels.get();
+    } else {
+      reproject::allocate_pixels(output, &pool_);
+    }
+
+    reproject::Stopwatch map_time;
+    if (!reprojector_.uses_gpu(input, output)) {
+      reprojector_.map(input, output);
+    }
+    response["map_seconds"] = map_time.seconds();
+    std::string map_error = reprojector_.take_map_save_error();
+    if (!map_error.empty()) {
+      std::fprintf(stderr, "Warning: %s\n", map_error.c_str());
+      response["warning"] = map_error;
+    }
+    reproject::Stopwatch process;
+    reprojector_.reproject(input, output, &transform);
+    response["reproject_seconds"] = process.seconds();
+    input = reproject::Image{};
+
+    reproject::Stopwatch write;
+    if (png) {
+      reproject::save_png(png_pixels.get(), output.width, output.height,
+                          transform.png_channels, output_file, png_options_);
+    } else {
+      reproject::save_exr(output, output_file, exr_options_);
+    }
+    response["write_seconds"] = write.seconds();
+
+    response["ok"] = true;
+    response["width"] = output.width;
+    response["height"] = output.height;
+    response["seconds"] = total.seconds();
+    return response;
+  }
+
+private:
+  /** A config given inline, or the file it is in, read once. */
+  const nlohmann::json &config(const nlohmann::json &cfg) {
+    if (!cfg.is_string()) {
+      return cfg;
+    }
+    std::string file = cfg.get<std::string>();
+    auto it = configs_.find(file);
+    if (it == configs_.end()) {
+      std::ifstream in(file);
+      nlohmann::json parsed;
+      if (!(in >> parsed)) {
+        throw std::invalid_argument("Cannot read config " + file);
+      }
+      it = configs_.emplace(file, parsed).first;
+    }
+    return it->second;
+  }
+
+  reproject::LensInfo lens(const nlohmann::json &cfg) {
+    return reproject::extract_lens_info_from_config(config(cfg));
+  }
+
+  reproject::Reprojector reprojector_;
+  reproject::BufferPool pool_;
+  std::map<std::string, nlohmann::json> configs_;
+  reproject::Storage storage_;
+  reproject::PixelFormat format_;
+  reproject::ExrOptions exr_options_;
+  reproject::PngOptions png_options_;
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  // clang-format off
+  cxxopts::Options options(argv[0],
+    "Reprojection server. Reads one JSON request per line from stdin and\n"
+    "writes one JSON response per line to stdout, keeping reprojection\n"
+    "maps, threads and buffers between requests.");
+  options.add_options("Reprojection")
+    ("s,samples", "Number of samples per dimension for interpolating",
+     cxxopts::value<int>()->default_value("1"), "number")
+    ("interpolation", "Interpolation method: nn, bl, bc or tl.",
+     cxxopts::value<std::string>()->default_value("bc"), "method")
+    ("adaptive-quality", "Pick the number of samples per tile like "
+     "--adaptive of reproject, with this quality. 0 disables it.",
+     cxxopts::value<float>()->default_value("0"), "factor")
+    ("fast-math", "Map pixels through a table of the radial scale between "
+     "the lenses.")
+    ("compact-map", "Store the source coordinates of most tiles as 16-bit "
+     "fixed point.")
+    ("map-cache", "Directory to keep reprojection maps in between runs.",
+     cxxopts::value<std::string>(), "dir")
+    ("planar", "Keep images in memory as one plane per channel.")
+    ("half", "Keep images in memory as 16-bit floats.")
+    ("gpu", "Reproject on the GPU, see the README. Not with "
+     "--adaptive-quality.")
+    ;
+  options.add_options("Runtime")
+    ("j,threads", "Number of threads reprojecting each image.",
+     cxxopts::value<int>()->default_value("1"), "threads")
+    ("exr-threads", "Number of threads OpenEXR uses to compress and "
+     "decompress.",
+     cxxopts::value<int>()->default_value("0"), "threads")
+    ("exr-compression", "Compression of output EXR files: none, zips, zip, "
+     "piz or dwaa.",
+     cxxopts::value<std::string>()->default_value("zip"), "type")
+    ("h,help", "Show help")
+    ;
+  // clang-format on
+
+  reproject::ReprojectorOptions reprojector_options;
+  reproject::Storage storage = reproject::INTERLEAVED;
+  reproject::PixelFormat format = reproject::F32;
+  reproject::ExrOptions exr_options;
+  reproject::PngOptions png_options;
+  try {
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+      std::printf("%s\n", options.help().c_str());
+      return 0;
+    }
+    reprojector_options.num_samples = result["samples"].as<int>();
+    reprojector_options.interpolation =
+        parse_interpolation(result["interpolation"].as<std::string>());
+    reprojector_options.adaptive_quality =
+        result["adaptive-quality"].as<float>();
+    reprojector_options.fast_lenses = result.count("fast-math") > 0;
+    reprojector_options.compact_map = result.count("compact-map") > 0;
+    if (result.count("map-cache")) {
+      reprojector_options.map_cache_dir =
+          result["map-cache"].as<std::string>();
+    }
+    reprojector_options.num_threads = result["threads"].as<int>();
+    if (reprojector_options.num_threads < 1 ||
+        reprojector_options.num_samples < 1) {
+      throw std::invalid_argument(
+          "--threads and --samples must be at least 1.");
+    }
+    if (reprojector_options.adaptive_quality > 0.0f &&
+        reprojector_options.num_samples > reproject::MAX_ADAPTIVE_SAMPLES) {
+      throw std::invalid_argument(
+          "--adaptive-quality supports at most " +
+          std::to_string(reproject::MAX_ADAPTIVE_SAMPLES) + " --samples.");
+    }
+    if (result.count("gpu")) {
+      reprojector_options.gpu = reproject::gpu_available();
+      if (!reprojector_options.gpu) {
+        std::fprintf(stderr,
+                     "Warning: No OpenCL GPU found, reprojecting on the "
+                     "CPU.\n");
+      }
+    }
+    if (result.count("planar")) {
+      storage = reproject::PLANAR;
+    }
+    if (result.count("half")) {
+      format = reproject::F16;
+    }
+    reproject::set_exr_threads(result["exr-threads"].as<int>());
+    exr_options.compression = reproject::parse_exr_compression(
+        result["exr-compression"].as<std::string>());
+  } catch (const cxxopts::OptionException &e) {
+    std::fprintf(stderr, "%s\n\n%s\n", e.what(), options.help().c_str());
+    return 1;
+  } catch (const std::invalid_argument &e) {
+    std::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+
+  // Responses are the lines on stdout, messages go to stderr.
+  Server server(reprojector_options, storage, format, exr_options,
+                png_options);
+  if (!server.gpu_error().empty()) {
+    std::fprintf(stderr, "Warning: %s\n", server.gpu_error().c_str());
+    std::fprintf(stderr,
+                 "Warning: No OpenCL GPU found, reprojecting on the CPU.\n");
+  }
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    nlohmann::json response;
+    try {
+      nlohmann::json request = nlohmann::json::parse(line);
+      response = server.handle(request);
+    } catch (const std::exception &e) {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      response = {{"ok", false}, {"error", e.what()}};
+      try {
+        response["id"] = nlohmann::json::parse(line).value("id",
+                                                           nlohmann::json());
+      } catch (const std::exception &) {
+        // Not JSON, no id to echo.
+      }
+    }
+    std::printf("%s\n", response.dump().c_str());
+    std::fflush(stdout);
+  }
+  return 0;
+}